@@ -7,6 +7,9 @@
 #include <linux/mutex.h>
 #include <linux/list.h>
 #include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <linux/crc32c.h>
 
 static int default_capacity = 16;
 module_param(default_capacity, int, 0644);
@@ -16,6 +19,18 @@ static int enable_auto_resize = 0;
 module_param(enable_auto_resize, int, 0644);
 MODULE_PARM_DESC(enable_auto_resize, "Enable automatic resizing when buffer is full (0=disabled, 1=enabled)");
 
+static char *checkpoint_path = "";
+module_param(checkpoint_path, charp, 0444);
+MODULE_PARM_DESC(checkpoint_path, "Backing file restored at load and checkpointed in the background (empty=disabled)");
+
+static int checkpoint_interval_ms = 1000;
+module_param(checkpoint_interval_ms, int, 0444);
+MODULE_PARM_DESC(checkpoint_interval_ms, "Milliseconds between checkpoints, bounding what a crash can lose");
+
+static int checkpoint_chunk = 1024;
+module_param(checkpoint_chunk, int, 0444);
+MODULE_PARM_DESC(checkpoint_chunk, "Elements per dirty-tracking chunk of the checkpointer");
+
 #define INT_BUFFER_MAGIC 's'
 #define INT_STACK_SET_MAX_SIZE _IOW(INT_BUFFER_MAGIC, 1, int)
 #define CMD_GET_CAPACITY _IOR(INT_BUFFER_MAGIC, 2, int)
@@ -39,6 +54,64 @@ struct integer_buffer {
 
 static struct integer_buffer *dev_buffer;
 
+/*
+ * Backing file layout: a header in the first block, then element i at
+ * CHECKPOINT_DATA_OFFSET + i * sizeof(int). A checkpoint does not touch
+ * that data until the chunks dirtied since the previous one and the new
+ * header are durable in an intent log behind it, described by a
+ * checkpoint_log in the header block. A crash while the log is written
+ * leaves the previous checkpoint intact; one while it is applied in place
+ * is finished from the log at the next load. Both the header and the log
+ * carry a CRC32C.
+ */
+#define CHECKPOINT_MAGIC       0x4b504349 /* "ICPK" */
+#define CHECKPOINT_VERSION     1
+#define CHECKPOINT_LOG_MAGIC   0x474c5049 /* "IPLG" */
+#define CHECKPOINT_LOG_OFFSET  2048
+#define CHECKPOINT_DATA_OFFSET 4096
+
+/* crc covers the other fields, with crc itself 0 */
+struct checkpoint_header {
+    u32 magic;
+    u32 version;
+    u64 depth;
+    u64 capacity;
+    u64 generation;
+    u32 crc;
+    u32 reserved;
+};
+
+/*
+ * The log at offset holds count u64 chunk indices, then the elements of
+ * each of those chunks that are below header.depth; crc covers this
+ * struct, with crc itself 0, and those size bytes.
+ */
+struct checkpoint_log {
+    u32 magic;
+    u32 chunk;
+    u64 count;
+    u64 offset;
+    u64 size;
+    struct checkpoint_header header;
+    u32 crc;
+    u32 reserved;
+};
+
+/* dirty and header_dirty are protected by op_lock */
+struct checkpointer {
+    struct file *file;
+    unsigned long *dirty;
+    size_t chunks;
+    bool header_dirty;
+    u64 generation;
+    /* Capacity in the header on disk, which bounds its data region */
+    u64 disk_capacity;
+    u64 chunks_written;
+    struct delayed_work work;
+};
+
+static struct checkpointer checkpoint;
+
 static int buffer_open(struct inode *inode, struct file *file)
 {
     return 0;
@@ -49,12 +122,51 @@ static int buffer_release(struct inode *inode, struct file *file)
     return 0;
 }
 
+/* Resizes the dirty map along with the stack; indices keep their chunk */
+static int resize_dirty_map(size_t new_capacity)
+{
+    size_t chunks = DIV_ROUND_UP(new_capacity, checkpoint_chunk);
+    unsigned long *dirty;
+    
+    if (!checkpoint.file)
+        return 0;
+    
+    dirty = bitmap_zalloc(chunks, GFP_KERNEL);
+    if (!dirty)
+        return -ENOMEM;
+    
+    if (checkpoint.dirty)
+        bitmap_copy(dirty, checkpoint.dirty, min(chunks, checkpoint.chunks));
+    bitmap_free(checkpoint.dirty);
+    checkpoint.dirty = dirty;
+    checkpoint.chunks = chunks;
+    checkpoint.header_dirty = true;
+    
+    return 0;
+}
+
+static void mark_dirty(size_t index)
+{
+    if (!checkpoint.file)
+        return;
+    
+    __set_bit(index / checkpoint_chunk, checkpoint.dirty);
+    checkpoint.header_dirty = true;
+}
+
+static void mark_depth_changed(void)
+{
+    checkpoint.header_dirty = true;
+}
+
 static int resize_buffer(size_t new_capacity)
 {
     int *new_array;
     size_t copy_size;
     
     if (new_capacity == 0) {
+        if (resize_dirty_map(0) < 0)
+            return -ENOMEM;
         if (dev_buffer->elements) {
             kfree(dev_buffer->elements);
             dev_buffer->elements = NULL;
@@ -67,18 +179,23 @@ static int resize_buffer(size_t new_capacity)
     new_array = kzalloc(sizeof(int) * new_capacity, GFP_KERNEL);
     if (!new_array)
         return -ENOMEM;
+    
+    if (resize_dirty_map(new_capacity) < 0) {
+        kfree(new_array);
+        return -ENOMEM;
+    }
         
     if (dev_buffer->elements && dev_buffer->position > 0) {
         copy_size = min(dev_buffer->position, new_capacity);
         memcpy(new_array, dev_buffer->elements, sizeof(int) * copy_size);
         
-        kfree(dev_buffer->elements);
-        
         dev_buffer->position = copy_size;
     } else {
         dev_buffer->position = 0;
     }
     
+    kfree(dev_buffer->elements);
+    
     dev_buffer->elements = new_array;
     dev_buffer->capacity = new_capacity;
     
@@ -121,6 +238,7 @@ static long buffer_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         
     case CMD_CLEAR_BUFFER:
         dev_buffer->position = 0;
+        mark_depth_changed();
         break;
         
     default:
@@ -158,6 +276,7 @@ static ssize_t buffer_read(struct file *file, char __user *user_buffer,
     }
     
     atomic_inc(&dev_buffer->stats.pop_count);
+    mark_depth_changed();
     mutex_unlock(&dev_buffer->op_lock);
     
     return sizeof(int);
@@ -194,6 +313,7 @@ static ssize_t buffer_write(struct file *file, const char __user *user_buffer,
         }
     }
     
+    mark_dirty(dev_buffer->position);
     dev_buffer->elements[dev_buffer->position++] = value;
     atomic_inc(&dev_buffer->stats.push_count);
     
@@ -226,6 +346,384 @@ static void init_stats(struct buffer_stats *stats)
     atomic_set(&stats->underflow_count, 0);
 }
 
+/*
+ * kernel_read() and kernel_write() stop at MAX_RW_COUNT, so both loop.
+ * Reading past the end of the file is -ENODATA.
+ */
+static int checkpoint_read(void *buf, size_t len, loff_t pos)
+{
+    ssize_t bytes;
+    
+    while (len > 0) {
+        bytes = kernel_read(checkpoint.file, buf, len, &pos);
+        if (bytes <= 0)
+            return bytes < 0 ? bytes : -ENODATA;
+        buf += bytes;
+        len -= bytes;
+    }
+    
+    return 0;
+}
+
+static int checkpoint_write(const void *buf, size_t len, loff_t pos)
+{
+    ssize_t bytes;
+    
+    while (len > 0) {
+        bytes = kernel_write(checkpoint.file, buf, len, &pos);
+        if (bytes <= 0)
+            return bytes < 0 ? bytes : -EIO;
+        buf += bytes;
+        len -= bytes;
+    }
+    
+    return 0;
+}
+
+static u32 header_crc(const struct checkpoint_header *header)
+{
+    struct checkpoint_header copy = *header;
+    
+    copy.crc = 0;
+    return ~crc32c(~0U, &copy, sizeof(copy));
+}
+
+static bool header_valid(const struct checkpoint_header *header)
+{
+    return header->magic == CHECKPOINT_MAGIC &&
+           header->version == CHECKPOINT_VERSION &&
+           header->crc == header_crc(header) &&
+           header->depth <= header->capacity && header->capacity <= INT_MAX;
+}
+
+/* Elements of chunk @index that a checkpoint of @depth elements saves */
+static size_t chunk_elements(u64 index, size_t chunk, u64 depth)
+{
+    u64 start = index * chunk;
+    
+    return start < depth ? min_t(u64, chunk, depth - start) : 0;
+}
+
+/* The log goes behind the data region of both the old and the new header */
+static loff_t log_offset(u64 capacity)
+{
+    return round_up(CHECKPOINT_DATA_OFFSET +
+                    max(checkpoint.disk_capacity, capacity) * sizeof(int), 4096);
+}
+
+/* Writes the logged chunks and the header in place */
+static int apply_log(const struct checkpoint_header *header, const u64 *indices,
+                     const int *data, size_t count, size_t chunk)
+{
+    size_t i, len;
+    int result;
+    
+    for (i = 0; i < count; i++) {
+        len = chunk_elements(indices[i], chunk, header->depth);
+        result = checkpoint_write(data, len * sizeof(int),
+                                  CHECKPOINT_DATA_OFFSET + indices[i] * chunk * sizeof(int));
+        if (result < 0)
+            return result;
+        data += len;
+    }
+    
+    result = checkpoint_write(header, sizeof(*header), 0);
+    if (result == 0)
+        result = vfs_fsync(checkpoint.file, 1);
+    return result;
+}
+
+/*
+ * Copies the dirty chunks below the current depth under op_lock, then
+ * logs and applies them without holding it. Cost is proportional to
+ * what changed since the previous checkpoint.
+ */
+static int write_checkpoint(void)
+{
+    struct checkpoint_log log;
+    struct checkpoint_header *header = &log.header;
+    size_t chunk = checkpoint_chunk;
+    u64 *indices;
+    int *staging;
+    size_t count, n = 0, used = 0, len, i;
+    unsigned long bit;
+    u32 crc;
+    int result;
+    
+    mutex_lock(&dev_buffer->op_lock);
+    
+    if (!checkpoint.header_dirty) {
+        mutex_unlock(&dev_buffer->op_lock);
+        return 0;
+    }
+    
+    count = bitmap_weight(checkpoint.dirty, checkpoint.chunks);
+    indices = kvmalloc_array(max_t(size_t, count, 1), sizeof(*indices), GFP_KERNEL);
+    staging = kvmalloc_array(max_t(size_t, count, 1), chunk * sizeof(int), GFP_KERNEL);
+    if (!indices || !staging) {
+        mutex_unlock(&dev_buffer->op_lock);
+        kvfree(indices);
+        kvfree(staging);
+        return -ENOMEM;
+    }
+    
+    memset(&log, 0, sizeof(log));
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->depth = dev_buffer->position;
+    header->capacity = dev_buffer->capacity;
+    header->generation = checkpoint.generation + 1;
+    header->crc = header_crc(header);
+    
+    /* Chunks above the depth hold nothing worth saving */
+    for_each_set_bit(bit, checkpoint.dirty, checkpoint.chunks) {
+        len = chunk_elements(bit, chunk, header->depth);
+        if (len == 0)
+            break;
+        memcpy(staging + used, dev_buffer->elements + bit * chunk, len * sizeof(int));
+        used += len;
+        indices[n++] = bit;
+    }
+    bitmap_zero(checkpoint.dirty, checkpoint.chunks);
+    checkpoint.header_dirty = false;
+    
+    mutex_unlock(&dev_buffer->op_lock);
+    
+    log.magic = CHECKPOINT_LOG_MAGIC;
+    log.chunk = chunk;
+    log.count = n;
+    log.offset = log_offset(header->capacity);
+    log.size = n * sizeof(*indices) + used * sizeof(int);
+    crc = crc32c(~0U, &log, sizeof(log));
+    crc = crc32c(crc, indices, n * sizeof(*indices));
+    log.crc = ~crc32c(crc, staging, used * sizeof(int));
+    
+    /* Nothing in place is overwritten before the log is durable */
+    result = checkpoint_write(indices, n * sizeof(*indices), log.offset);
+    if (result == 0)
+        result = checkpoint_write(staging, used * sizeof(int),
+                                  log.offset + n * sizeof(*indices));
+    if (result == 0)
+        result = checkpoint_write(&log, sizeof(log), CHECKPOINT_LOG_OFFSET);
+    if (result == 0)
+        result = vfs_fsync(checkpoint.file, 1);
+    if (result == 0)
+        result = apply_log(header, indices, staging, n, chunk);
+    
+    mutex_lock(&dev_buffer->op_lock);
+    if (result == 0) {
+        checkpoint.generation = header->generation;
+        checkpoint.disk_capacity = header->capacity;
+        checkpoint.chunks_written += n;
+    } else {
+        /* Retry everything that was taken out of the dirty map */
+        for (i = 0; i < n; i++) {
+            if (indices[i] < checkpoint.chunks)
+                __set_bit(indices[i], checkpoint.dirty);
+        }
+        checkpoint.header_dirty = true;
+    }
+    mutex_unlock(&dev_buffer->op_lock);
+    
+    kvfree(indices);
+    kvfree(staging);
+    return result;
+}
+
+static void checkpoint_work_fn(struct work_struct *work)
+{
+    int result = write_checkpoint();
+    
+    if (result < 0)
+        printk(KERN_WARNING "int_stack: checkpoint to %s failed: %d\n",
+               checkpoint_path, result);
+    
+    schedule_delayed_work(&checkpoint.work, msecs_to_jiffies(checkpoint_interval_ms));
+}
+
+/*
+ * Finishes a checkpoint whose log is intact but that may not have been
+ * applied. Returns 1 if @header was replaced by the log's, 0 if there
+ * was nothing to do.
+ */
+static int replay_log(struct checkpoint_header *header, bool header_ok)
+{
+    struct checkpoint_log log;
+    u64 *indices = NULL;
+    int *data;
+    size_t i, elements = 0;
+    u32 crc, expected;
+    int result;
+    
+    result = checkpoint_read(&log, sizeof(log), CHECKPOINT_LOG_OFFSET);
+    if (result < 0)
+        return result == -ENODATA ? 0 : result;
+    
+    /* A log the header already reflects, or a torn or foreign one */
+    if (log.magic != CHECKPOINT_LOG_MAGIC || !header_valid(&log.header) ||
+        (header_ok && log.header.generation != header->generation + 1))
+        return 0;
+    if (log.chunk == 0 ||
+        log.count > DIV_ROUND_UP(log.header.capacity, log.chunk) ||
+        log.size < log.count * sizeof(u64) ||
+        log.size > log.count * (sizeof(u64) + log.chunk * sizeof(int)) ||
+        log.offset < CHECKPOINT_DATA_OFFSET + log.header.capacity * sizeof(int))
+        return 0;
+    
+    indices = kvmalloc(max_t(size_t, log.size, 1), GFP_KERNEL);
+    if (!indices)
+        return -ENOMEM;
+    result = checkpoint_read(indices, log.size, log.offset);
+    if (result < 0) {
+        /* The log ends the file, so a short one was never completed */
+        if (result == -ENODATA)
+            result = 0;
+        goto out;
+    }
+    
+    expected = log.crc;
+    log.crc = 0;
+    crc = crc32c(~0U, &log, sizeof(log));
+    if (~crc32c(crc, indices, log.size) != expected) {
+        result = 0;
+        goto out;
+    }
+    
+    for (i = 0; i < log.count; i++) {
+        if (indices[i] >= DIV_ROUND_UP(log.header.capacity, log.chunk)) {
+            result = 0;
+            goto out;
+        }
+        elements += chunk_elements(indices[i], log.chunk, log.header.depth);
+    }
+    if (elements * sizeof(int) != log.size - log.count * sizeof(u64)) {
+        result = 0;
+        goto out;
+    }
+    
+    data = (int *)(indices + log.count);
+    result = apply_log(&log.header, indices, data, log.count, log.chunk);
+    if (result == 0) {
+        printk(KERN_INFO "int_stack: finished interrupted checkpoint %llu\n",
+               log.header.generation);
+        *header = log.header;
+        result = 1;
+    }
+    
+out:
+    kvfree(indices);
+    return result;
+}
+
+/* Called with op_lock held; an empty file is a fresh checkpoint */
+static int restore_checkpoint(void)
+{
+    struct checkpoint_header header;
+    loff_t pos = 0;
+    ssize_t bytes;
+    bool header_ok;
+    int result;
+    
+    bytes = kernel_read(checkpoint.file, &header, sizeof(header), &pos);
+    if (bytes == 0)
+        return 0;
+    
+    header_ok = bytes == (ssize_t)sizeof(header) && header_valid(&header);
+    result = replay_log(&header, header_ok);
+    if (result < 0)
+        return result;
+    
+    if (!header_ok && result == 0) {
+        printk(KERN_ERR "int_stack: %s is not a valid checkpoint\n", checkpoint_path);
+        return -EINVAL;
+    }
+    
+    if (header.capacity > dev_buffer->capacity) {
+        result = resize_buffer(header.capacity);
+        if (result < 0)
+            return result;
+    }
+    
+    result = checkpoint_read(dev_buffer->elements, header.depth * sizeof(int),
+                             CHECKPOINT_DATA_OFFSET);
+    if (result < 0) {
+        printk(KERN_ERR "int_stack: checkpoint %s is truncated\n", checkpoint_path);
+        return result == -ENODATA ? -EIO : result;
+    }
+    
+    dev_buffer->position = header.depth;
+    checkpoint.generation = header.generation;
+    checkpoint.disk_capacity = header.capacity;
+    
+    printk(KERN_INFO "int_stack: restored %llu elements from checkpoint %llu\n",
+           header.depth, header.generation);
+    return 0;
+}
+
+static int init_checkpoint(void)
+{
+    int result;
+    
+    if (!checkpoint_path || !checkpoint_path[0])
+        return 0;
+    
+    if (checkpoint_chunk <= 0 || checkpoint_interval_ms <= 0)
+        return -EINVAL;
+    
+    checkpoint.file = filp_open(checkpoint_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(checkpoint.file)) {
+        result = PTR_ERR(checkpoint.file);
+        checkpoint.file = NULL;
+        return result;
+    }
+    
+    mutex_lock(&dev_buffer->op_lock);
+    result = resize_dirty_map(dev_buffer->capacity);
+    if (result == 0)
+        result = restore_checkpoint();
+    /* The file already matches memory */
+    if (result == 0) {
+        bitmap_zero(checkpoint.dirty, checkpoint.chunks);
+        checkpoint.header_dirty = false;
+    }
+    mutex_unlock(&dev_buffer->op_lock);
+    
+    if (result < 0) {
+        bitmap_free(checkpoint.dirty);
+        checkpoint.dirty = NULL;
+        filp_close(checkpoint.file, NULL);
+        checkpoint.file = NULL;
+        return result;
+    }
+    
+    INIT_DELAYED_WORK(&checkpoint.work, checkpoint_work_fn);
+    schedule_delayed_work(&checkpoint.work, msecs_to_jiffies(checkpoint_interval_ms));
+    return 0;
+}
+
+/* Writes a final checkpoint so that a clean unload loses nothing */
+static void release_checkpoint(void)
+{
+    int result;
+    
+    if (!checkpoint.file)
+        return;
+    
+    cancel_delayed_work_sync(&checkpoint.work);
+    result = write_checkpoint();
+    if (result < 0)
+        printk(KERN_WARNING "int_stack: final checkpoint to %s failed: %d\n",
+               checkpoint_path, result);
+    
+    printk(KERN_INFO "int_stack: checkpoint generation=%llu, chunks written=%llu\n",
+           checkpoint.generation, checkpoint.chunks_written);
+    
+    filp_close(checkpoint.file, NULL);
+    checkpoint.file = NULL;
+    bitmap_free(checkpoint.dirty);
+    checkpoint.dirty = NULL;
+}
+
 static int __init integer_buffer_init(void)
 {
     int result;
@@ -240,24 +738,35 @@ static int __init integer_buffer_init(void)
     mutex_init(&dev_buffer->op_lock);
     init_stats(&dev_buffer->stats);
     
-    result = misc_register(&buffer_device);
-    if (result < 0) {
-        kfree(dev_buffer);
-        return result;
-    }
-    
     if (default_capacity > 0) {
         mutex_lock(&dev_buffer->op_lock);
         result = resize_buffer(default_capacity);
         mutex_unlock(&dev_buffer->op_lock);
         
         if (result < 0) {
-            misc_deregister(&buffer_device);
             kfree(dev_buffer);
             return result;
         }
     }
     
+    /* Restore before the device node appears */
+    result = init_checkpoint();
+    if (result < 0) {
+        printk(KERN_ERR "int_stack: checkpointing to %s failed: %d\n",
+               checkpoint_path, result);
+        kfree(dev_buffer->elements);
+        kfree(dev_buffer);
+        return result;
+    }
+    
+    result = misc_register(&buffer_device);
+    if (result < 0) {
+        release_checkpoint();
+        kfree(dev_buffer->elements);
+        kfree(dev_buffer);
+        return result;
+    }
+    
     printk(KERN_INFO "int_stack: initialized with capacity=%zu\n", 
            dev_buffer->capacity);
     return 0;
@@ -273,6 +782,8 @@ static void __exit integer_buffer_exit(void)
            
     misc_deregister(&buffer_device);
     
+    release_checkpoint();
+    
     if (dev_buffer) {
         if (dev_buffer->elements)
             kfree(dev_buffer->elements);
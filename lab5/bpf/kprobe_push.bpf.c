@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Pushes an increasing counter onto the "int_stack" stack every time the
+ * target process enters getppid(), through the module's kfuncs.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+extern int bpf_int_stack_push(const char *name__str, int value) __ksym;
+extern s64 bpf_int_stack_usage(const char *name__str) __ksym;
+
+const volatile int target_tgid = 0;
+
+__u64 counter = 0;
+__u64 pushed = 0;
+__u64 failed = 0;
+__s64 last_depth = 0;
+
+SEC("ksyscall/getppid")
+int BPF_KSYSCALL(push_counter)
+{
+    if ((bpf_get_current_pid_tgid() >> 32) != target_tgid)
+        return 0;
+
+    if (bpf_int_stack_push("int_stack", (int)__sync_fetch_and_add(&counter, 1)) == 0)
+        __sync_fetch_and_add(&pushed, 1);
+    else
+        __sync_fetch_and_add(&failed, 1);
+
+    last_depth = bpf_int_stack_usage("int_stack");
+    return 0;
+}
+
+char LICENSE[] SEC("license") = "GPL";
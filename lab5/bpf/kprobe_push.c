@@ -0,0 +1,84 @@
+/*
+ * Loads kprobe_push.bpf.o, calls getppid() in a loop and reports how many
+ * values per second reach the stack through bpf_int_stack_push(), against
+ * the same loop with nothing attached.
+ *
+ *   sudo ./kernel_stack set-size 2000000
+ *   sudo ./bpf/kprobe_push 1000000
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <bpf/libbpf.h>
+
+#include "kprobe_push.skel.h"
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run_loop(long iterations)
+{
+    double start = now_seconds();
+    long i;
+    
+    for (i = 0; i < iterations; i++)
+        syscall(SYS_getppid);
+    return now_seconds() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    struct kprobe_push_bpf *skel;
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    double baseline;
+    double elapsed;
+    
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    skel = kprobe_push_bpf__open();
+    if (!skel) {
+        fprintf(stderr, "Error: Failed to open BPF skeleton\n");
+        return EXIT_FAILURE;
+    }
+    skel->rodata->target_tgid = getpid();
+    
+    if (kprobe_push_bpf__load(skel)) {
+        fprintf(stderr, "Error: Failed to load BPF program (is int_stack.ko loaded with BTF?)\n");
+        kprobe_push_bpf__destroy(skel);
+        return EXIT_FAILURE;
+    }
+    
+    baseline = run_loop(iterations);
+    
+    if (kprobe_push_bpf__attach(skel)) {
+        fprintf(stderr, "Error: Failed to attach BPF program\n");
+        kprobe_push_bpf__destroy(skel);
+        return EXIT_FAILURE;
+    }
+    
+    elapsed = run_loop(iterations);
+    kprobe_push_bpf__detach(skel);
+    
+    printf("iterations: %ld\n", iterations);
+    printf("pushed: %llu failed: %llu depth: %lld\n",
+           (unsigned long long)skel->bss->pushed,
+           (unsigned long long)skel->bss->failed,
+           (long long)skel->bss->last_depth);
+    printf("baseline: %.0f calls/s\n", iterations / baseline);
+    printf("with push: %.0f calls/s (%.1f ns per push)\n",
+           iterations / elapsed, (elapsed - baseline) * 1e9 / iterations);
+    
+    kprobe_push_bpf__destroy(skel);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Example push filter: rejects negative values and clamps large ones.
+ *
+ *   sudo bpftool prog load bpf/push_filter.bpf.o /sys/fs/bpf/int_stack_filter
+ *   sudo ./kernel_stack set-filter /sys/fs/bpf/int_stack_filter
+ */
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "../int_stack_uapi.h"
+
+const volatile int clamp_max = 1000000;
+
+SEC("syscall")
+int clamp_push(struct int_stack_filter_ctx *ctx)
+{
+    if (ctx->value < 0)
+        return INT_STACK_FILTER_REJECT;
+
+    if (ctx->value > clamp_max) {
+        ctx->value = clamp_max;
+        return INT_STACK_FILTER_REWRITE;
+    }
+
+    return INT_STACK_FILTER_ACCEPT;
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "int_stack_core.h"
+
+/*
+ * Times the module's stack core (int_stack_core.h) in userspace, so the
+ * push/pop path and the resize policy can be measured, profiled and run
+ * under sanitizers without root, a USB key or a module reload:
+ *
+ *   push/pop   fill the stack to capacity and drain it, single thread
+ *   locked     T threads pushing and popping one value at a time under a
+ *              mutex, as the file operations do under op_lock
+ *   resize     move a full stack between two arrays (stack_core_replace)
+ *   grow       auto-resize from 8 elements to capacity, one push at a time
+ *
+ * usage: core_bench [--capacity N] [--rounds N] [--threads 1,2,4]
+ *                   [--timestamps]
+ */
+
+#define MAX_THREAD_COUNTS 16
+
+struct bench_options {
+    size_t capacity;
+    long rounds;
+    int threads[MAX_THREAD_COUNTS];
+    int thread_counts;
+    int timestamps;
+};
+
+struct locked_stack {
+    pthread_mutex_t lock;
+    struct stack_core core;
+    pthread_barrier_t start;
+    long ops_per_thread;
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: core_bench [--capacity N] [--rounds N] [--threads 1,2,4] [--timestamps]\n");
+    exit(2);
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "Error: %s\n", what);
+    exit(1);
+}
+
+static void core_init(struct stack_core *core, size_t capacity, int timestamps)
+{
+    memset(core, 0, sizeof(*core));
+    core->elements = kvcalloc(capacity, sizeof(int), GFP_KERNEL);
+    core->timestamps = timestamps ? kvcalloc(capacity, sizeof(u64), GFP_KERNEL) : NULL;
+    if (!core->elements || (timestamps && !core->timestamps))
+        die("out of memory");
+    core->capacity = capacity;
+}
+
+static void core_free(struct stack_core *core)
+{
+    kvfree(core->elements);
+    kvfree(core->timestamps);
+}
+
+static void report(const char *name, int threads, double ns, long ops)
+{
+    printf("%-10s %7d %12ld %10.2f %12.0f\n", name, threads, ops,
+           ns / ops, ops * 1e9 / ns);
+}
+
+static void bench_push_pop(const struct bench_options *options)
+{
+    struct stack_core core;
+    u64 enqueued_ns, start;
+    long round, sum = 0;
+    size_t i;
+    int value = 0;
+
+    core_init(&core, options->capacity, options->timestamps);
+
+    start = ktime_get_ns();
+    for (round = 0; round < options->rounds; round++) {
+        for (i = 0; i < options->capacity; i++)
+            stack_core_push(&core, (int)i, options->timestamps ? start : 0);
+        for (i = 0; i < options->capacity; i++) {
+            stack_core_pop(&core, &value, &enqueued_ns);
+            sum += value;
+        }
+    }
+    report("push/pop", 1, (double)(ktime_get_ns() - start),
+           2 * options->rounds * (long)options->capacity);
+
+    /* Keeps the pops from being optimized away */
+    if (sum == -1)
+        printf("%ld\n", sum);
+    core_free(&core);
+}
+
+static void *locked_worker(void *arg)
+{
+    struct locked_stack *stack = arg;
+    u64 enqueued_ns;
+    int value;
+    long i;
+
+    pthread_barrier_wait(&stack->start);
+    for (i = 0; i < stack->ops_per_thread; i++) {
+        pthread_mutex_lock(&stack->lock);
+        stack_core_push(&stack->core, (int)i, 0);
+        pthread_mutex_unlock(&stack->lock);
+
+        pthread_mutex_lock(&stack->lock);
+        stack_core_pop(&stack->core, &value, &enqueued_ns);
+        pthread_mutex_unlock(&stack->lock);
+    }
+    return NULL;
+}
+
+static void bench_locked(const struct bench_options *options, int threads)
+{
+    struct locked_stack stack;
+    pthread_t *workers;
+    u64 start;
+    int i;
+
+    workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+        die("out of memory");
+    core_init(&stack.core, options->capacity, 0);
+    pthread_mutex_init(&stack.lock, NULL);
+    pthread_barrier_init(&stack.start, NULL, threads + 1);
+    stack.ops_per_thread = options->rounds * (long)options->capacity / threads;
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, locked_worker, &stack) != 0)
+            die("cannot create thread");
+    }
+    pthread_barrier_wait(&stack.start);
+    start = ktime_get_ns();
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    report("locked", threads, (double)(ktime_get_ns() - start),
+           2 * stack.ops_per_thread * threads);
+
+    if (atomic_read(&stack.core.stats.push_count) != atomic_read(&stack.core.stats.pop_count)
+        || stack.core.position != 0)
+        die("locked run lost elements");
+
+    pthread_barrier_destroy(&stack.start);
+    pthread_mutex_destroy(&stack.lock);
+    core_free(&stack.core);
+    free(workers);
+}
+
+static void bench_resize(const struct bench_options *options)
+{
+    struct stack_core core;
+    int *spare, *old_array;
+    u64 *spare_timestamps, *old_timestamps;
+    u64 start, ns;
+    long round;
+    size_t i;
+
+    core_init(&core, options->capacity, options->timestamps);
+    spare = kvcalloc(options->capacity, sizeof(int), GFP_KERNEL);
+    spare_timestamps = options->timestamps
+        ? kvcalloc(options->capacity, sizeof(u64), GFP_KERNEL) : NULL;
+    if (!spare || (options->timestamps && !spare_timestamps))
+        die("out of memory");
+    for (i = 0; i < options->capacity; i++)
+        stack_core_push(&core, (int)i, 0);
+
+    start = ktime_get_ns();
+    for (round = 0; round < options->rounds; round++) {
+        stack_core_replace(&core, spare, spare_timestamps, options->capacity, 0,
+                           &old_array, &old_timestamps);
+        spare = old_array;
+        spare_timestamps = old_timestamps;
+    }
+    ns = ktime_get_ns() - start;
+    printf("%-10s %7d %12ld %10.2f %12.0f  %.2f GB/s\n", "resize", 1,
+           options->rounds, (double)ns / options->rounds, options->rounds * 1e9 / ns,
+           (double)options->rounds * options->capacity
+               * (sizeof(int) + (options->timestamps ? sizeof(u64) : 0)) / ns);
+
+    if (core.position != options->capacity || core.elements[core.position - 1] != (int)core.position - 1)
+        die("resize corrupted the stack");
+    kvfree(spare);
+    kvfree(spare_timestamps);
+    core_free(&core);
+}
+
+static void bench_grow(const struct bench_options *options)
+{
+    struct stack_core core;
+    int *new_array, *old_array;
+    u64 *new_timestamps, *old_timestamps;
+    u64 start;
+    long round;
+    size_t i, capacity;
+
+    start = ktime_get_ns();
+    for (round = 0; round < options->rounds; round++) {
+        core_init(&core, 8, options->timestamps);
+        for (i = 0; i < options->capacity; i++) {
+            if (core.position + 1 > core.capacity) {
+                capacity = stack_core_grow_capacity(core.capacity, core.position + 1);
+                new_array = kvcalloc(capacity, sizeof(int), GFP_KERNEL);
+                new_timestamps = options->timestamps
+                    ? kvcalloc(capacity, sizeof(u64), GFP_KERNEL) : NULL;
+                if (!new_array || (options->timestamps && !new_timestamps))
+                    die("out of memory");
+                stack_core_replace(&core, new_array, new_timestamps, capacity, 0,
+                                   &old_array, &old_timestamps);
+                kvfree(old_array);
+                kvfree(old_timestamps);
+            }
+            if (stack_core_push(&core, (int)i, options->timestamps ? ktime_get_ns() : 0) != 0)
+                die("push failed after growing");
+        }
+        if (round == 0)
+            printf("           grow to %zu took %d resizes\n", options->capacity,
+                   atomic_read(&core.stats.resize_count));
+        core_free(&core);
+    }
+    report("grow", 1, (double)(ktime_get_ns() - start),
+           options->rounds * (long)options->capacity);
+}
+
+static long parse_long(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+
+    if (*text == '\0' || *end != '\0' || value <= 0)
+        usage();
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_options options = {
+        .capacity = 1 << 16,
+        .rounds = 100,
+        .threads = { 1, 2, 4 },
+        .thread_counts = 3,
+    };
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            options.capacity = parse_long(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            options.rounds = parse_long(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *list = argv[++i];
+            char *token;
+
+            options.thread_counts = 0;
+            for (token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+                if (options.thread_counts == MAX_THREAD_COUNTS)
+                    usage();
+                options.threads[options.thread_counts++] = (int)parse_long(token);
+            }
+        } else if (strcmp(argv[i], "--timestamps") == 0) {
+            options.timestamps = 1;
+        } else {
+            usage();
+        }
+    }
+
+    printf("capacity %zu, %ld rounds, timestamps %s\n", options.capacity,
+           options.rounds, options.timestamps ? "on" : "off");
+    printf("%-10s %7s %12s %10s %12s\n", "case", "threads", "ops", "ns/op", "ops/s");
+    bench_push_pop(&options);
+    for (i = 0; i < options.thread_counts; i++)
+        bench_locked(&options, options.threads[i]);
+    bench_resize(&options);
+    bench_grow(&options);
+
+    return 0;
+}
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "int_stack_core.h"
+
+/*
+ * Checks the module's stack core (int_stack_core.h) in userspace: bounds
+ * and their counters, two-phase pops, the resize copy and its truncation,
+ * the auto-resize policy and high-water tracking. Prints each failed check
+ * and exits 1 if there was any.
+ *
+ * usage: core_test
+ */
+
+static int failures;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__,  \
+                    __LINE__, __func__, #cond);                         \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static void core_init(struct stack_core *core, size_t capacity, int timestamps)
+{
+    memset(core, 0, sizeof(*core));
+    core->elements = kvcalloc(capacity, sizeof(int), GFP_KERNEL);
+    core->timestamps = timestamps ? kvcalloc(capacity, sizeof(u64), GFP_KERNEL) : NULL;
+    if (!core->elements || (timestamps && !core->timestamps)) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    core->capacity = capacity;
+}
+
+static void core_free(struct stack_core *core)
+{
+    kvfree(core->elements);
+    kvfree(core->timestamps);
+}
+
+static void test_push_to_full(void)
+{
+    struct stack_core core;
+    int i;
+
+    core_init(&core, 4, 0);
+    for (i = 0; i < 4; i++)
+        CHECK(stack_core_push(&core, i, 0) == 0);
+    CHECK(core.position == 4);
+
+    CHECK(stack_core_push(&core, 4, 0) == -ENOSPC);
+    CHECK(stack_core_push(&core, 5, 0) == -ENOSPC);
+    CHECK(core.position == 4);
+    CHECK(core.elements[3] == 3);
+    CHECK(atomic_read(&core.stats.push_count) == 4);
+    CHECK(atomic_read(&core.stats.overflow_count) == 2);
+    core_free(&core);
+}
+
+static void test_pop_empty(void)
+{
+    struct stack_core core;
+    u64 enqueued_ns = 1;
+    int value = -1;
+
+    core_init(&core, 4, 0);
+    CHECK(stack_core_pop(&core, &value, &enqueued_ns) == -ENODATA);
+    CHECK(value == -1);
+    CHECK(atomic_read(&core.stats.underflow_count) == 1);
+
+    CHECK(stack_core_push(&core, 7, 0) == 0);
+    CHECK(stack_core_pop(&core, &value, &enqueued_ns) == 0);
+    CHECK(value == 7);
+    CHECK(enqueued_ns == 0);
+    CHECK(stack_core_pop(&core, &value, &enqueued_ns) == -ENODATA);
+    CHECK(core.position == 0);
+    CHECK(atomic_read(&core.stats.pop_count) == 1);
+    CHECK(atomic_read(&core.stats.underflow_count) == 2);
+    core_free(&core);
+}
+
+static void test_timestamps(void)
+{
+    struct stack_core core;
+    u64 enqueued_ns;
+    int value;
+
+    core_init(&core, 2, 1);
+    CHECK(stack_core_push(&core, 1, 100) == 0);
+    CHECK(stack_core_push(&core, 2, 200) == 0);
+    CHECK(stack_core_pop(&core, &value, &enqueued_ns) == 0);
+    CHECK(value == 2 && enqueued_ns == 200);
+    CHECK(stack_core_pop(&core, &value, &enqueued_ns) == 0);
+    CHECK(value == 1 && enqueued_ns == 100);
+    core_free(&core);
+}
+
+static void test_pop_start_finish(void)
+{
+    struct stack_core core;
+    u64 enqueued_ns;
+    int values[4];
+    int value;
+
+    core_init(&core, 4, 0);
+    CHECK(stack_core_pop_start(&core, values, 2) == 0);
+    CHECK(atomic_read(&core.stats.underflow_count) == 1);
+
+    stack_core_push(&core, 1, 0);
+    stack_core_push(&core, 2, 0);
+    stack_core_push(&core, 3, 0);
+
+    /* Values come out top first and stay until finished */
+    CHECK(stack_core_pop_start(&core, values, 4) == 3);
+    CHECK(values[0] == 3 && values[1] == 2 && values[2] == 1);
+    CHECK(core.position == 3);
+    CHECK(atomic_read(&core.stats.pop_count) == 0);
+
+    /* A delivery that failed is simply not finished: nothing to put back */
+    CHECK(stack_core_pop_start(&core, values, 2) == 2);
+    CHECK(values[0] == 3 && values[1] == 2);
+    CHECK(stack_core_pop_finish(&core, 3, 2));
+    CHECK(core.position == 1 && core.copy_floor == 0);
+    CHECK(atomic_read(&core.stats.pop_count) == 2);
+
+    /* A push in between leaves the values stale */
+    stack_core_push(&core, 4, 0);
+    CHECK(stack_core_pop_start(&core, values, 1) == 1);
+    stack_core_push(&core, 5, 0);
+    CHECK(!stack_core_pop_finish(&core, 2, 1));
+    CHECK(core.position == 3 && core.elements[2] == 5);
+
+    /* So does a pop, even if a push restores the depth */
+    CHECK(stack_core_pop_start(&core, values, 2) == 2);
+    stack_core_pop(&core, &value, &enqueued_ns);
+    stack_core_push(&core, 6, 0);
+    CHECK(!stack_core_pop_finish(&core, 3, 2));
+    CHECK(core.position == 3 && core.elements[2] == 6);
+
+    /* A push and pop above the values do not touch them */
+    CHECK(stack_core_pop_start(&core, values, 2) == 2);
+    stack_core_push(&core, 7, 0);
+    stack_core_pop(&core, &value, &enqueued_ns);
+    CHECK(stack_core_pop_finish(&core, 3, 2));
+    CHECK(core.position == 1 && core.elements[0] == 1);
+
+    /* And so does a clear */
+    CHECK(stack_core_pop_start(&core, values, 1) == 1);
+    stack_core_clear(&core);
+    CHECK(!stack_core_pop_finish(&core, 1, 1));
+    CHECK(core.position == 0);
+    core_free(&core);
+}
+
+static void test_replace_truncates(void)
+{
+    struct stack_core core;
+    int *new_array, *old_array;
+    u64 *new_timestamps, *old_timestamps;
+    int i;
+
+    core_init(&core, 10, 1);
+    for (i = 0; i < 10; i++)
+        stack_core_push(&core, i, 1000 + i);
+
+    new_array = kvcalloc(4, sizeof(int), GFP_KERNEL);
+    new_timestamps = kvcalloc(4, sizeof(u64), GFP_KERNEL);
+    CHECK(new_array && new_timestamps);
+    CHECK(stack_core_replace(&core, new_array, new_timestamps, 4, 0,
+                             &old_array, &old_timestamps) == 4);
+    CHECK(core.position == 4);
+    CHECK(core.capacity == 4);
+    CHECK(core.elements == new_array && core.timestamps == new_timestamps);
+    for (i = 0; i < 4; i++)
+        CHECK(core.elements[i] == i && core.timestamps[i] == (u64)(1000 + i));
+    CHECK(old_array[9] == 9);
+    CHECK(atomic_read(&core.stats.resize_count) == 1);
+    CHECK(stack_core_push(&core, 4, 0) == -ENOSPC);
+    kvfree(old_array);
+    kvfree(old_timestamps);
+
+    /* Growing keeps everything */
+    new_array = kvcalloc(8, sizeof(int), GFP_KERNEL);
+    CHECK(new_array != NULL);
+    CHECK(stack_core_replace(&core, new_array, NULL, 8, 0,
+                             &old_array, &old_timestamps) == 4);
+    CHECK(core.capacity == 8 && core.timestamps == NULL);
+    CHECK(core.elements[3] == 3);
+    kvfree(old_array);
+    kvfree(old_timestamps);
+    core_free(&core);
+}
+
+static void test_copy_protocol(void)
+{
+    struct stack_core core;
+    int *new_array, *old_array;
+    u64 *old_timestamps;
+    u64 enqueued_ns;
+    size_t copied;
+    int i, value;
+
+    core_init(&core, 8, 0);
+    for (i = 0; i < 6; i++)
+        stack_core_push(&core, i, 0);
+
+    new_array = kvcalloc(8, sizeof(int), GFP_KERNEL);
+    CHECK(new_array != NULL);
+    copied = stack_core_copy_start(&core, 8);
+    CHECK(copied == 6);
+    stack_core_copy(&core, new_array, NULL, 0, copied);
+
+    /* Changes between the bulk copy and the replace must be picked up */
+    stack_core_pop(&core, &value, &enqueued_ns);
+    stack_core_pop(&core, &value, &enqueued_ns);
+    CHECK(core.copy_floor == 4);
+    stack_core_push(&core, 40, 0);
+    stack_core_push(&core, 50, 0);
+    stack_core_push(&core, 60, 0);
+
+    CHECK(stack_core_replace(&core, new_array, NULL, 8, copied,
+                             &old_array, &old_timestamps) == 7);
+    CHECK(core.copy_floor == 0);
+    CHECK(core.elements[3] == 3);
+    CHECK(core.elements[4] == 40 && core.elements[5] == 50 && core.elements[6] == 60);
+    kvfree(old_array);
+
+    /* A clear during the copy leaves nothing to keep */
+    new_array = kvcalloc(8, sizeof(int), GFP_KERNEL);
+    CHECK(new_array != NULL);
+    copied = stack_core_copy_start(&core, 8);
+    stack_core_copy(&core, new_array, NULL, 0, copied);
+    stack_core_clear(&core);
+    stack_core_push(&core, 9, 0);
+    CHECK(stack_core_replace(&core, new_array, NULL, 8, copied,
+                             &old_array, &old_timestamps) == 1);
+    CHECK(core.elements[0] == 9);
+    kvfree(old_array);
+    core_free(&core);
+}
+
+static void test_grow_capacity(void)
+{
+    CHECK(stack_core_grow_capacity(0, 1) == 8);
+    CHECK(stack_core_grow_capacity(0, 0) == 0);
+    CHECK(stack_core_grow_capacity(8, 8) == 8);
+    CHECK(stack_core_grow_capacity(8, 9) == 16);
+    CHECK(stack_core_grow_capacity(3, 4) == 8);
+    CHECK(stack_core_grow_capacity(5, 6) == 10);
+    CHECK(stack_core_grow_capacity(8, 1000) == 1024);
+    CHECK(stack_core_grow_capacity(100, 50) == 100);
+
+    /* Doubling would wrap: settle for what is needed */
+    CHECK(stack_core_grow_capacity(SIZE_MAX / 2, SIZE_MAX / 2 + 1) == SIZE_MAX - 1);
+    CHECK(stack_core_grow_capacity(SIZE_MAX / 2 + 1, SIZE_MAX / 2 + 2) == SIZE_MAX / 2 + 2);
+    CHECK(stack_core_grow_capacity(SIZE_MAX / 2, SIZE_MAX) == SIZE_MAX);
+    CHECK(stack_core_grow_capacity(SIZE_MAX - 1, SIZE_MAX) == SIZE_MAX);
+    CHECK(stack_core_grow_capacity(8, SIZE_MAX) == SIZE_MAX);
+}
+
+static void test_high_water(void)
+{
+    struct stack_core core;
+    u64 enqueued_ns;
+    int value;
+
+    core_init(&core, 8, 0);
+    stack_core_push(&core, 1, 0);
+    stack_core_push(&core, 2, 0);
+    stack_core_push(&core, 3, 0);
+    stack_core_pop(&core, &value, &enqueued_ns);
+    stack_core_pop(&core, &value, &enqueued_ns);
+    stack_core_push(&core, 4, 0);
+    CHECK(core.high_water == 3);
+    CHECK(core.window_high_water == 3);
+
+    /* A new window starts at the current depth, as CMD_GET_HIGH_WATER does */
+    core.window_high_water = core.position;
+    stack_core_push(&core, 5, 0);
+    CHECK(core.window_high_water == 3);
+    CHECK(core.high_water == 3);
+    stack_core_push(&core, 6, 0);
+    CHECK(core.window_high_water == 4);
+    CHECK(core.high_water == 4);
+
+    /* Clearing keeps the marks */
+    stack_core_clear(&core);
+    CHECK(core.position == 0 && core.high_water == 4);
+    core_free(&core);
+}
+
+int main(void)
+{
+    test_push_to_full();
+    test_pop_empty();
+    test_timestamps();
+    test_pop_start_finish();
+    test_replace_truncates();
+    test_copy_protocol();
+    test_grow_capacity();
+    test_high_water();
+
+    if (failures) {
+        fprintf(stderr, "core_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("core_test: all checks passed\n");
+    return 0;
+}
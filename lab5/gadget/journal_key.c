@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/usb/functionfs.h>
+
+#include "../int_stack_uapi.h"
+
+/* Descriptors are little-endian and built at compile time */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define cpu_to_le16(x) (x)
+#define cpu_to_le32(x) (x)
+#else
+#define cpu_to_le16(x) ((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x) ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+                        (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#endif
+
+/*
+ * FunctionFS side of the emulated USB key (see scripts/dummy_key.sh).
+ * It exposes one vendor interface with a bulk IN/OUT pair and keeps the
+ * module's write-behind journal in a file: change records received on
+ * bulk OUT are appended, a RESET record truncates the file first, and the
+ * vendor request JOURNAL_REQ_REPLAY sends the file back on bulk IN.
+ *
+ * usage: journal_key <functionfs mount> <journal file>
+ */
+
+#define JOURNAL_REQ_REPLAY   0x01
+#define TRANSFER_SIZE        (64 * 1024)
+#define RECORD_SIZE          sizeof(struct int_stack_change)
+
+struct endpoint_descs {
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor_no_audio bulk_in;
+    struct usb_endpoint_descriptor_no_audio bulk_out;
+} __attribute__((packed));
+
+#define ENDPOINT_DESCS(packet_size) {                                   \
+    .intf = {                                                           \
+        .bLength = sizeof(struct usb_interface_descriptor),             \
+        .bDescriptorType = USB_DT_INTERFACE,                            \
+        .bNumEndpoints = 2,                                             \
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,                       \
+        .iInterface = 1,                                                \
+    },                                                                  \
+    .bulk_in = {                                                        \
+        .bLength = USB_DT_ENDPOINT_SIZE,                                \
+        .bDescriptorType = USB_DT_ENDPOINT,                             \
+        .bEndpointAddress = 1 | USB_DIR_IN,                             \
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,                         \
+        .wMaxPacketSize = cpu_to_le16(packet_size),                         \
+    },                                                                  \
+    .bulk_out = {                                                       \
+        .bLength = USB_DT_ENDPOINT_SIZE,                                \
+        .bDescriptorType = USB_DT_ENDPOINT,                             \
+        .bEndpointAddress = 2 | USB_DIR_OUT,                            \
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,                         \
+        .wMaxPacketSize = cpu_to_le16(packet_size),                         \
+    },                                                                  \
+}
+
+static const struct {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    struct endpoint_descs fs_descs;
+    struct endpoint_descs hs_descs;
+} __attribute__((packed)) descriptors = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+        .length = cpu_to_le32(sizeof(descriptors)),
+    },
+    .fs_count = cpu_to_le32(3),
+    .hs_count = cpu_to_le32(3),
+    .fs_descs = ENDPOINT_DESCS(64),
+    .hs_descs = ENDPOINT_DESCS(512),
+};
+
+#define INTERFACE_NAME "int_stack journal"
+
+static const struct {
+    struct usb_functionfs_strings_head header;
+    struct {
+        __le16 code;
+        const char name[sizeof(INTERFACE_NAME)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+        .length = cpu_to_le32(sizeof(strings)),
+        .str_count = cpu_to_le32(1),
+        .lang_count = cpu_to_le32(1),
+    },
+    .lang0 = {
+        cpu_to_le16(0x0409),
+        INTERFACE_NAME,
+    },
+};
+
+static int journal_fd = -1;
+static int in_fd = -1;
+static int out_fd = -1;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_requested = PTHREAD_COND_INITIALIZER;
+static int replay_pending = 0;
+
+static int open_endpoint(const char *mount, const char *name, int flags)
+{
+    char path[4096];
+    int fd;
+    
+    snprintf(path, sizeof(path), "%s/%s", mount, name);
+    fd = open(path, flags);
+    if (fd < 0)
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    ssize_t written;
+    
+    while (size > 0) {
+        written = write(fd, p, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        size -= written;
+    }
+    
+    return 0;
+}
+
+/* Appends whole records, truncating the journal at every RESET */
+static void store_records(const struct int_stack_change *records, size_t count)
+{
+    size_t start = 0, i;
+    
+    pthread_mutex_lock(&journal_lock);
+    for (i = 0; i < count; i++) {
+        if (records[i].type != INT_STACK_CHANGE_RESET)
+            continue;
+        if (ftruncate(journal_fd, 0) < 0)
+            perror("ftruncate");
+        start = i;
+    }
+    if (write_all(journal_fd, records + start, (count - start) * RECORD_SIZE) < 0)
+        perror("journal write");
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static void *receive_thread(void *arg)
+{
+    static char chunk[TRANSFER_SIZE];
+    size_t carry = 0, records;
+    ssize_t got;
+    
+    (void)arg;
+    for (;;) {
+        got = read(out_fd, chunk + carry, sizeof(chunk) - carry);
+        if (got < 0) {
+            /* Disabled or unbound, wait for the host to come back */
+            if (errno != EINTR)
+                usleep(100000);
+            carry = 0;
+            continue;
+        }
+        
+        records = (carry + got) / RECORD_SIZE;
+        store_records((const struct int_stack_change *)chunk, records);
+        carry = (carry + got) % RECORD_SIZE;
+        memmove(chunk, chunk + records * RECORD_SIZE, carry);
+    }
+    
+    return NULL;
+}
+
+/* Sends the journal, ending it with a short or zero-length packet */
+static void *replay_thread(void *arg)
+{
+    static char chunk[TRANSFER_SIZE];
+    ssize_t got;
+    off_t offset;
+    
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&journal_lock);
+        while (!replay_pending)
+            pthread_cond_wait(&replay_requested, &journal_lock);
+        replay_pending = 0;
+        
+        offset = 0;
+        do {
+            got = pread(journal_fd, chunk, sizeof(chunk), offset);
+            if (got < 0) {
+                perror("journal read");
+                got = 0;
+            }
+            if (write(in_fd, chunk, got) < 0) {
+                perror("replay");
+                break;
+            }
+            offset += got;
+        } while (got == sizeof(chunk));
+        pthread_mutex_unlock(&journal_lock);
+        
+        printf("replayed %lld bytes\n", (long long)offset);
+    }
+    
+    return NULL;
+}
+
+static void handle_setup(int ep0, const struct usb_ctrlrequest *setup)
+{
+    if ((setup->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR &&
+        setup->bRequest == JOURNAL_REQ_REPLAY &&
+        !(setup->bRequestType & USB_DIR_IN)) {
+        /* A zero-length read acknowledges the status stage */
+        if (read(ep0, NULL, 0) < 0)
+            perror("ep0 ack");
+        pthread_mutex_lock(&journal_lock);
+        replay_pending = 1;
+        pthread_cond_signal(&replay_requested);
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    
+    /* Reading an IN request (or writing an OUT one) stalls it */
+    if (setup->bRequestType & USB_DIR_IN) {
+        if (read(ep0, NULL, 0) < 0 && errno != EL2HLT)
+            perror("ep0 stall");
+    } else {
+        if (write(ep0, NULL, 0) < 0 && errno != EL2HLT)
+            perror("ep0 stall");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct usb_functionfs_event event;
+    pthread_t receiver, replayer;
+    int ep0;
+    
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <functionfs mount> <journal file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    journal_fd = open(argv[2], O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", argv[2], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    
+    ep0 = open_endpoint(argv[1], "ep0", O_RDWR);
+    if (ep0 < 0)
+        return EXIT_FAILURE;
+    
+    if (write_all(ep0, &descriptors, sizeof(descriptors)) < 0 ||
+        write_all(ep0, &strings, sizeof(strings)) < 0) {
+        perror("Error: Cannot write descriptors");
+        return EXIT_FAILURE;
+    }
+    
+    /* Endpoint files appear in descriptor order once ep0 is set up */
+    in_fd = open_endpoint(argv[1], "ep1", O_RDWR);
+    out_fd = open_endpoint(argv[1], "ep2", O_RDWR);
+    if (in_fd < 0 || out_fd < 0)
+        return EXIT_FAILURE;
+    
+    if (pthread_create(&receiver, NULL, receive_thread, NULL) != 0 ||
+        pthread_create(&replayer, NULL, replay_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot start threads\n");
+        return EXIT_FAILURE;
+    }
+    
+    for (;;) {
+        if (read(ep0, &event, sizeof(event)) != sizeof(event)) {
+            if (errno == EINTR)
+                continue;
+            perror("ep0");
+            return EXIT_FAILURE;
+        }
+        
+        switch (event.type) {
+        case FUNCTIONFS_SETUP:
+            handle_setup(ep0, &event.u.setup);
+            break;
+        case FUNCTIONFS_ENABLE:
+            printf("key plugged in\n");
+            break;
+        case FUNCTIONFS_DISABLE:
+            printf("key unplugged\n");
+            break;
+        default:
+            break;
+        }
+        fflush(stdout);
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/usb/functionfs.h>
+
+/* Descriptors are little-endian and built at compile time */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define cpu_to_le16(x) (x)
+#define cpu_to_le32(x) (x)
+#else
+#define cpu_to_le16(x) ((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x) ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+                        (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#endif
+
+/*
+ * FunctionFS side of an emulated sampling device (see scripts/dummy_key.sh).
+ * It exposes one vendor interface with a single IN endpoint and streams a
+ * counter as little-endian 32-bit samples, so gaps in what reaches the
+ * stack show exactly which samples were lost. The module's sample
+ * producer (usb_samples=1) pushes them onto the device stack.
+ *
+ * usage: sample_key <functionfs mount> [samples/s, 0=unlimited] [bulk|interrupt]
+ */
+
+#define TRANSFER_SIZE        (16 * 1024)
+#define SAMPLE_SIZE          sizeof(__le32)
+
+struct endpoint_descs {
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor_no_audio sample_in;
+} __attribute__((packed));
+
+#define ENDPOINT_DESCS(packet_size) {                                   \
+    .intf = {                                                           \
+        .bLength = sizeof(struct usb_interface_descriptor),             \
+        .bDescriptorType = USB_DT_INTERFACE,                            \
+        .bNumEndpoints = 1,                                             \
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,                       \
+        .iInterface = 1,                                                \
+    },                                                                  \
+    .sample_in = {                                                      \
+        .bLength = USB_DT_ENDPOINT_SIZE,                                \
+        .bDescriptorType = USB_DT_ENDPOINT,                             \
+        .bEndpointAddress = 1 | USB_DIR_IN,                             \
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,                         \
+        .wMaxPacketSize = cpu_to_le16(packet_size),                     \
+    },                                                                  \
+}
+
+/* Patched in main() for an interrupt endpoint */
+static struct {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    struct endpoint_descs fs_descs;
+    struct endpoint_descs hs_descs;
+} __attribute__((packed)) descriptors = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+        .length = cpu_to_le32(sizeof(descriptors)),
+    },
+    .fs_count = cpu_to_le32(2),
+    .hs_count = cpu_to_le32(2),
+    .fs_descs = ENDPOINT_DESCS(64),
+    .hs_descs = ENDPOINT_DESCS(512),
+};
+
+#define INTERFACE_NAME "int_stack samples"
+
+static const struct {
+    struct usb_functionfs_strings_head header;
+    struct {
+        __le16 code;
+        const char name[sizeof(INTERFACE_NAME)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+        .length = cpu_to_le32(sizeof(strings)),
+        .str_count = cpu_to_le32(1),
+        .lang_count = cpu_to_le32(1),
+    },
+    .lang0 = {
+        cpu_to_le16(0x0409),
+        INTERFACE_NAME,
+    },
+};
+
+static int in_fd = -1;
+static unsigned long rate = 0;
+static volatile unsigned long long samples_sent = 0;
+
+static int open_endpoint(const char *mount, const char *name, int flags)
+{
+    char path[4096];
+    int fd;
+    
+    snprintf(path, sizeof(path), "%s/%s", mount, name);
+    fd = open(path, flags);
+    if (fd < 0)
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    ssize_t written;
+    
+    while (size > 0) {
+        written = write(fd, p, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        size -= written;
+    }
+    
+    return 0;
+}
+
+static void advance(struct timespec *ts, unsigned long long ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/* Paces whole transfers so that the average matches rate */
+static void *generator_thread(void *arg)
+{
+    static __le32 chunk[TRANSFER_SIZE / SAMPLE_SIZE];
+    size_t batch = TRANSFER_SIZE / SAMPLE_SIZE, i;
+    unsigned int counter = 0;
+    struct timespec deadline;
+    ssize_t written;
+    
+    (void)arg;
+    /* At low rates send about a hundred transfers per second */
+    if (rate > 0 && rate / 100 < batch)
+        batch = rate / 100 > 0 ? rate / 100 : 1;
+    
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for (;;) {
+        for (i = 0; i < batch; i++)
+            chunk[i] = cpu_to_le32(counter + i);
+        
+        written = write(in_fd, chunk, batch * SAMPLE_SIZE);
+        if (written < 0) {
+            /* Disabled or unbound, wait for the host to come back */
+            if (errno != EINTR)
+                usleep(100000);
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            continue;
+        }
+        
+        counter += written / SAMPLE_SIZE;
+        samples_sent += written / SAMPLE_SIZE;
+        
+        if (rate > 0) {
+            advance(&deadline, (unsigned long long)written / SAMPLE_SIZE * 1000000000ULL / rate);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        }
+    }
+    
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct usb_functionfs_event event;
+    pthread_t generator;
+    int ep0;
+    
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <functionfs mount> [samples/s] [bulk|interrupt]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (argc > 2)
+        rate = strtoul(argv[2], NULL, 10);
+    
+    if (argc > 3 && strcmp(argv[3], "interrupt") == 0) {
+        descriptors.fs_descs.sample_in.bmAttributes = USB_ENDPOINT_XFER_INT;
+        descriptors.fs_descs.sample_in.bInterval = 1;
+        descriptors.hs_descs.sample_in.bmAttributes = USB_ENDPOINT_XFER_INT;
+        descriptors.hs_descs.sample_in.wMaxPacketSize = cpu_to_le16(1024);
+        descriptors.hs_descs.sample_in.bInterval = 1;
+    } else if (argc > 3 && strcmp(argv[3], "bulk") != 0) {
+        fprintf(stderr, "Error: Unknown endpoint type '%s'\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+    
+    ep0 = open_endpoint(argv[1], "ep0", O_RDWR);
+    if (ep0 < 0)
+        return EXIT_FAILURE;
+    
+    if (write_all(ep0, &descriptors, sizeof(descriptors)) < 0 ||
+        write_all(ep0, &strings, sizeof(strings)) < 0) {
+        perror("Error: Cannot write descriptors");
+        return EXIT_FAILURE;
+    }
+    
+    in_fd = open_endpoint(argv[1], "ep1", O_RDWR);
+    if (in_fd < 0)
+        return EXIT_FAILURE;
+    
+    if (pthread_create(&generator, NULL, generator_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot start generator\n");
+        return EXIT_FAILURE;
+    }
+    
+    for (;;) {
+        if (read(ep0, &event, sizeof(event)) != sizeof(event)) {
+            if (errno == EINTR)
+                continue;
+            perror("ep0");
+            return EXIT_FAILURE;
+        }
+        
+        switch (event.type) {
+        case FUNCTIONFS_SETUP:
+            /* No control requests, stall them */
+            if (event.u.setup.bRequestType & USB_DIR_IN) {
+                if (read(ep0, NULL, 0) < 0 && errno != EL2HLT)
+                    perror("ep0 stall");
+            } else {
+                if (write(ep0, NULL, 0) < 0 && errno != EL2HLT)
+                    perror("ep0 stall");
+            }
+            break;
+        case FUNCTIONFS_ENABLE:
+            printf("device plugged in\n");
+            break;
+        case FUNCTIONFS_DISABLE:
+            printf("device unplugged, %llu samples sent\n", samples_sent);
+            break;
+        default:
+            break;
+        }
+        fflush(stdout);
+    }
+    
+    return EXIT_SUCCESS;
+}
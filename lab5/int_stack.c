@@ -8,6 +8,45 @@
 #include <linux/list.h>
 #include <linux/atomic.h>
 #include <linux/usb.h> 
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/hashtable.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/rculist.h>
+#include <linux/hardirq.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/filter.h>
+#include <linux/rcupdate_trace.h>
+#include <linux/capability.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/crc32c.h>
+#include <linux/irq_work.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
+#include <linux/ctype.h>
+#include <linux/percpu-refcount.h>
+#include <linux/completion.h>
+
+#include "int_stack.h"
+#include "int_stack_core.h"
+
+#include "int_stack_uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "int_stack_trace.h"
 
 static int default_capacity = 16;
 module_param(default_capacity, int, 0644);
@@ -25,283 +64,4201 @@ static int usb_pid = 0x5678;
 module_param(usb_pid, int, 0644);
 MODULE_PARM_DESC(usb_pid, "USB Product ID (PID) in hex (e.g., 0xc52b for Logitech Unifying receiver)");
 
-#define INT_BUFFER_MAGIC 's'
-#define INT_STACK_SET_MAX_SIZE _IOW(INT_BUFFER_MAGIC, 1, int)
-#define CMD_GET_CAPACITY _IOR(INT_BUFFER_MAGIC, 2, int)
-#define CMD_GET_USAGE _IOR(INT_BUFFER_MAGIC, 3, int)
-#define CMD_CLEAR_BUFFER _IO(INT_BUFFER_MAGIC, 4)
+static int client_table_size = 256;
+module_param(client_table_size, int, 0444);
+MODULE_PARM_DESC(client_table_size, "Number of processes tracked for per-process attribution (0=disabled)");
+
+static int sample_period_us = 0;
+module_param(sample_period_us, int, 0444);
+MODULE_PARM_DESC(sample_period_us, "Initial depth sampling period in microseconds (0=disabled)");
+
+static int depth_ring_size = 4096;
+module_param(depth_ring_size, int, 0444);
+MODULE_PARM_DESC(depth_ring_size, "Number of depth samples kept in the in-kernel ring buffer");
+
+static bool element_timestamps = false;
+module_param(element_timestamps, bool, 0444);
+MODULE_PARM_DESC(element_timestamps, "Store a coarse enqueue timestamp with every element for sojourn-time telemetry");
+
+static bool latency_stats = false;
+module_param(latency_stats, bool, 0444);
+MODULE_PARM_DESC(latency_stats, "Record lock wait/hold latency histograms from load time (toggle later via debugfs)");
+
+static int change_log_size = 0;
+module_param(change_log_size, int, 0444);
+MODULE_PARM_DESC(change_log_size, "Change-log records kept for the device stack (0=disabled)");
 
+static bool usb_journal = false;
+module_param(usb_journal, bool, 0444);
+MODULE_PARM_DESC(usb_journal, "Journal the device stack to the key's bulk endpoints and restore it on the first plug-in");
+
+static int journal_flush_ms = 100;
+module_param(journal_flush_ms, int, 0644);
+MODULE_PARM_DESC(journal_flush_ms, "Longest delay before a change reaches the key's journal");
+
+static bool usb_samples = false;
+module_param(usb_samples, bool, 0444);
+MODULE_PARM_DESC(usb_samples, "Push the integer samples streamed by the key's IN endpoint onto the device stack");
+
+static int sample_urbs = 8;
+module_param(sample_urbs, int, 0444);
+MODULE_PARM_DESC(sample_urbs, "Sample URBs kept in flight on the key's IN endpoint");
+
+static int removal_grace_ms = 0;
+module_param(removal_grace_ms, int, 0644);
+MODULE_PARM_DESC(removal_grace_ms, "Keep a removed key's device node and let ops wait this long for it to return (0=fail with ENODEV at once)");
+
+static bool require_key = true;
+module_param(require_key, bool, 0444);
+MODULE_PARM_DESC(require_key, "Only provide /dev/int_stack while a key is plugged in (0=always)");
+
+/* Keys plugged in; /dev/int_stack is present while there is one */
 static atomic_t usb_key_present = ATOMIC_INIT(0);
-static atomic_t device_registered = ATOMIC_INIT(0);
 
-struct buffer_stats {
-    atomic_t push_count;
-    atomic_t pop_count;
-    atomic_t overflow_count;
-    atomic_t underflow_count;
+/*
+ * Presence of a device node's key. Every op holds a reference on ref,
+ * which is live exactly while the key is present, so removal kills it and
+ * waits on drained for the ops in flight. Within removal_grace_ms of a
+ * removal new ops wait on wait for the key to return; expire ends the
+ * window. The node itself is (un)registered by sync, off the USB probe
+ * and disconnect paths. registered is guarded by key_lock.
+ */
+struct key_gate {
+    struct miscdevice *misc;
+    bool registered;
+    struct percpu_ref ref;
+    struct completion drained;
+    atomic_t present;
+    atomic_t grace;
+    wait_queue_head_t wait;
+    struct delayed_work expire;
+    struct work_struct sync;
+};
+
+/* require_key=0: /dev/int_stack is never gated */
+static DEFINE_STATIC_KEY_FALSE(shared_always_present);
+
+/* hrtimer-driven depth sampler feeding a ring of int_stack_depth_sample */
+struct depth_sampler {
+    struct hrtimer timer;
+    u64 period_ns;
+    spinlock_t lock;
+    struct int_stack_depth_sample *ring;
+    unsigned int size;
+    unsigned int head;
+    unsigned int count;
+    u64 overwritten;
 };
 
+/*
+ * op_lock serializes file operations, which may sleep (resize, user copies).
+ * data_lock nests inside it and guards elements, timestamps, position and
+ * capacity, so that non-sleeping callers such as BPF kfuncs can use the
+ * stack with data_lock alone. Those fields are the stack_core of
+ * int_stack_core.h, reachable both by name and as ->core.
+ */
 struct integer_buffer {
-    int *elements;
-    size_t capacity;
-    size_t position;
+    int id;
+    char name[32];
+    struct list_head node;
+    struct kref ref;
+    union {
+        struct { STACK_CORE_MEMBERS };
+        struct stack_core core;
+    };
+    u64 oldest_timestamp;
     struct mutex op_lock;
-    struct buffer_stats stats;
+    raw_spinlock_t data_lock;
+    struct depth_sampler sampler;
+    struct int_stack_status *status;
+    struct bpf_prog *push_filter;
+    struct stack_consumer __rcu *consumer;
+    struct irq_work consumer_kick;
+    bool user_created;
+    u64 change_seq;
+    struct change_log *changes;
 };
 
 static struct integer_buffer *dev_buffer;
 
-static int buffer_open(struct inode *inode, struct file *file)
+struct usb_journal;
+struct usb_producer;
+
+/*
+ * A key, identified by its serial number, owns the stack and device node
+ * int_stack-<serial>. Keys stay on key_list after removal so that a
+ * re-plugged key finds its contents; while a key is out its node is
+ * unregistered and interface is NULL. key_lock only guards the list and
+ * plug state, operations go straight to the key's stack.
+ */
+#define KEY_SERIAL_LEN (INT_STACK_NAME_LEN - sizeof("int_stack-") + 1)
+
+struct usb_key {
+    struct list_head node;
+    char serial[KEY_SERIAL_LEN];
+    char name[INT_STACK_NAME_LEN];
+    struct integer_buffer *buffer;
+    struct miscdevice misc;
+    struct key_gate gate;
+    struct usb_interface *interface;
+    struct usb_journal *journal;
+    /* The journal is replayed into the stack on the first plug-in only */
+    bool journal_replayed;
+    struct usb_producer *producer;
+    atomic64_t samples;
+    atomic64_t overruns;
+    atomic64_t urb_errors;
+};
+
+static LIST_HEAD(key_list);
+static DEFINE_MUTEX(key_lock);
+
+/* Gate of /dev/int_stack, present while any key is */
+static struct key_gate shared_gate;
+
+/* All stacks by name; readers walk it under RCU */
+static LIST_HEAD(stack_list);
+static DEFINE_MUTEX(stack_list_lock);
+static DEFINE_IDA(stack_ida);
+
+static struct dentry *debug_dir;
+
+/*
+ * Latency instrumentation. Histograms are log2-bucketed by nanoseconds,
+ * kept per CPU and only merged when read from debugfs. While disabled the
+ * static key turns every hook into a single patched-out jump.
+ */
+enum stack_op {
+    STACK_OP_PUSH,
+    STACK_OP_POP,
+    STACK_OP_IOCTL,
+    STACK_OP_RESIZE,
+    STACK_OP_COUNT,
+};
+
+static const char * const stack_op_names[STACK_OP_COUNT] = {
+    [STACK_OP_PUSH] = "push",
+    [STACK_OP_POP] = "pop",
+    [STACK_OP_IOCTL] = "ioctl",
+    [STACK_OP_RESIZE] = "resize",
+};
+
+#define LATENCY_BUCKETS 32
+
+struct op_latency {
+    u64 wait[LATENCY_BUCKETS];
+    u64 hold[LATENCY_BUCKETS];
+    u64 total[LATENCY_BUCKETS];
+};
+
+struct latency_hist {
+    struct op_latency ops[STACK_OP_COUNT];
+};
+
+struct op_timing {
+    u64 start;
+    u64 requested;
+    u64 locked;
+    u64 unlocked;
+};
+
+static DEFINE_STATIC_KEY_FALSE(latency_tracking);
+static DEFINE_PER_CPU(struct latency_hist, latency_hist);
+
+static inline unsigned int latency_bucket(u64 ns)
+{
+    if (ns == 0)
+        return 0;
+    return min_t(unsigned int, ilog2(ns), LATENCY_BUCKETS - 1);
+}
+
+static inline void op_timing_start(struct op_timing *timing)
+{
+    timing->start = 0;
+    timing->requested = 0;
+    timing->locked = 0;
+    timing->unlocked = 0;
+    if (static_branch_unlikely(&latency_tracking))
+        timing->start = ktime_get_ns();
+}
+
+static inline void stack_lock(struct integer_buffer *buffer, struct op_timing *timing)
+{
+    if (static_branch_unlikely(&latency_tracking) && timing->start) {
+        timing->requested = ktime_get_ns();
+        mutex_lock(&buffer->op_lock);
+        timing->locked = ktime_get_ns();
+        return;
+    }
+    mutex_lock(&buffer->op_lock);
+}
+
+static inline void stack_unlock(struct integer_buffer *buffer, struct op_timing *timing)
+{
+    if (static_branch_unlikely(&latency_tracking) && timing->locked)
+        timing->unlocked = ktime_get_ns();
+    mutex_unlock(&buffer->op_lock);
+}
+
+static inline void op_timing_end(enum stack_op op, struct op_timing *timing)
+{
+    u64 now;
+    
+    if (!static_branch_unlikely(&latency_tracking) || !timing->start)
+        return;
+    
+    now = ktime_get_ns();
+    this_cpu_inc(latency_hist.ops[op].total[latency_bucket(now - timing->start)]);
+    if (timing->locked) {
+        this_cpu_inc(latency_hist.ops[op].wait[latency_bucket(timing->locked - timing->requested)]);
+        this_cpu_inc(latency_hist.ops[op].hold[latency_bucket(timing->unlocked - timing->locked)]);
+    }
+}
+
+static void latency_merge(struct latency_hist *merged)
+{
+    int cpu;
+    int op;
+    int b;
+    
+    memset(merged, 0, sizeof(*merged));
+    for_each_possible_cpu(cpu) {
+        struct latency_hist *hist = per_cpu_ptr(&latency_hist, cpu);
+        
+        for (op = 0; op < STACK_OP_COUNT; op++) {
+            for (b = 0; b < LATENCY_BUCKETS; b++) {
+                merged->ops[op].wait[b] += READ_ONCE(hist->ops[op].wait[b]);
+                merged->ops[op].hold[b] += READ_ONCE(hist->ops[op].hold[b]);
+                merged->ops[op].total[b] += READ_ONCE(hist->ops[op].total[b]);
+            }
+        }
+    }
+}
+
+static void latency_show_metric(struct seq_file *m, const char *op_name,
+                                const char *metric, const u64 *buckets)
+{
+    int b;
+    
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        if (buckets[b])
+            seq_printf(m, "%-6s %-5s %12llu %llu\n", op_name, metric,
+                       b ? 1ULL << b : 0ULL, buckets[b]);
+    }
+}
+
+static int latency_show(struct seq_file *m, void *v)
+{
+    struct latency_hist *merged;
+    int op;
+    
+    merged = kmalloc(sizeof(*merged), GFP_KERNEL);
+    if (!merged)
+        return -ENOMEM;
+    
+    latency_merge(merged);
+    
+    seq_printf(m, "# tracking=%d\n", static_key_enabled(&latency_tracking));
+    seq_puts(m, "# op     metric  bucket_ns    count\n");
+    for (op = 0; op < STACK_OP_COUNT; op++) {
+        latency_show_metric(m, stack_op_names[op], "wait", merged->ops[op].wait);
+        latency_show_metric(m, stack_op_names[op], "hold", merged->ops[op].hold);
+        latency_show_metric(m, stack_op_names[op], "total", merged->ops[op].total);
+    }
+    
+    kfree(merged);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int latency_enable_get(void *data, u64 *val)
+{
+    *val = static_key_enabled(&latency_tracking);
+    return 0;
+}
+
+static int latency_enable_set(void *data, u64 val)
+{
+    if (val)
+        static_branch_enable(&latency_tracking);
+    else
+        static_branch_disable(&latency_tracking);
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(latency_enable_fops, latency_enable_get,
+                         latency_enable_set, "%llu\n");
+
+static int latency_reset_set(void *data, u64 val)
+{
+    int cpu;
+    
+    /* Racy against concurrent increments, which only lose a few samples */
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&latency_hist, cpu), 0, sizeof(struct latency_hist));
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(latency_reset_fops, NULL, latency_reset_set, "%llu\n");
+
+/*
+ * Sojourn time of popped elements, from the coarse enqueue timestamp kept
+ * when element_timestamps is set. Same log2 buckets as the latency histograms.
+ */
+struct sojourn_hist {
+    u64 buckets[LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct sojourn_hist, sojourn_hist);
+
+static inline void sojourn_record(u64 enqueued_at)
+{
+    u64 now = ktime_get_coarse_ns();
+    
+    this_cpu_inc(sojourn_hist.buckets[latency_bucket(now > enqueued_at ? now - enqueued_at : 0)]);
+}
+
+static int sojourn_show(struct seq_file *m, void *v)
+{
+    u64 merged[LATENCY_BUCKETS] = { 0 };
+    u64 oldest = READ_ONCE(dev_buffer->oldest_timestamp);
+    int cpu;
+    int b;
+    
+    for_each_possible_cpu(cpu) {
+        struct sojourn_hist *hist = per_cpu_ptr(&sojourn_hist, cpu);
+        
+        for (b = 0; b < LATENCY_BUCKETS; b++)
+            merged[b] += READ_ONCE(hist->buckets[b]);
+    }
+    
+    seq_printf(m, "# element_timestamps=%d\n", element_timestamps);
+    seq_printf(m, "oldest_age_ns %llu\n",
+               oldest ? ktime_get_coarse_ns() - oldest : 0ULL);
+    seq_puts(m, "# bucket_ns    count\n");
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        if (merged[b])
+            seq_printf(m, "%12llu %llu\n", b ? 1ULL << b : 0ULL, merged[b]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sojourn);
+
+/*
+ * Per-process attribution. Each CPU owns a small direct-mapped cache of
+ * per-TGID counters that is updated after op_lock has been dropped. Slots
+ * are folded into a bounded global table, with LRU eviction, when they are
+ * displaced by another process or when the table is read.
+ */
+enum client_event {
+    CLIENT_PUSH,
+    CLIENT_POP,
+    CLIENT_OVERFLOW,
+};
+
+#define CLIENT_CACHE_BITS 5
+#define CLIENT_HASH_BITS 8
+
+struct client_counters {
+    u64 pushes;
+    u64 pops;
+    u64 overflows;
+    u64 bytes;
+};
+
+struct client_slot {
+    pid_t tgid;
+    char comm[TASK_COMM_LEN];
+    struct client_counters counters;
+};
+
+struct client_cache {
+    spinlock_t lock;
+    struct client_slot slots[1 << CLIENT_CACHE_BITS];
+};
+
+struct client_entry {
+    struct hlist_node node;
+    struct list_head lru;
+    pid_t tgid;
+    char comm[TASK_COMM_LEN];
+    struct client_counters counters;
+};
+
+static DEFINE_PER_CPU(struct client_cache, client_cache);
+static DEFINE_HASHTABLE(client_hash, CLIENT_HASH_BITS);
+static LIST_HEAD(client_lru);
+static LIST_HEAD(client_free);
+static DEFINE_SPINLOCK(client_lock);
+static struct client_entry *client_pool;
+
+static struct client_entry *client_get_entry(pid_t tgid, const char *comm)
+{
+    struct client_entry *entry;
+    
+    hash_for_each_possible(client_hash, entry, node, tgid) {
+        if (entry->tgid == tgid)
+            return entry;
+    }
+    
+    if (!list_empty(&client_free)) {
+        entry = list_first_entry(&client_free, struct client_entry, lru);
+    } else {
+        /* Evict the least recently updated process */
+        entry = list_last_entry(&client_lru, struct client_entry, lru);
+        hash_del(&entry->node);
+    }
+    
+    entry->tgid = tgid;
+    strscpy(entry->comm, comm, sizeof(entry->comm));
+    memset(&entry->counters, 0, sizeof(entry->counters));
+    hash_add(client_hash, &entry->node, tgid);
+    list_move(&entry->lru, &client_lru);
+    
+    return entry;
+}
+
+/* Called with the slot's cache lock and client_lock held */
+static void client_flush_slot(struct client_slot *slot)
+{
+    struct client_entry *entry;
+    
+    if (!slot->tgid)
+        return;
+    
+    entry = client_get_entry(slot->tgid, slot->comm);
+    entry->counters.pushes += slot->counters.pushes;
+    entry->counters.pops += slot->counters.pops;
+    entry->counters.overflows += slot->counters.overflows;
+    entry->counters.bytes += slot->counters.bytes;
+    list_move(&entry->lru, &client_lru);
+    
+    slot->tgid = 0;
+    memset(&slot->counters, 0, sizeof(slot->counters));
+}
+
+static void client_account(enum client_event event, size_t bytes)
+{
+    struct client_cache *cache;
+    struct client_slot *slot;
+    pid_t tgid = current->tgid;
+    
+    if (!client_pool)
+        return;
+    
+    /* Migrating after picking the cache is harmless, the lock still protects it */
+    cache = raw_cpu_ptr(&client_cache);
+    slot = &cache->slots[hash_32(tgid, CLIENT_CACHE_BITS)];
+    
+    spin_lock(&cache->lock);
+    if (slot->tgid != tgid) {
+        if (slot->tgid) {
+            spin_lock(&client_lock);
+            client_flush_slot(slot);
+            spin_unlock(&client_lock);
+        }
+        slot->tgid = tgid;
+        strscpy(slot->comm, current->comm, sizeof(slot->comm));
+    }
+    
+    switch (event) {
+    case CLIENT_PUSH:
+        slot->counters.pushes += bytes / sizeof(int);
+        break;
+    case CLIENT_POP:
+        slot->counters.pops += bytes / sizeof(int);
+        break;
+    case CLIENT_OVERFLOW:
+        slot->counters.overflows++;
+        break;
+    }
+    slot->counters.bytes += bytes;
+    spin_unlock(&cache->lock);
+}
+
+static void client_flush_all(void)
+{
+    int cpu;
+    int i;
+    
+    for_each_possible_cpu(cpu) {
+        struct client_cache *cache = per_cpu_ptr(&client_cache, cpu);
+        
+        spin_lock(&cache->lock);
+        spin_lock(&client_lock);
+        for (i = 0; i < ARRAY_SIZE(cache->slots); i++)
+            client_flush_slot(&cache->slots[i]);
+        spin_unlock(&client_lock);
+        spin_unlock(&cache->lock);
+    }
+}
+
+static u64 client_total_ops(const struct client_entry *entry)
+{
+    return entry->counters.pushes + entry->counters.pops + entry->counters.overflows;
+}
+
+static int client_cmp(const void *a, const void *b)
+{
+    u64 ops_a = client_total_ops(a);
+    u64 ops_b = client_total_ops(b);
+    
+    if (ops_a == ops_b)
+        return 0;
+    return ops_a < ops_b ? 1 : -1;
+}
+
+static int clients_show(struct seq_file *m, void *v)
+{
+    struct client_entry *snapshot;
+    struct client_entry *entry;
+    int count = 0;
+    int i;
+    
+    if (!client_pool)
+        return 0;
+    
+    snapshot = kvmalloc_array(client_table_size, sizeof(*snapshot), GFP_KERNEL);
+    if (!snapshot)
+        return -ENOMEM;
+    
+    client_flush_all();
+    
+    spin_lock(&client_lock);
+    list_for_each_entry(entry, &client_lru, lru)
+        snapshot[count++] = *entry;
+    spin_unlock(&client_lock);
+    
+    sort(snapshot, count, sizeof(*snapshot), client_cmp, NULL);
+    
+    seq_puts(m, "# tgid       comm             pushes       pops         overflows    bytes\n");
+    for (i = 0; i < count; i++) {
+        seq_printf(m, "%-10d %-16s %-12llu %-12llu %-12llu %llu\n",
+                   snapshot[i].tgid, snapshot[i].comm,
+                   snapshot[i].counters.pushes, snapshot[i].counters.pops,
+                   snapshot[i].counters.overflows, snapshot[i].counters.bytes);
+    }
+    
+    kvfree(snapshot);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(clients);
+
+static int init_client_table(void)
+{
+    int cpu;
+    int i;
+    
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(&client_cache, cpu)->lock);
+    
+    if (client_table_size <= 0)
+        return 0;
+    
+    client_pool = kvcalloc(client_table_size, sizeof(*client_pool), GFP_KERNEL);
+    if (!client_pool)
+        return -ENOMEM;
+    
+    for (i = 0; i < client_table_size; i++)
+        list_add_tail(&client_pool[i].lru, &client_free);
+    
+    return 0;
+}
+
+static enum hrtimer_restart depth_sample_fn(struct hrtimer *timer)
+{
+    struct depth_sampler *sampler = container_of(timer, struct depth_sampler, timer);
+    struct integer_buffer *buffer = container_of(sampler, struct integer_buffer, sampler);
+    struct int_stack_depth_sample *sample;
+    unsigned long flags;
+    u64 period = READ_ONCE(sampler->period_ns);
+    
+    spin_lock_irqsave(&sampler->lock, flags);
+    sample = &sampler->ring[sampler->head];
+    sample->timestamp_ns = ktime_get_ns();
+    sample->depth = READ_ONCE(buffer->position);
+    sample->capacity = READ_ONCE(buffer->capacity);
+    sampler->head = (sampler->head + 1) % sampler->size;
+    if (sampler->count < sampler->size)
+        sampler->count++;
+    else
+        sampler->overwritten++;
+    spin_unlock_irqrestore(&sampler->lock, flags);
+    
+    if (!period)
+        return HRTIMER_NORESTART;
+    
+    hrtimer_forward_now(timer, ns_to_ktime(period));
+    return HRTIMER_RESTART;
+}
+
+/* Nonzero periods are raised to INT_STACK_MIN_SAMPLE_PERIOD_US */
+static void set_sample_period(struct integer_buffer *buffer, u64 period_ns)
+{
+    struct depth_sampler *sampler = &buffer->sampler;
+    
+    if (!sampler->ring)
+        return;
+    
+    if (period_ns)
+        period_ns = max_t(u64, period_ns,
+                          (u64)INT_STACK_MIN_SAMPLE_PERIOD_US * NSEC_PER_USEC);
+    
+    hrtimer_cancel(&sampler->timer);
+    WRITE_ONCE(sampler->period_ns, period_ns);
+    if (period_ns)
+        hrtimer_start(&sampler->timer, ns_to_ktime(period_ns), HRTIMER_MODE_REL);
+}
+
+static int init_sampler(struct integer_buffer *buffer)
+{
+    struct depth_sampler *sampler = &buffer->sampler;
+    
+    spin_lock_init(&sampler->lock);
+    hrtimer_init(&sampler->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sampler->timer.function = depth_sample_fn;
+    
+    if (depth_ring_size <= 0)
+        return 0;
+    
+    sampler->ring = kvcalloc(depth_ring_size, sizeof(*sampler->ring), GFP_KERNEL);
+    if (!sampler->ring)
+        return -ENOMEM;
+    sampler->size = depth_ring_size;
+    
+    return 0;
+}
+
+static void release_sampler(struct integer_buffer *buffer)
+{
+    hrtimer_cancel(&buffer->sampler.timer);
+    kvfree(buffer->sampler.ring);
+    buffer->sampler.ring = NULL;
+}
+
+/* Drains whole samples, oldest first; returns 0 once the ring is empty */
+static ssize_t sampler_drain(struct depth_sampler *sampler, char __user *user_buffer,
+                             size_t count)
+{
+    struct int_stack_depth_sample chunk[32];
+    unsigned long flags;
+    size_t done = 0;
+    
+    if (!sampler->ring)
+        return 0;
+    
+    while (count - done >= sizeof(chunk[0])) {
+        unsigned int n = min_t(size_t, ARRAY_SIZE(chunk),
+                               (count - done) / sizeof(chunk[0]));
+        unsigned int tail;
+        unsigned int i;
+        
+        spin_lock_irqsave(&sampler->lock, flags);
+        n = min(n, sampler->count);
+        tail = (sampler->head + sampler->size - sampler->count) % sampler->size;
+        for (i = 0; i < n; i++)
+            chunk[i] = sampler->ring[(tail + i) % sampler->size];
+        sampler->count -= n;
+        spin_unlock_irqrestore(&sampler->lock, flags);
+        
+        if (n == 0)
+            break;
+        
+        if (copy_to_user(user_buffer + done, chunk, n * sizeof(chunk[0])))
+            return done ? done : -EFAULT;
+        done += n * sizeof(chunk[0]);
+    }
+    
+    return done;
+}
+
+static ssize_t depth_samples_read(struct file *file, char __user *user_buffer,
+                                  size_t count, loff_t *offset)
+{
+    return sampler_drain(&dev_buffer->sampler, user_buffer, count);
+}
+
+static const struct file_operations depth_samples_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = depth_samples_read,
+    .llseek = noop_llseek,
+};
+
+static int high_water_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "lifetime %zu\nwindow %zu\noverwritten_samples %llu\n",
+               READ_ONCE(dev_buffer->high_water),
+               READ_ONCE(dev_buffer->window_high_water),
+               READ_ONCE(dev_buffer->sampler.overwritten));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(high_water);
+
+/*
+ * Publish position, capacity and counters to the mmap()able status page.
+ * Writers are serialized by data_lock; readers follow the seq protocol.
+ */
+static void status_publish(struct integer_buffer *buffer)
+{
+    struct int_stack_status *status = buffer->status;
+    
+    WRITE_ONCE(buffer->oldest_timestamp,
+               buffer->timestamps && buffer->position ? buffer->timestamps[0] : 0);
+    
+    if (!status)
+        return;
+    
+    WRITE_ONCE(status->seq, status->seq + 1);
+    smp_wmb();
+    status->generation++;
+    status->position = buffer->position;
+    status->capacity = buffer->capacity;
+    status->push_count = atomic_read(&buffer->stats.push_count);
+    status->pop_count = atomic_read(&buffer->stats.pop_count);
+    status->overflow_count = atomic_read(&buffer->stats.overflow_count);
+    status->underflow_count = atomic_read(&buffer->stats.underflow_count);
+    status->oldest_timestamp_ns = buffer->oldest_timestamp;
+    status->filtered_count = atomic_read(&buffer->stats.filtered_count);
+    status->change_seq = buffer->change_seq;
+    smp_wmb();
+    WRITE_ONCE(status->seq, status->seq + 1);
+}
+
+/*
+ * Change log. Every mutation takes the next change_seq and appends a
+ * record to one ring, both under the data_lock it already holds, so the
+ * ring is in seq order and a reader finds any seq by its offset from the
+ * oldest record. Producers wake readers through an irq_work since they
+ * may run in NMI or under the raw lock.
+ */
+struct change_log {
+    struct int_stack_change *records;
+    u64 head;
+    u32 size;
+    wait_queue_head_t wait;
+    struct irq_work wake;
+};
+
+/* Called with data_lock held */
+static void change_record(struct integer_buffer *buffer, u16 type, s32 value)
+{
+    struct change_log *log = buffer->changes;
+    struct int_stack_change *record;
+    
+    buffer->change_seq++;
+    if (!log)
+        return;
+    
+    record = &log->records[log->head & (log->size - 1)];
+    record->seq = buffer->change_seq;
+    record->type = type;
+    record->stack_id = buffer->id;
+    record->value = value;
+    log->head++;
+    
+    if (wq_has_sleeper(&log->wait))
+        irq_work_queue(&log->wake);
+}
+
+static void change_wake_fn(struct irq_work *work)
+{
+    struct change_log *log = container_of(work, struct change_log, wake);
+    
+    wake_up_interruptible(&log->wait);
+}
+
+static void free_change_log(struct change_log *log)
+{
+    irq_work_sync(&log->wake);
+    kvfree(log->records);
+    kfree(log);
+}
+
+static int init_change_log(struct integer_buffer *buffer, unsigned int size)
+{
+    struct change_log *log;
+    
+    log = kzalloc(sizeof(*log), GFP_KERNEL);
+    if (!log)
+        return -ENOMEM;
+    
+    log->size = roundup_pow_of_two(size);
+    init_waitqueue_head(&log->wait);
+    init_irq_work(&log->wake, change_wake_fn);
+    
+    log->records = kvcalloc(log->size, sizeof(*log->records), GFP_KERNEL);
+    if (!log->records) {
+        kfree(log);
+        return -ENOMEM;
+    }
+    
+    /* Published under data_lock so that mutations see a complete log */
+    raw_spin_lock_irq(&buffer->data_lock);
+    buffer->changes = log;
+    raw_spin_unlock_irq(&buffer->data_lock);
+    
+    return 0;
+}
+
+static void release_change_log(struct integer_buffer *buffer)
+{
+    if (buffer->changes)
+        free_change_log(buffer->changes);
+    buffer->changes = NULL;
+}
+
+/* Index of the oldest record the ring still holds */
+static u64 change_log_first(const struct change_log *log)
+{
+    return log->head > log->size ? log->head - log->size : 0;
+}
+
+/* Oldest seq still in the log, or the next one if it is empty */
+static u64 change_log_start(struct integer_buffer *buffer)
+{
+    struct change_log *log = buffer->changes;
+    
+    if (log->head == 0)
+        return buffer->change_seq + 1;
+    return log->records[change_log_first(log) & (log->size - 1)].seq;
+}
+
+#define CHANGE_BATCH 256
+
+struct change_reader {
+    struct integer_buffer *buffer;
+    u64 next_seq;
+    struct int_stack_change batch[CHANGE_BATCH];
+};
+
+/* Takes a reference on @buffer; from_seq 0 means the oldest retained record */
+static struct change_reader *alloc_change_reader(struct integer_buffer *buffer, u64 from_seq)
+{
+    struct change_reader *reader;
+    unsigned long flags;
+    
+    reader = kvzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return NULL;
+    
+    reader->buffer = buffer;
+    reader->next_seq = from_seq;
+    if (from_seq == 0) {
+        raw_spin_lock_irqsave(&buffer->data_lock, flags);
+        reader->next_seq = change_log_start(buffer);
+        raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    }
+    
+    kref_get(&buffer->ref);
+    return reader;
+}
+
+static void free_change_reader(struct change_reader *reader)
+{
+    int_stack_put(reader->buffer);
+    kvfree(reader);
+}
+
+/* Copies up to @max records starting at next_seq into reader->batch */
+static int collect_changes(struct change_reader *reader, size_t max)
+{
+    struct integer_buffer *buffer = reader->buffer;
+    struct change_log *log = buffer->changes;
+    u64 next = reader->next_seq;
+    unsigned long flags;
+    u64 oldest, index;
+    size_t n = 0;
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    
+    oldest = change_log_start(buffer);
+    if (next < oldest) {
+        raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+        return -EOVERFLOW;
+    }
+    
+    index = change_log_first(log) + (next - oldest);
+    while (n < max && index < log->head)
+        reader->batch[n++] = log->records[index++ & (log->size - 1)];
+    
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    return n;
+}
+
+static ssize_t changes_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+{
+    struct change_reader *reader = file->private_data;
+    struct integer_buffer *buffer = reader->buffer;
+    size_t max = min_t(size_t, len / sizeof(struct int_stack_change), CHANGE_BATCH);
+    int n;
+    
+    if (max == 0)
+        return -EINVAL;
+    
+    while ((n = collect_changes(reader, max)) == 0) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(buffer->changes->wait,
+                                     READ_ONCE(buffer->change_seq) >= reader->next_seq))
+            return -ERESTARTSYS;
+    }
+    
+    if (n < 0)
+        return n;
+    
+    if (copy_to_user(buf, reader->batch, n * sizeof(struct int_stack_change)))
+        return -EFAULT;
+    
+    reader->next_seq += n;
+    return n * sizeof(struct int_stack_change);
+}
+
+static __poll_t changes_poll(struct file *file, poll_table *wait)
+{
+    struct change_reader *reader = file->private_data;
+    struct integer_buffer *buffer = reader->buffer;
+    
+    poll_wait(file, &buffer->changes->wait, wait);
+    
+    if (READ_ONCE(buffer->change_seq) >= reader->next_seq)
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+static int changes_release(struct inode *inode, struct file *file)
+{
+    free_change_reader(file->private_data);
+    return 0;
+}
+
+static const struct file_operations changes_fops = {
+    .owner = THIS_MODULE,
+    .read = changes_read,
+    .poll = changes_poll,
+    .release = changes_release,
+    .llseek = noop_llseek,
+};
+
+static int open_changes(struct integer_buffer *buffer, u64 from_seq)
+{
+    struct change_reader *reader;
+    int fd;
+    
+    if (!buffer->changes)
+        return -EOPNOTSUPP;
+    
+    reader = alloc_change_reader(buffer, from_seq);
+    if (!reader)
+        return -ENOMEM;
+    
+    fd = anon_inode_getfd("int_stack_changes", &changes_fops, reader, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        free_change_reader(reader);
+    
+    return fd;
+}
+
+static struct miscdevice buffer_device;
+
+static struct key_gate *file_gate(struct file *file, struct integer_buffer **buffer)
+{
+    struct miscdevice *misc = file->private_data;
+    struct usb_key *key;
+    
+    if (misc == &buffer_device) {
+        *buffer = dev_buffer;
+        return &shared_gate;
+    }
+    
+    key = container_of(misc, struct usb_key, misc);
+    *buffer = key->buffer;
+    return &key->gate;
+}
+
+/*
+ * Enters an op on the opened node and returns its stack. While the key
+ * is out within the grace period callers wait for it (-EAGAIN with
+ * O_NONBLOCK); afterwards they get -ENODEV. Paired with gate_exit().
+ */
+static struct integer_buffer *gate_enter(struct file *file)
+{
+    struct integer_buffer *buffer;
+    struct key_gate *gate;
+    
+    if (static_branch_unlikely(&shared_always_present) &&
+        file->private_data == &buffer_device)
+        return dev_buffer;
+    
+    gate = file_gate(file, &buffer);
+    
+    for (;;) {
+        if (likely(percpu_ref_tryget_live(&gate->ref)))
+            return buffer;
+        
+        if (!atomic_read(&gate->grace))
+            return ERR_PTR(-ENODEV);
+        if (file->f_flags & O_NONBLOCK)
+            return ERR_PTR(-EAGAIN);
+        
+        if (wait_event_interruptible(gate->wait, atomic_read(&gate->present) ||
+                                     !atomic_read(&gate->grace)))
+            return ERR_PTR(-ERESTARTSYS);
+    }
+}
+
+static void gate_exit(struct file *file)
+{
+    struct integer_buffer *buffer;
+    
+    if (static_branch_unlikely(&shared_always_present) &&
+        file->private_data == &buffer_device)
+        return;
+    
+    percpu_ref_put(&file_gate(file, &buffer)->ref);
+}
+
+static int buffer_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct integer_buffer *buffer;
+    struct key_gate *gate = file_gate(file, &buffer);
+    unsigned long size = vma->vm_end - vma->vm_start;
+    
+    /* The status page stays valid, so there is no need to wait for the key */
+    if (!atomic_read(&gate->present) && !atomic_read(&gate->grace))
+        return -ENODEV;
+    
+    if (vma->vm_pgoff != 0 || size > PAGE_SIZE)
+        return -EINVAL;
+    
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    
+    vm_flags_clear(vma, VM_MAYWRITE);
+    /* vm_insert_page takes a page reference, so mappings may outlive the module */
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(buffer->status));
+}
+
+static struct integer_buffer *find_stack_rcu(const char *name)
+{
+    struct integer_buffer *buffer;
+    
+    list_for_each_entry_rcu(buffer, &stack_list, node) {
+        if (strcmp(buffer->name, name) == 0)
+            return buffer;
+    }
+    return NULL;
+}
+
+/* The *_locked helpers are called with data_lock held */
+static int stack_push_locked(struct integer_buffer *buffer, int value)
+{
+    int result;
+    
+    result = stack_core_push(&buffer->core, value,
+                             buffer->timestamps ? ktime_get_coarse_ns() : 0);
+    if (result == 0)
+        change_record(buffer, INT_STACK_CHANGE_PUSH, value);
+    status_publish(buffer);
+    
+    return result;
+}
+
+/* Pops without a change record, for callers that log a batch */
+static int __stack_pop_locked(struct integer_buffer *buffer, int *value)
+{
+    u64 enqueued_ns;
+    int result;
+    
+    result = stack_core_pop(&buffer->core, value, &enqueued_ns);
+    if (result == 0 && buffer->timestamps)
+        sojourn_record(enqueued_ns);
+    status_publish(buffer);
+    
+    return result;
+}
+
+static int stack_pop_locked(struct integer_buffer *buffer, int *value)
+{
+    int result = __stack_pop_locked(buffer, value);
+    
+    if (result == 0)
+        change_record(buffer, INT_STACK_CHANGE_POP, 1);
+    return result;
+}
+
+/*
+ * Push filters and stage programs are BPF_PROG_TYPE_SYSCALL programs:
+ * their context is plain memory, so an on-stack struct
+ * int_stack_filter_ctx is handed to them directly. The verifier lets
+ * them access up to U16_MAX bytes of it, so, like
+ * bpf_prog_test_run_syscall(), only programs that stay within the struct
+ * are taken. Sleepable ones (libbpf's default for SEC("syscall")) may call
+ * bpf_sys_bpf() and bpf_sys_close(), which act on the fd table of
+ * whichever task is pushing, so attaching one takes CAP_SYS_ADMIN and
+ * not just CAP_BPF.
+ */
+static struct bpf_prog *get_value_prog(int prog_fd)
+{
+    struct bpf_prog *prog;
+    
+    prog = bpf_prog_get_type(prog_fd, BPF_PROG_TYPE_SYSCALL);
+    if (IS_ERR(prog))
+        return prog;
+    
+    if (prog->aux->max_ctx_offset > sizeof(struct int_stack_filter_ctx)) {
+        bpf_prog_put(prog);
+        return ERR_PTR(-EINVAL);
+    }
+    if (prog->sleepable && !capable(CAP_SYS_ADMIN)) {
+        bpf_prog_put(prog);
+        return ERR_PTR(-EPERM);
+    }
+    
+    return prog;
+}
+
+/*
+ * Filters are swapped and run under op_lock, outside data_lock, since
+ * they may be sleepable.
+ */
+static int set_push_filter(struct integer_buffer *buffer, int prog_fd)
+{
+    struct bpf_prog *prog = NULL;
+    
+    if (!bpf_capable())
+        return -EPERM;
+    
+    if (prog_fd >= 0) {
+        prog = get_value_prog(prog_fd);
+        if (IS_ERR(prog))
+            return PTR_ERR(prog);
+    }
+    
+    if (buffer->push_filter)
+        bpf_prog_put(buffer->push_filter);
+    buffer->push_filter = prog;
+    
+    return 0;
+}
+
+/* Runs a push filter or a stage program on one element */
+static u32 run_value_prog(struct bpf_prog *prog, struct integer_buffer *buffer,
+                          int *value)
+{
+    struct int_stack_filter_ctx ctx;
+    u32 verdict;
+    
+    ctx.value = *value;
+    ctx.depth = READ_ONCE(buffer->position);
+    ctx.capacity = buffer->capacity;
+    ctx.tgid = current->tgid;
+    
+    if (prog->sleepable)
+        rcu_read_lock_trace();
+    else
+        rcu_read_lock();
+    verdict = bpf_prog_run_pin_on_cpu(prog, &ctx);
+    if (prog->sleepable)
+        rcu_read_unlock_trace();
+    else
+        rcu_read_unlock();
+    
+    if (verdict == INT_STACK_FILTER_REWRITE)
+        *value = ctx.value;
+    else if (verdict != INT_STACK_FILTER_REJECT)
+        verdict = INT_STACK_FILTER_ACCEPT;
+    
+    return verdict;
+}
+
+/*
+ * A consumer stage attached to a source stack. Pushes queue its workers
+ * once the depth reaches threshold; each worker then drains the source in
+ * batches until it is empty.
+ */
+struct consumer_work {
+    struct work_struct work;
+    struct stack_consumer *consumer;
+    int *in;
+    int *out;
+};
+
+struct stack_consumer {
+    struct integer_buffer *source;
+    struct integer_buffer *output;
+    struct int_stack_transform *transform;
+    struct bpf_prog *prog;
+    unsigned int threshold;
+    unsigned int batch_size;
+    unsigned int max_active;
+    bool stopping;
+    struct workqueue_struct *wq;
+    atomic64_t processed;
+    atomic64_t dropped;
+    atomic64_t batches;
+    struct consumer_work workers[];
+};
+
+/* Called after a successful push; queue_work() is not NMI safe */
+static void consumer_kick(struct integer_buffer *buffer)
+{
+    struct stack_consumer *consumer;
+    unsigned int i;
+    
+    if (!rcu_access_pointer(buffer->consumer) || in_nmi())
+        return;
+    
+    rcu_read_lock();
+    consumer = rcu_dereference(buffer->consumer);
+    if (consumer && READ_ONCE(buffer->position) >= consumer->threshold) {
+        for (i = 0; i < consumer->max_active; i++)
+            queue_work(consumer->wq, &consumer->workers[i].work);
+    }
+    rcu_read_unlock();
+}
+
+static void consumer_kick_fn(struct irq_work *work)
+{
+    consumer_kick(container_of(work, struct integer_buffer, consumer_kick));
+}
+
+/*
+ * BPF programs kick through an irq_work: one attached inside the
+ * workqueue code, under a pool lock, would deadlock in queue_work().
+ */
+static void consumer_kick_deferred(struct integer_buffer *buffer)
+{
+    if (rcu_access_pointer(buffer->consumer))
+        irq_work_queue(&buffer->consumer_kick);
+}
+
+static int do_resize_buffer(struct integer_buffer *buffer, size_t new_capacity)
+{
+    size_t old_capacity = buffer->capacity;
+    int *new_array = NULL;
+    int *old_array;
+    u64 *new_timestamps = NULL;
+    u64 *old_timestamps;
+    unsigned long flags;
+    size_t copy_size;
+    size_t copied;
+    u64 copy_ns = 0;
+    
+    if (new_capacity > 0) {
+        new_array = kvcalloc(new_capacity, sizeof(int), GFP_KERNEL);
+        if (!new_array)
+            return -ENOMEM;
+        
+        if (element_timestamps) {
+            new_timestamps = kvcalloc(new_capacity, sizeof(u64), GFP_KERNEL);
+            if (!new_timestamps) {
+                kvfree(new_array);
+                return -ENOMEM;
+            }
+        }
+    }
+    
+    /*
+     * op_lock keeps the arrays in place, so the bulk copy runs with IRQs
+     * on; _atomic pushes and pops meanwhile are caught up by the final
+     * copy from copy_floor under data_lock.
+     */
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    copied = stack_core_copy_start(&buffer->core, new_capacity);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    if (trace_int_stack_resize_enabled()) {
+        u64 copy_start = ktime_get_ns();
+        
+        stack_core_copy(&buffer->core, new_array, new_timestamps, 0, copied);
+        copy_ns = ktime_get_ns() - copy_start;
+    } else {
+        stack_core_copy(&buffer->core, new_array, new_timestamps, 0, copied);
+    }
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    copy_size = stack_core_replace(&buffer->core, new_array, new_timestamps,
+                                   new_capacity, copied, &old_array, &old_timestamps);
+    change_record(buffer, INT_STACK_CHANGE_RESIZE, new_capacity);
+    status_publish(buffer);
+    
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    kvfree(old_array);
+    kvfree(old_timestamps);
+    
+    trace_int_stack_resize(buffer->id, copy_size, old_capacity,
+                           new_capacity, copy_ns);
+    return 0;
+}
+
+/* Called with op_lock held */
+static int resize_buffer(struct integer_buffer *buffer, size_t new_capacity)
+{
+    struct op_timing timing;
+    int result;
+    
+    op_timing_start(&timing);
+    result = do_resize_buffer(buffer, new_capacity);
+    op_timing_end(STACK_OP_RESIZE, &timing);
+    
+    return result;
+}
+
+/* Grows the stack, when auto-resize is on, so that @count more elements fit */
+static void auto_resize(struct integer_buffer *buffer, size_t count)
+{
+    size_t needed = READ_ONCE(buffer->position) + count;
+    
+    if (!enable_auto_resize || needed <= buffer->capacity)
+        return;
+    
+    /* A failed resize simply lets the push overflow */
+    resize_buffer(buffer, stack_core_grow_capacity(buffer->capacity, needed));
+}
+
+/*
+ * From NMI the data lock is only tried, and so it is for BPF programs
+ * (try_only): a kprobe or fentry program on anything called with
+ * data_lock held, such as irq_work_queue() from change_record() or the
+ * ktime getters, would otherwise spin on a lock its own CPU holds. They
+ * also leave queue_work() to an irq_work (consumer_kick_deferred()).
+ */
+static bool stack_lock_atomic(struct integer_buffer *buffer, unsigned long *flags,
+                              bool try_only)
+{
+    if (try_only || in_nmi())
+        return raw_spin_trylock_irqsave(&buffer->data_lock, *flags);
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, *flags);
+    return true;
+}
+
+static int __int_stack_push(struct integer_buffer *buffer, int value,
+                            struct op_timing *timing)
+{
+    unsigned long flags;
+    size_t depth;
+    int result;
+    
+    stack_lock(buffer, timing);
+    
+    if (buffer->push_filter &&
+        run_value_prog(buffer->push_filter, buffer, &value) == INT_STACK_FILTER_REJECT) {
+        atomic_inc(&buffer->stats.filtered_count);
+        stack_unlock(buffer, timing);
+        return -EPERM;
+    }
+    
+    auto_resize(buffer, 1);
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    result = stack_push_locked(buffer, value);
+    depth = buffer->position;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    stack_unlock(buffer, timing);
+    
+    if (result < 0) {
+        trace_int_stack_overflow(buffer->id, depth);
+    } else {
+        trace_int_stack_push(buffer->id, depth, value);
+        consumer_kick(buffer);
+    }
+    
+    return result;
+}
+
+/*
+ * Pushes @count values under one op_lock hold with the same outcome as
+ * pushing them one at a time: it stops at the first value the filter
+ * rejects or that does not fit. Returns how many were pushed, or the
+ * error of the first value.
+ */
+static int __int_stack_push_batch(struct integer_buffer *buffer, const int *values,
+                                  size_t count, struct op_timing *timing)
+{
+    unsigned long flags;
+    size_t done = 0;
+    int result = 0;
+    
+    stack_lock(buffer, timing);
+    
+    while (done < count) {
+        int value = values[done];
+        
+        if (buffer->push_filter &&
+            run_value_prog(buffer->push_filter, buffer, &value) == INT_STACK_FILTER_REJECT) {
+            atomic_inc(&buffer->stats.filtered_count);
+            result = -EPERM;
+            break;
+        }
+        
+        auto_resize(buffer, count - done);
+        
+        raw_spin_lock_irqsave(&buffer->data_lock, flags);
+        result = stack_push_locked(buffer, value);
+        raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+        
+        if (result < 0) {
+            trace_int_stack_overflow(buffer->id, READ_ONCE(buffer->position));
+            break;
+        }
+        trace_int_stack_push(buffer->id, READ_ONCE(buffer->position), value);
+        done++;
+    }
+    
+    stack_unlock(buffer, timing);
+    
+    if (done)
+        consumer_kick(buffer);
+    
+    return done ? done : result;
+}
+
+static int __int_stack_pop(struct integer_buffer *buffer, int *value,
+                           struct op_timing *timing)
+{
+    unsigned long flags;
+    size_t depth;
+    int result;
+    
+    stack_lock(buffer, timing);
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    result = stack_pop_locked(buffer, value);
+    depth = buffer->position;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    stack_unlock(buffer, timing);
+    
+    if (result < 0)
+        trace_int_stack_underflow(buffer->id, 0);
+    else
+        trace_int_stack_pop(buffer->id, depth, *value);
+    
+    return result;
+}
+
+/*
+ * In-kernel API. The plain variants may sleep: they serialize on op_lock
+ * with the file operations, run the push filter and auto-resize. The
+ * _atomic variants only take data_lock and are safe from any context,
+ * but never resize.
+ */
+
+/**
+ * int_stack_push - push one value
+ * Returns 0, -ENOSPC when the stack is full or -EPERM when filtered out.
+ */
+int int_stack_push(struct integer_buffer *buffer, int value)
+{
+    struct op_timing timing;
+    int result;
+    
+    op_timing_start(&timing);
+    result = __int_stack_push(buffer, value, &timing);
+    op_timing_end(STACK_OP_PUSH, &timing);
+    
+    return result;
+}
+EXPORT_SYMBOL_GPL(int_stack_push);
+
+/**
+ * int_stack_push_n - push up to @count values, values[0] first
+ * Returns how many values were consumed (pushed or filtered out), or
+ * -ENOSPC if the stack was already full.
+ */
+int int_stack_push_n(struct integer_buffer *buffer, const int *values, size_t count)
+{
+    struct op_timing timing;
+    unsigned long flags;
+    size_t done = 0;
+    int result = 0;
+    
+    op_timing_start(&timing);
+    stack_lock(buffer, &timing);
+    
+    auto_resize(buffer, count);
+    
+    while (done < count && result == 0) {
+        int value = values[done];
+        
+        if (buffer->push_filter &&
+            run_value_prog(buffer->push_filter, buffer, &value) == INT_STACK_FILTER_REJECT) {
+            atomic_inc(&buffer->stats.filtered_count);
+            done++;
+            continue;
+        }
+        
+        raw_spin_lock_irqsave(&buffer->data_lock, flags);
+        result = stack_push_locked(buffer, value);
+        raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+        
+        if (result == 0) {
+            trace_int_stack_push(buffer->id, READ_ONCE(buffer->position), value);
+            done++;
+        } else {
+            trace_int_stack_overflow(buffer->id, READ_ONCE(buffer->position));
+        }
+    }
+    
+    stack_unlock(buffer, &timing);
+    op_timing_end(STACK_OP_PUSH, &timing);
+    
+    if (done)
+        consumer_kick(buffer);
+    
+    if (done == 0 && result < 0)
+        return result;
+    return done;
+}
+EXPORT_SYMBOL_GPL(int_stack_push_n);
+
+/**
+ * int_stack_pop - pop the top value
+ * Returns 0 or -ENODATA when the stack is empty.
+ */
+int int_stack_pop(struct integer_buffer *buffer, int *value)
+{
+    struct op_timing timing;
+    int result;
+    
+    op_timing_start(&timing);
+    result = __int_stack_pop(buffer, value, &timing);
+    op_timing_end(STACK_OP_POP, &timing);
+    
+    return result;
+}
+EXPORT_SYMBOL_GPL(int_stack_pop);
+
+/* Pops values under one data_lock hold, top first */
+static int stack_pop_n_locked(struct integer_buffer *buffer, int *values, size_t count)
+{
+    size_t done = 0;
+    
+    while (done < count && __stack_pop_locked(buffer, &values[done]) == 0)
+        done++;
+    if (done)
+        change_record(buffer, INT_STACK_CHANGE_POP, done);
+    
+    return done;
+}
+
+/**
+ * int_stack_pop_n - pop up to @count values, top of the stack first
+ * Returns how many values were popped.
+ */
+int int_stack_pop_n(struct integer_buffer *buffer, int *values, size_t count)
+{
+    struct op_timing timing;
+    unsigned long flags;
+    int result;
+    
+    op_timing_start(&timing);
+    stack_lock(buffer, &timing);
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    result = stack_pop_n_locked(buffer, values, count);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    stack_unlock(buffer, &timing);
+    op_timing_end(STACK_OP_POP, &timing);
+    
+    if (result > 0)
+        trace_int_stack_pop(buffer->id, READ_ONCE(buffer->position), values[result - 1]);
+    else if (count)
+        trace_int_stack_underflow(buffer->id, 0);
+    
+    return result;
+}
+EXPORT_SYMBOL_GPL(int_stack_pop_n);
+
+/**
+ * int_stack_usage - current depth, safe from any context
+ */
+size_t int_stack_usage(struct integer_buffer *buffer)
+{
+    return READ_ONCE(buffer->position);
+}
+EXPORT_SYMBOL_GPL(int_stack_usage);
+
+/**
+ * int_stack_clear - drop every element, safe from any context
+ */
+void int_stack_clear(struct integer_buffer *buffer)
+{
+    unsigned long flags;
+    size_t depth;
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    depth = buffer->position;
+    stack_core_clear(&buffer->core);
+    change_record(buffer, INT_STACK_CHANGE_CLEAR, 0);
+    status_publish(buffer);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    trace_int_stack_clear(buffer->id, depth);
+}
+EXPORT_SYMBOL_GPL(int_stack_clear);
+
+static int __int_stack_push_atomic(struct integer_buffer *buffer, int value,
+                                   bool try_only)
+{
+    unsigned long flags;
+    size_t depth;
+    int result;
+    
+    if (!stack_lock_atomic(buffer, &flags, try_only))
+        return -EBUSY;
+    result = stack_push_locked(buffer, value);
+    depth = buffer->position;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    if (result < 0) {
+        trace_int_stack_overflow(buffer->id, depth);
+    } else {
+        trace_int_stack_push(buffer->id, depth, value);
+        if (try_only)
+            consumer_kick_deferred(buffer);
+        else
+            consumer_kick(buffer);
+    }
+    
+    return result;
+}
+
+/**
+ * int_stack_push_atomic - push one value from any context
+ * Returns 0, -ENOSPC when full or -EBUSY when the lock could not be
+ * taken from NMI.
+ */
+int int_stack_push_atomic(struct integer_buffer *buffer, int value)
+{
+    return __int_stack_push_atomic(buffer, value, false);
+}
+EXPORT_SYMBOL_GPL(int_stack_push_atomic);
+
+/**
+ * int_stack_push_n_atomic - push up to @count values from any context
+ * Returns how many were pushed, -ENOSPC when full or -EBUSY from NMI.
+ */
+int int_stack_push_n_atomic(struct integer_buffer *buffer, const int *values, size_t count)
+{
+    unsigned long flags;
+    size_t done = 0;
+    
+    if (!stack_lock_atomic(buffer, &flags, false))
+        return -EBUSY;
+    while (done < count && stack_push_locked(buffer, values[done]) == 0)
+        done++;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    if (done) {
+        trace_int_stack_push(buffer->id, READ_ONCE(buffer->position), values[done - 1]);
+        consumer_kick(buffer);
+    }
+    if (done < count)
+        trace_int_stack_overflow(buffer->id, READ_ONCE(buffer->position));
+    
+    if (done == 0 && count > 0)
+        return -ENOSPC;
+    return done;
+}
+EXPORT_SYMBOL_GPL(int_stack_push_n_atomic);
+
+static int __int_stack_pop_atomic(struct integer_buffer *buffer, int *value,
+                                  bool try_only)
+{
+    unsigned long flags;
+    size_t depth;
+    int result;
+    
+    if (!stack_lock_atomic(buffer, &flags, try_only))
+        return -EBUSY;
+    result = stack_pop_locked(buffer, value);
+    depth = buffer->position;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    if (result < 0)
+        trace_int_stack_underflow(buffer->id, 0);
+    else
+        trace_int_stack_pop(buffer->id, depth, *value);
+    
+    return result;
+}
+
+/**
+ * int_stack_pop_atomic - pop the top value from any context
+ * Returns 0, -ENODATA when empty or -EBUSY from NMI.
+ */
+int int_stack_pop_atomic(struct integer_buffer *buffer, int *value)
+{
+    return __int_stack_pop_atomic(buffer, value, false);
+}
+EXPORT_SYMBOL_GPL(int_stack_pop_atomic);
+
+/**
+ * int_stack_pop_n_atomic - pop up to @count values from any context
+ * Returns how many were popped, or -EBUSY from NMI.
+ */
+int int_stack_pop_n_atomic(struct integer_buffer *buffer, int *values, size_t count)
+{
+    unsigned long flags;
+    int result;
+    
+    if (!stack_lock_atomic(buffer, &flags, false))
+        return -EBUSY;
+    result = stack_pop_n_locked(buffer, values, count);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    if (result > 0)
+        trace_int_stack_pop(buffer->id, READ_ONCE(buffer->position), values[result - 1]);
+    
+    return result;
+}
+EXPORT_SYMBOL_GPL(int_stack_pop_n_atomic);
+
+static void init_stats(struct buffer_stats *stats)
+{
+    atomic_set(&stats->push_count, 0);
+    atomic_set(&stats->pop_count, 0);
+    atomic_set(&stats->overflow_count, 0);
+    atomic_set(&stats->underflow_count, 0);
+    atomic_set(&stats->filtered_count, 0);
+}
+
+static void free_stack(struct kref *ref)
+{
+    struct integer_buffer *buffer = container_of(ref, struct integer_buffer, ref);
+    
+    if (buffer->push_filter)
+        bpf_prog_put(buffer->push_filter);
+    release_sampler(buffer);
+    release_change_log(buffer);
+    irq_work_sync(&buffer->consumer_kick);
+    free_page((unsigned long)buffer->status);
+    kvfree(buffer->elements);
+    kvfree(buffer->timestamps);
+    mutex_destroy(&buffer->op_lock);
+    ida_free(&stack_ida, buffer->id);
+    kfree(buffer);
+}
+
+/**
+ * int_stack_create - create a named stack with an initial capacity
+ * Returns the stack or an ERR_PTR; -EEXIST if the name is taken.
+ */
+struct integer_buffer *int_stack_create(const char *name, size_t capacity)
+{
+    struct integer_buffer *buffer;
+    bool exists;
+    int result;
+    
+    buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+    if (!buffer)
+        return ERR_PTR(-ENOMEM);
+    
+    result = ida_alloc(&stack_ida, GFP_KERNEL);
+    if (result < 0) {
+        kfree(buffer);
+        return ERR_PTR(result);
+    }
+    
+    buffer->id = result;
+    strscpy(buffer->name, name, sizeof(buffer->name));
+    kref_init(&buffer->ref);
+    mutex_init(&buffer->op_lock);
+    raw_spin_lock_init(&buffer->data_lock);
+    init_irq_work(&buffer->consumer_kick, consumer_kick_fn);
+    init_stats(&buffer->stats);
+    
+    result = init_sampler(buffer);
+    if (result == 0) {
+        buffer->status = (struct int_stack_status *)get_zeroed_page(GFP_KERNEL);
+        if (!buffer->status)
+            result = -ENOMEM;
+    }
+    
+    if (result == 0 && capacity > 0) {
+        mutex_lock(&buffer->op_lock);
+        result = resize_buffer(buffer, capacity);
+        mutex_unlock(&buffer->op_lock);
+    }
+    
+    if (result < 0) {
+        kref_put(&buffer->ref, free_stack);
+        return ERR_PTR(result);
+    }
+    
+    status_publish(buffer);
+    
+    if (sample_period_us > 0)
+        set_sample_period(buffer, (u64)sample_period_us * NSEC_PER_USEC);
+    
+    mutex_lock(&stack_list_lock);
+    rcu_read_lock();
+    exists = find_stack_rcu(buffer->name) != NULL;
+    rcu_read_unlock();
+    if (exists) {
+        mutex_unlock(&stack_list_lock);
+        kref_put(&buffer->ref, free_stack);
+        return ERR_PTR(-EEXIST);
+    }
+    list_add_tail_rcu(&buffer->node, &stack_list);
+    mutex_unlock(&stack_list_lock);
+    
+    return buffer;
+}
+EXPORT_SYMBOL_GPL(int_stack_create);
+
+/**
+ * int_stack_destroy - unpublish a stack created by int_stack_create and
+ * drop the creator's reference
+ */
+void int_stack_destroy(struct integer_buffer *buffer)
+{
+    int_stack_detach_stage(buffer);
+    
+    mutex_lock(&stack_list_lock);
+    list_del_rcu(&buffer->node);
+    mutex_unlock(&stack_list_lock);
+    synchronize_rcu();
+    
+    kref_put(&buffer->ref, free_stack);
+}
+EXPORT_SYMBOL_GPL(int_stack_destroy);
+
+/**
+ * int_stack_find - look up a stack by name and take a reference
+ * Returns NULL if there is none; release with int_stack_put().
+ */
+struct integer_buffer *int_stack_find(const char *name)
+{
+    struct integer_buffer *buffer;
+    
+    rcu_read_lock();
+    buffer = find_stack_rcu(name);
+    if (buffer && !kref_get_unless_zero(&buffer->ref))
+        buffer = NULL;
+    rcu_read_unlock();
+    
+    return buffer;
+}
+EXPORT_SYMBOL_GPL(int_stack_find);
+
+void int_stack_put(struct integer_buffer *buffer)
+{
+    kref_put(&buffer->ref, free_stack);
+}
+EXPORT_SYMBOL_GPL(int_stack_put);
+
+/*
+ * Consumer pipelines. pipeline_lock serializes attaching and detaching
+ * stages, the transform registry and stacks created through the device.
+ * Workers only use the exported stack API, so they never take it.
+ */
+#define STAGE_MAX_BATCH  4096
+#define STAGE_MAX_ACTIVE 64
+
+static DEFINE_MUTEX(pipeline_lock);
+static LIST_HEAD(transform_list);
+
+static bool transform_identity(int value, int *out)
+{
+    *out = value;
+    return true;
+}
+
+static bool transform_negate(int value, int *out)
+{
+    *out = -value;
+    return true;
+}
+
+static bool transform_drop_negative(int value, int *out)
+{
+    *out = value;
+    return value >= 0;
+}
+
+static struct int_stack_transform builtin_transforms[] = {
+    { .name = "identity", .fn = transform_identity },
+    { .name = "negate", .fn = transform_negate },
+    { .name = "drop-negative", .fn = transform_drop_negative },
+};
+
+static struct int_stack_transform *find_transform(const char *name)
+{
+    struct int_stack_transform *transform;
+    
+    list_for_each_entry(transform, &transform_list, node) {
+        if (strcmp(transform->name, name) == 0)
+            return transform;
+    }
+    
+    return NULL;
+}
+
+/**
+ * int_stack_register_transform - make a transform available to stages
+ * Returns 0 or -EEXIST if the name is taken.
+ */
+int int_stack_register_transform(struct int_stack_transform *transform)
+{
+    int result = 0;
+    
+    mutex_lock(&pipeline_lock);
+    if (find_transform(transform->name))
+        result = -EEXIST;
+    else
+        list_add_tail(&transform->node, &transform_list);
+    mutex_unlock(&pipeline_lock);
+    
+    return result;
+}
+EXPORT_SYMBOL_GPL(int_stack_register_transform);
+
+/* Stages using the transform pin its owner, so none can be attached here */
+void int_stack_unregister_transform(struct int_stack_transform *transform)
+{
+    mutex_lock(&pipeline_lock);
+    list_del(&transform->node);
+    mutex_unlock(&pipeline_lock);
+}
+EXPORT_SYMBOL_GPL(int_stack_unregister_transform);
+
+static bool run_stage(struct stack_consumer *consumer, int value, int *out)
+{
+    if (consumer->prog) {
+        if (run_value_prog(consumer->prog, consumer->source, &value) ==
+            INT_STACK_FILTER_REJECT)
+            return false;
+        *out = value;
+        return true;
+    }
+    
+    return consumer->transform->fn(value, out);
+}
+
+/*
+ * Pops come out top first, so the batch is replayed bottom first to keep
+ * the relative order on the output stack. Elements the output has no room
+ * for are counted as dropped.
+ */
+static void consumer_work_fn(struct work_struct *work)
+{
+    struct consumer_work *worker = container_of(work, struct consumer_work, work);
+    struct stack_consumer *consumer = worker->consumer;
+    int popped, emitted, delivered, i;
+    
+    /* Checking the depth first keeps the final pop out of the underflow count */
+    while (!READ_ONCE(consumer->stopping) && int_stack_usage(consumer->source) > 0) {
+        popped = int_stack_pop_n(consumer->source, worker->in, consumer->batch_size);
+        if (popped <= 0)
+            break;
+        
+        emitted = 0;
+        for (i = popped - 1; i >= 0; i--) {
+            if (run_stage(consumer, worker->in[i], &worker->out[emitted]))
+                emitted++;
+        }
+        
+        delivered = emitted;
+        if (consumer->output && emitted > 0) {
+            delivered = int_stack_push_n(consumer->output, worker->out, emitted);
+            if (delivered < 0)
+                delivered = 0;
+        }
+        
+        atomic64_add(popped, &consumer->processed);
+        atomic64_add(emitted - delivered, &consumer->dropped);
+        atomic64_inc(&consumer->batches);
+        
+        cond_resched();
+    }
+}
+
+/* Drains the workqueue and drops every reference the stage holds */
+static void free_consumer(struct stack_consumer *consumer)
+{
+    unsigned int i;
+    
+    if (consumer->wq)
+        destroy_workqueue(consumer->wq);
+    
+    for (i = 0; i < consumer->max_active; i++) {
+        kvfree(consumer->workers[i].in);
+        kvfree(consumer->workers[i].out);
+    }
+    
+    if (consumer->prog)
+        bpf_prog_put(consumer->prog);
+    if (consumer->transform)
+        module_put(consumer->transform->owner);
+    if (consumer->output)
+        int_stack_put(consumer->output);
+    kfree(consumer);
+}
+
+/*
+ * Called with pipeline_lock held. Takes over the references on @prog and
+ * @output and pins @transform's owner, whether or not it succeeds.
+ */
+static int attach_stage(struct integer_buffer *source, struct int_stack_transform *transform,
+                        struct bpf_prog *prog, struct integer_buffer *output,
+                        unsigned int threshold, unsigned int batch_size,
+                        unsigned int max_active)
+{
+    struct stack_consumer *consumer;
+    struct stack_consumer *next;
+    struct integer_buffer *stack;
+    unsigned int i;
+    int result = 0;
+    
+    consumer = kzalloc(struct_size(consumer, workers, max_active), GFP_KERNEL);
+    if (!consumer) {
+        if (prog)
+            bpf_prog_put(prog);
+        if (output)
+            int_stack_put(output);
+        return -ENOMEM;
+    }
+    
+    consumer->source = source;
+    consumer->output = output;
+    consumer->prog = prog;
+    consumer->threshold = max(threshold, 1U);
+    consumer->batch_size = batch_size;
+    consumer->max_active = max_active;
+    atomic64_set(&consumer->processed, 0);
+    atomic64_set(&consumer->dropped, 0);
+    atomic64_set(&consumer->batches, 0);
+    
+    if (transform && try_module_get(transform->owner))
+        consumer->transform = transform;
+    else if (!prog)
+        result = -ENOENT;
+    
+    if (rcu_access_pointer(source->consumer))
+        result = -EBUSY;
+    
+    /* A cycle would keep its workers busy forever */
+    for (stack = output; stack && result == 0; stack = next ? next->output : NULL) {
+        if (stack == source)
+            result = -ELOOP;
+        next = rcu_dereference_protected(stack->consumer,
+                                         lockdep_is_held(&pipeline_lock));
+    }
+    
+    for (i = 0; i < max_active && result == 0; i++) {
+        struct consumer_work *worker = &consumer->workers[i];
+        
+        INIT_WORK(&worker->work, consumer_work_fn);
+        worker->consumer = consumer;
+        worker->in = kvmalloc_array(batch_size, sizeof(int), GFP_KERNEL);
+        worker->out = kvmalloc_array(batch_size, sizeof(int), GFP_KERNEL);
+        if (!worker->in || !worker->out)
+            result = -ENOMEM;
+    }
+    
+    if (result == 0) {
+        consumer->wq = alloc_workqueue("int_stack_%s", WQ_UNBOUND, max_active,
+                                       source->name);
+        if (!consumer->wq)
+            result = -ENOMEM;
+    }
+    
+    if (result < 0) {
+        free_consumer(consumer);
+        return result;
+    }
+    
+    rcu_assign_pointer(source->consumer, consumer);
+    
+    /* Elements already above the threshold are not left waiting for a push */
+    consumer_kick(source);
+    return 0;
+}
+
+/* Called with pipeline_lock held */
+static void detach_stage(struct integer_buffer *source)
+{
+    struct stack_consumer *consumer;
+    
+    consumer = rcu_dereference_protected(source->consumer,
+                                         lockdep_is_held(&pipeline_lock));
+    if (!consumer)
+        return;
+    
+    RCU_INIT_POINTER(source->consumer, NULL);
+    synchronize_rcu();
+    
+    WRITE_ONCE(consumer->stopping, true);
+    free_consumer(consumer);
+}
+
+static int check_stage_params(unsigned int batch_size, unsigned int max_active)
+{
+    if (batch_size == 0 || batch_size > STAGE_MAX_BATCH)
+        return -EINVAL;
+    if (max_active == 0 || max_active > STAGE_MAX_ACTIVE)
+        return -EINVAL;
+    return 0;
+}
+
+/**
+ * int_stack_attach_stage - drain @source through a registered transform
+ * into @output (may be NULL), using up to @max_active concurrent workers
+ * once its depth reaches @threshold
+ * Returns 0, -ENOENT for an unknown transform, -EBUSY if @source already
+ * has a stage or -ELOOP if the pipeline would feed back into @source.
+ */
+int int_stack_attach_stage(struct integer_buffer *source, const char *transform,
+                           struct integer_buffer *output, unsigned int threshold,
+                           unsigned int batch_size, unsigned int max_active)
+{
+    int result;
+    
+    result = check_stage_params(batch_size, max_active);
+    if (result < 0)
+        return result;
+    
+    if (output)
+        kref_get(&output->ref);
+    
+    mutex_lock(&pipeline_lock);
+    result = attach_stage(source, find_transform(transform), NULL, output,
+                          threshold, batch_size, max_active);
+    mutex_unlock(&pipeline_lock);
+    
+    return result;
+}
+EXPORT_SYMBOL_GPL(int_stack_attach_stage);
+
+/**
+ * int_stack_detach_stage - stop the stage draining @source, if any, and
+ * wait for its workers
+ */
+void int_stack_detach_stage(struct integer_buffer *source)
+{
+    mutex_lock(&pipeline_lock);
+    detach_stage(source);
+    mutex_unlock(&pipeline_lock);
+}
+EXPORT_SYMBOL_GPL(int_stack_detach_stage);
+
+/* An empty name refers to the device stack; takes a reference */
+static struct integer_buffer *find_stack_by_spec(const char *name)
+{
+    if (name[0] == '\0')
+        name = dev_buffer->name;
+    return int_stack_find(name);
+}
+
+static int stage_ioctl(struct int_stack_stage *stage)
+{
+    struct integer_buffer *source;
+    struct integer_buffer *output = NULL;
+    struct bpf_prog *prog = NULL;
+    int result;
+    
+    stage->input[INT_STACK_NAME_LEN - 1] = '\0';
+    stage->output[INT_STACK_NAME_LEN - 1] = '\0';
+    stage->transform[INT_STACK_NAME_LEN - 1] = '\0';
+    
+    result = check_stage_params(stage->batch_size, stage->max_active);
+    if (result < 0)
+        return result;
+    
+    if (stage->transform[0] == '\0') {
+        if (!bpf_capable())
+            return -EPERM;
+        prog = get_value_prog(stage->prog_fd);
+        if (IS_ERR(prog))
+            return PTR_ERR(prog);
+    }
+    
+    source = find_stack_by_spec(stage->input);
+    if (stage->output[0] != '\0')
+        output = int_stack_find(stage->output);
+    
+    if (!source || (stage->output[0] != '\0' && !output)) {
+        if (prog)
+            bpf_prog_put(prog);
+        if (output)
+            int_stack_put(output);
+        if (source)
+            int_stack_put(source);
+        return -ENOENT;
+    }
+    
+    mutex_lock(&pipeline_lock);
+    result = attach_stage(source, prog ? NULL : find_transform(stage->transform),
+                          prog, output, stage->threshold, stage->batch_size,
+                          stage->max_active);
+    mutex_unlock(&pipeline_lock);
+    
+    int_stack_put(source);
+    return result;
+}
+
+static int create_stack_ioctl(struct int_stack_spec *spec)
+{
+    struct integer_buffer *buffer;
+    
+    spec->name[INT_STACK_NAME_LEN - 1] = '\0';
+    if (spec->name[0] == '\0')
+        return -EINVAL;
+    
+    buffer = int_stack_create(spec->name, spec->capacity);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    
+    mutex_lock(&pipeline_lock);
+    buffer->user_created = true;
+    mutex_unlock(&pipeline_lock);
+    
+    return 0;
+}
+
+/* Only stacks created through the device can be destroyed through it */
+static int destroy_stack(struct integer_buffer *buffer)
+{
+    bool owned;
+    
+    mutex_lock(&pipeline_lock);
+    owned = buffer->user_created;
+    buffer->user_created = false;
+    mutex_unlock(&pipeline_lock);
+    
+    if (!owned)
+        return -EPERM;
+    
+    int_stack_destroy(buffer);
+    return 0;
+}
+
+static void destroy_user_stacks(void)
+{
+    struct integer_buffer *buffer;
+    bool found;
+    
+    do {
+        found = false;
+        rcu_read_lock();
+        list_for_each_entry_rcu(buffer, &stack_list, node) {
+            if (READ_ONCE(buffer->user_created) &&
+                kref_get_unless_zero(&buffer->ref)) {
+                found = true;
+                break;
+            }
+        }
+        rcu_read_unlock();
+        
+        if (found) {
+            destroy_stack(buffer);
+            int_stack_put(buffer);
+        }
+    } while (found);
+}
+
+/*
+ * Admin commands run without the device stack's op_lock: detaching a
+ * stage waits for workers that may be popping the device stack.
+ */
+static long pipeline_ioctl(unsigned int cmd, unsigned long arg)
+{
+    struct int_stack_stage stage;
+    struct int_stack_spec spec;
+    struct integer_buffer *buffer;
+    long result;
+    
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    
+    if (cmd == CMD_ATTACH_STAGE) {
+        if (copy_from_user(&stage, (void __user *)arg, sizeof(stage)))
+            return -EFAULT;
+        return stage_ioctl(&stage);
+    }
+    
+    if (copy_from_user(&spec, (void __user *)arg, sizeof(spec)))
+        return -EFAULT;
+    spec.name[INT_STACK_NAME_LEN - 1] = '\0';
+    
+    if (cmd == CMD_CREATE_STACK)
+        return create_stack_ioctl(&spec);
+    
+    buffer = find_stack_by_spec(spec.name);
+    if (!buffer)
+        return -ENOENT;
+    
+    result = 0;
+    if (cmd == CMD_DESTROY_STACK)
+        result = destroy_stack(buffer);
+    else
+        int_stack_detach_stage(buffer);
+    
+    int_stack_put(buffer);
+    return result;
+}
+
+static int stages_show(struct seq_file *m, void *v)
+{
+    struct integer_buffer *buffer;
+    struct stack_consumer *consumer;
+    
+    seq_puts(m, "source output transform threshold batch workers depth processed dropped batches\n");
+    
+    mutex_lock(&pipeline_lock);
+    rcu_read_lock();
+    list_for_each_entry_rcu(buffer, &stack_list, node) {
+        consumer = rcu_dereference_protected(buffer->consumer,
+                                             lockdep_is_held(&pipeline_lock));
+        if (!consumer)
+            continue;
+        
+        seq_printf(m, "%s %s %s %u %u %u %zu %lld %lld %lld\n",
+                   buffer->name,
+                   consumer->output ? consumer->output->name : "-",
+                   consumer->prog ? "bpf" : consumer->transform->name,
+                   consumer->threshold, consumer->batch_size,
+                   consumer->max_active, int_stack_usage(buffer),
+                   atomic64_read(&consumer->processed),
+                   atomic64_read(&consumer->dropped),
+                   atomic64_read(&consumer->batches));
+    }
+    rcu_read_unlock();
+    mutex_unlock(&pipeline_lock);
+    
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stages);
+
+/*
+ * One line per stack for kernel_stack top/export, which poll it and
+ * compute rates themselves. Counters are unsigned and wrap at 2^32.
+ */
+static int stacks_show(struct seq_file *m, void *v)
+{
+    struct integer_buffer *buffer;
+    
+    seq_puts(m, "name depth capacity pushed popped overflows underflows filtered resizes\n");
+    
+    rcu_read_lock();
+    list_for_each_entry_rcu(buffer, &stack_list, node) {
+        seq_printf(m, "%s %zu %zu %u %u %u %u %u %u\n",
+                   buffer->name, READ_ONCE(buffer->position),
+                   READ_ONCE(buffer->capacity),
+                   atomic_read(&buffer->stats.push_count),
+                   atomic_read(&buffer->stats.pop_count),
+                   atomic_read(&buffer->stats.overflow_count),
+                   atomic_read(&buffer->stats.underflow_count),
+                   atomic_read(&buffer->stats.filtered_count),
+                   atomic_read(&buffer->stats.resize_count));
+    }
+    rcu_read_unlock();
+    
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stacks);
+
+static void register_builtin_transforms(void)
+{
+    size_t i;
+    
+    for (i = 0; i < ARRAY_SIZE(builtin_transforms); i++)
+        int_stack_register_transform(&builtin_transforms[i]);
+}
+
+/*
+ * Snapshots. Both directions run under op_lock and stream between the
+ * stack and user memory, which is typically an mmap()ed file. Producers on
+ * the _atomic API do not take op_lock, so an export first stages the
+ * elements the way a resize copies them: in bulk without data_lock, then
+ * under it whatever changed meanwhile, together with the change_seq.
+ */
+#define SNAPSHOT_CHUNK   (64 * 1024)
+#define VARINT_MAX_BYTES 5
+
+static inline u32 zigzag_encode(u32 delta)
+{
+    return (delta << 1) ^ (u32)((s32)delta >> 31);
+}
+
+static inline u32 zigzag_decode(u32 value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+static size_t put_varint(u8 *p, u32 value)
+{
+    size_t n = 0;
+    
+    while (value >= 0x80) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    
+    return n;
+}
+
+/* Called with op_lock held, so the element array cannot be reallocated */
+static int export_snapshot(struct integer_buffer *buffer, struct int_stack_transfer *xfer)
+{
+    struct int_stack_snapshot_header header;
+    u8 __user *dst = u64_to_user_ptr(xfer->buffer);
+    size_t offset = sizeof(header);
+    size_t width, used = 0, count, i;
+    unsigned long flags;
+    u32 crc = ~0U;
+    u32 prev = 0;
+    u64 seq;
+    int result = 0;
+    int *staged;
+    u8 *chunk;
+    
+    if (xfer->encoding == INT_STACK_SNAPSHOT_RAW)
+        width = sizeof(int);
+    else if (xfer->encoding == INT_STACK_SNAPSHOT_DELTA)
+        width = VARINT_MAX_BYTES;
+    else
+        return -EINVAL;
+    
+    count = READ_ONCE(buffer->position);
+    if (xfer->length < sizeof(header) + count * width) {
+        xfer->length = sizeof(header) + count * width;
+        return -ENOSPC;
+    }
+    
+    /* _atomic pushes may deepen the stack up to capacity meanwhile */
+    staged = kvmalloc_array(max_t(size_t, buffer->capacity, 1), sizeof(int), GFP_KERNEL);
+    if (!staged)
+        return -ENOMEM;
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    count = stack_core_copy_start(&buffer->core, buffer->capacity);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    stack_core_copy(&buffer->core, staged, NULL, 0, count);
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    count = stack_core_copy_finish(&buffer->core, staged, NULL, buffer->capacity, count);
+    seq = buffer->change_seq;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    if (xfer->length < sizeof(header) + count * width) {
+        xfer->length = sizeof(header) + count * width;
+        kvfree(staged);
+        return -ENOSPC;
+    }
+    
+    if (xfer->encoding == INT_STACK_SNAPSHOT_RAW) {
+        for (i = 0; i < count && result == 0; i += used) {
+            used = min_t(size_t, count - i, SNAPSHOT_CHUNK / sizeof(int));
+            crc = crc32c(crc, &staged[i], used * sizeof(int));
+            if (copy_to_user(dst + offset, &staged[i], used * sizeof(int)))
+                result = -EFAULT;
+            offset += used * sizeof(int);
+            cond_resched();
+        }
+    } else {
+        chunk = kvmalloc(SNAPSHOT_CHUNK, GFP_KERNEL);
+        if (!chunk) {
+            kvfree(staged);
+            return -ENOMEM;
+        }
+        
+        for (i = 0; i < count && result == 0; i++) {
+            u32 value = staged[i];
+            
+            used += put_varint(chunk + used, zigzag_encode(value - prev));
+            prev = value;
+            
+            if (used > SNAPSHOT_CHUNK - VARINT_MAX_BYTES || i + 1 == count) {
+                crc = crc32c(crc, chunk, used);
+                if (copy_to_user(dst + offset, chunk, used))
+                    result = -EFAULT;
+                offset += used;
+                used = 0;
+                cond_resched();
+            }
+        }
+        
+        kvfree(chunk);
+    }
+    
+    kvfree(staged);
+    if (result < 0)
+        return result;
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = INT_STACK_SNAPSHOT_MAGIC;
+    header.version = INT_STACK_SNAPSHOT_VERSION;
+    header.element_width = sizeof(int);
+    header.encoding = xfer->encoding;
+    header.count = count;
+    header.body_size = offset - sizeof(header);
+    header.checksum = ~crc;
+    header.seq = seq;
+    
+    if (copy_to_user(dst, &header, sizeof(header)))
+        return -EFAULT;
+    
+    xfer->length = offset;
+    return 0;
+}
+
+/* Decodes a delta body that must hold exactly @count values */
+static int decode_delta_body(const u8 __user *src, size_t body_size, int *values,
+                             size_t count, u32 *crc)
+{
+    size_t offset, decoded = 0, n, i;
+    unsigned int shift = 0;
+    u32 acc = 0;
+    u32 prev = 0;
+    u8 *chunk;
+    int result = 0;
+    
+    chunk = kvmalloc(SNAPSHOT_CHUNK, GFP_KERNEL);
+    if (!chunk)
+        return -ENOMEM;
+    
+    for (offset = 0; offset < body_size && result == 0; offset += n) {
+        n = min_t(size_t, body_size - offset, SNAPSHOT_CHUNK);
+        if (copy_from_user(chunk, src + offset, n)) {
+            result = -EFAULT;
+            break;
+        }
+        *crc = crc32c(*crc, chunk, n);
+        
+        for (i = 0; i < n; i++) {
+            acc |= (u32)(chunk[i] & 0x7f) << shift;
+            if (chunk[i] & 0x80) {
+                shift += 7;
+                if (shift > 28) {
+                    result = -EBADMSG;
+                    break;
+                }
+                continue;
+            }
+            
+            if (decoded == count) {
+                result = -EBADMSG;
+                break;
+            }
+            prev += zigzag_decode(acc);
+            values[decoded++] = prev;
+            acc = 0;
+            shift = 0;
+        }
+        cond_resched();
+    }
+    
+    kvfree(chunk);
+    
+    if (result == 0 && (decoded != count || shift != 0))
+        result = -EBADMSG;
+    return result;
+}
+
+/*
+ * Called with op_lock held. Replaces the contents of the stack with the
+ * first @count of @new_array's @capacity elements, taking ownership of it.
+ */
+static int install_contents(struct integer_buffer *buffer, int *new_array,
+                            size_t count, size_t capacity)
+{
+    u64 *new_timestamps = NULL;
+    u64 *old_timestamps;
+    int *old_array;
+    unsigned long flags;
+    size_t i;
+    
+    if (element_timestamps && capacity > 0) {
+        u64 now = ktime_get_coarse_ns();
+        
+        new_timestamps = kvcalloc(capacity, sizeof(u64), GFP_KERNEL);
+        if (!new_timestamps) {
+            kvfree(new_array);
+            return -ENOMEM;
+        }
+        for (i = 0; i < count; i++)
+            new_timestamps[i] = now;
+    }
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    old_array = buffer->elements;
+    old_timestamps = buffer->timestamps;
+    buffer->elements = new_array;
+    buffer->timestamps = new_timestamps;
+    buffer->capacity = capacity;
+    buffer->position = count;
+    if (count > buffer->window_high_water) {
+        buffer->window_high_water = count;
+        if (count > buffer->high_water)
+            buffer->high_water = count;
+    }
+    change_record(buffer, INT_STACK_CHANGE_RESET, count);
+    status_publish(buffer);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    kvfree(old_array);
+    kvfree(old_timestamps);
+    
+    consumer_kick(buffer);
+    return 0;
+}
+
+/* Called with op_lock held; replaces the contents of the stack */
+static int import_snapshot(struct integer_buffer *buffer, const struct int_stack_transfer *xfer)
+{
+    struct int_stack_snapshot_header header;
+    const u8 __user *src = u64_to_user_ptr(xfer->buffer);
+    int *new_array = NULL;
+    size_t capacity, count;
+    u32 crc = ~0U;
+    int result = 0;
+    
+    if (xfer->length < sizeof(header))
+        return -EINVAL;
+    if (copy_from_user(&header, src, sizeof(header)))
+        return -EFAULT;
+    
+    if (header.magic != INT_STACK_SNAPSHOT_MAGIC ||
+        header.version != INT_STACK_SNAPSHOT_VERSION ||
+        header.element_width != sizeof(int) ||
+        header.encoding > INT_STACK_SNAPSHOT_DELTA ||
+        header.body_size > xfer->length - sizeof(header))
+        return -EINVAL;
+    
+    /* Capacities are ints on the ioctl interface */
+    if (header.count > INT_MAX)
+        return -EFBIG;
+    
+    if (header.encoding == INT_STACK_SNAPSHOT_RAW &&
+        header.body_size != header.count * sizeof(int))
+        return -EBADMSG;
+    
+    count = header.count;
+    capacity = max_t(size_t, buffer->capacity, count);
+    src += sizeof(header);
+    
+    if (capacity > 0) {
+        new_array = kvcalloc(capacity, sizeof(int), GFP_KERNEL);
+        if (!new_array)
+            return -ENOMEM;
+    }
+    
+    if (header.encoding == INT_STACK_SNAPSHOT_RAW) {
+        if (copy_from_user(new_array, src, header.body_size))
+            result = -EFAULT;
+        else
+            crc = crc32c(crc, new_array, header.body_size);
+    } else {
+        result = decode_delta_body(src, header.body_size, new_array, count, &crc);
+    }
+    
+    if (result == 0 && ~crc != header.checksum)
+        result = -EBADMSG;
+    
+    if (result < 0) {
+        kvfree(new_array);
+        return result;
+    }
+    
+    return install_contents(buffer, new_array, count, capacity);
+}
+
+static int transfer_ioctl(struct integer_buffer *buffer, unsigned int cmd, unsigned long arg)
+{
+    struct int_stack_transfer xfer;
+    int result;
+    
+    if (copy_from_user(&xfer, (void __user *)arg, sizeof(xfer)))
+        return -EFAULT;
+    
+    if (cmd == CMD_IMPORT)
+        return import_snapshot(buffer, &xfer);
+    
+    result = export_snapshot(buffer, &xfer);
+    if ((result == 0 || result == -ENOSPC) &&
+        copy_to_user((void __user *)arg, &xfer, sizeof(xfer)))
+        result = -EFAULT;
+    
+    return result;
+}
+
+static int buffer_open(struct inode *inode, struct file *file)
+{
+    struct integer_buffer *buffer = gate_enter(file);
+    
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    
+    gate_exit(file);
+    return 0;
+}
+
+static int buffer_release(struct inode *inode, struct file *file)
+{
+    return 0;
+}
+
+#define POP_BATCH 64
+
+/* Completes a stack_core_pop_start() of count values from depth */
+static bool stack_pop_finish_locked(struct integer_buffer *buffer, size_t depth, size_t count)
+{
+    size_t i;
+    
+    if (!stack_core_pop_finish(&buffer->core, depth, count))
+        return false;
+    
+    if (buffer->timestamps) {
+        for (i = depth - count; i < depth; i++)
+            sojourn_record(buffer->timestamps[i]);
+    }
+    change_record(buffer, INT_STACK_CHANGE_POP, count);
+    status_publish(buffer);
+    
+    return true;
+}
+
+/*
+ * Pops up to count ints into to, top first, in chunks of POP_BATCH with
+ * op_lock held per chunk. Values are copied out before they are popped,
+ * so a fault leaves them on the stack; a chunk that an _atomic push or
+ * pop changed during the copy is taken again.
+ */
+static ssize_t pop_to_iter(struct integer_buffer *buffer, struct iov_iter *to, size_t count,
+                           struct op_timing *timing)
+{
+    int values[POP_BATCH];
+    size_t done = 0, depth, n;
+    unsigned long flags;
+    bool popped = false;
+    
+    while (done < count) {
+        stack_lock(buffer, timing);
+        do {
+            raw_spin_lock_irqsave(&buffer->data_lock, flags);
+            depth = buffer->position;
+            n = stack_core_pop_start(&buffer->core, values,
+                                     min_t(size_t, count - done, POP_BATCH));
+            raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+            if (n == 0)
+                break;
+            
+            if (copy_to_iter(values, n * sizeof(int), to) != n * sizeof(int)) {
+                stack_unlock(buffer, timing);
+                return done ? (ssize_t)(done * sizeof(int)) : -EFAULT;
+            }
+            
+            raw_spin_lock_irqsave(&buffer->data_lock, flags);
+            popped = stack_pop_finish_locked(buffer, depth, n);
+            raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+            if (!popped)
+                iov_iter_revert(to, n * sizeof(int));
+        } while (!popped);
+        stack_unlock(buffer, timing);
+        
+        if (n == 0) {
+            if (done == 0)
+                trace_int_stack_underflow(buffer->id, 0);
+            break;
+        }
+        
+        trace_int_stack_pop(buffer->id, depth - n, values[n - 1]);
+        done += n;
+        if (n < POP_BATCH)
+            break;
+    }
+    
+    if (done)
+        client_account(CLIENT_POP, done * sizeof(int));
+    
+    return done * sizeof(int);
+}
+
+/* CMD_POP_BATCH: a read of up to count ints */
+static long pop_batch_ioctl(struct integer_buffer *buffer, unsigned long arg)
+{
+    struct int_stack_pop_batch request;
+    struct op_timing timing;
+    struct iov_iter to;
+    ssize_t result;
+    
+    if (copy_from_user(&request, (void __user *)arg, sizeof(request)))
+        return -EFAULT;
+    if (request.count == 0 || request.reserved || request.count > INT_MAX / sizeof(int))
+        return -EINVAL;
+    
+    result = import_ubuf(ITER_DEST, u64_to_user_ptr(request.buffer),
+                         request.count * sizeof(int), &to);
+    if (result < 0)
+        return result;
+    
+    op_timing_start(&timing);
+    result = pop_to_iter(buffer, &to, request.count, &timing);
+    op_timing_end(STACK_OP_POP, &timing);
+    if (result < 0)
+        return result;
+    
+    request.count = result / sizeof(int);
+    if (copy_to_user((void __user *)arg, &request, sizeof(request)))
+        return -EFAULT;
+    return 0;
+}
+
+static long node_ioctl(struct integer_buffer *buffer, unsigned int cmd, unsigned long arg)
+{
+    struct op_timing timing;
+    unsigned long flags;
+    int result = 0;
+    int value = 0;
+    
+    switch (cmd) {
+    case CMD_CREATE_STACK:
+    case CMD_DESTROY_STACK:
+    case CMD_ATTACH_STAGE:
+    case CMD_DETACH_STAGE:
+        return pipeline_ioctl(cmd, arg);
+        
+    case CMD_POP_BATCH:
+        return pop_batch_ioctl(buffer, arg);
+    }
+    
+    op_timing_start(&timing);
+    stack_lock(buffer, &timing);
+    
+    switch (cmd) {
+    case INT_STACK_SET_MAX_SIZE:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(int))) {
+            result = -EFAULT;
+            break;
+        }
+        
+        if (value < 0) {
+            result = -EINVAL;
+            break;
+        }
+        
+        result = resize_buffer(buffer, value);
+        break;
+        
+    case CMD_GET_CAPACITY:
+        value = buffer->capacity;
+        if (copy_to_user((int __user *)arg, &value, sizeof(int)))
+            result = -EFAULT;
+        break;
+        
+    case CMD_GET_USAGE:
+        value = int_stack_usage(buffer);
+        if (copy_to_user((int __user *)arg, &value, sizeof(int)))
+            result = -EFAULT;
+        break;
+        
+    case CMD_SET_SAMPLE_PERIOD:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(int))) {
+            result = -EFAULT;
+            break;
+        }
+        
+        if (value < 0) {
+            result = -EINVAL;
+            break;
+        }
+        
+        /* Every period is an hrtimer interrupt, so not for any user */
+        if (!capable(CAP_SYS_ADMIN)) {
+            result = -EPERM;
+            break;
+        }
+        
+        set_sample_period(buffer, (u64)value * NSEC_PER_USEC);
+        break;
+        
+    case CMD_READ_DEPTH_SAMPLES: {
+        struct int_stack_sample_read request;
+        ssize_t done;
+        
+        if (copy_from_user(&request, (void __user *)arg, sizeof(request))) {
+            result = -EFAULT;
+            break;
+        }
+        
+        done = sampler_drain(&buffer->sampler, u64_to_user_ptr(request.buffer),
+                             (size_t)request.count * sizeof(struct int_stack_depth_sample));
+        if (done < 0) {
+            result = done;
+            break;
+        }
+        
+        request.count = done / sizeof(struct int_stack_depth_sample);
+        request.overwritten = READ_ONCE(buffer->sampler.overwritten);
+        if (copy_to_user((void __user *)arg, &request, sizeof(request)))
+            result = -EFAULT;
+        break;
+    }
+        
+    case CMD_SET_PUSH_FILTER:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(int))) {
+            result = -EFAULT;
+            break;
+        }
+        
+        result = set_push_filter(buffer, value);
+        break;
+        
+    case CMD_GET_HIGH_WATER: {
+        struct int_stack_high_water high_water;
+        
+        raw_spin_lock_irqsave(&buffer->data_lock, flags);
+        high_water.lifetime = buffer->high_water;
+        high_water.window = buffer->window_high_water;
+        buffer->window_high_water = buffer->position;
+        raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+        
+        if (copy_to_user((void __user *)arg, &high_water, sizeof(high_water)))
+            result = -EFAULT;
+        break;
+    }
+        
+    case CMD_CLEAR_BUFFER:
+        int_stack_clear(buffer);
+        break;
+        
+    case CMD_EXPORT:
+    case CMD_IMPORT:
+        result = transfer_ioctl(buffer, cmd, arg);
+        break;
+        
+    case CMD_OPEN_CHANGES: {
+        u64 from_seq;
+        
+        if (copy_from_user(&from_seq, (u64 __user *)arg, sizeof(from_seq))) {
+            result = -EFAULT;
+            break;
+        }
+        
+        result = open_changes(buffer, from_seq);
+        break;
+    }
+        
+    default:
+        result = -ENOTTY;
+    }
+    
+    stack_unlock(buffer, &timing);
+    op_timing_end(STACK_OP_IOCTL, &timing);
+    return result;
+}
+
+/*
+ * read/write are iov_iter based so that in-kernel users of the file
+ * (kernel_read/kernel_write) take the same path as userspace. A read pops
+ * one int however large the buffer; CMD_POP_BATCH pops more.
+ */
+static ssize_t node_read(struct integer_buffer *buffer, struct iov_iter *to)
+{
+    struct op_timing timing;
+    ssize_t result;
+    
+    if (iov_iter_count(to) < sizeof(int))
+        return -EINVAL;
+    
+    op_timing_start(&timing);
+    result = pop_to_iter(buffer, to, 1, &timing);
+    op_timing_end(STACK_OP_POP, &timing);
+    
+    return result;
+}
+
+#define WRITE_BATCH 64
+
+/*
+ * A write pushes a whole number of ints, first int first. Like write(2)
+ * on a pipe it is short when a value is rejected or does not fit after
+ * some were pushed, and the next write reports the error.
+ */
+static ssize_t node_write(struct integer_buffer *buffer, struct iov_iter *from)
+{
+    struct op_timing timing;
+    int values[WRITE_BATCH];
+    size_t count = iov_iter_count(from) / sizeof(int);
+    size_t written = 0;
+    int result = 0;
+    
+    if (count == 0 || iov_iter_count(from) % sizeof(int))
+        return -EINVAL;
+    
+    op_timing_start(&timing);
+    
+    while (written < count) {
+        size_t batch = min_t(size_t, count - written, WRITE_BATCH);
+        
+        if (!copy_from_iter_full(values, batch * sizeof(int), from)) {
+            result = -EFAULT;
+            break;
+        }
+        
+        result = __int_stack_push_batch(buffer, values, batch, &timing);
+        if (result < 0)
+            break;
+        written += result;
+        if ((size_t)result < batch)
+            break;
+    }
+    
+    op_timing_end(STACK_OP_PUSH, &timing);
+    
+    if (written)
+        client_account(CLIENT_PUSH, written * sizeof(int));
+    else if (result == -ENOSPC)
+        client_account(CLIENT_OVERFLOW, 0);
+    
+    return written ? written * sizeof(int) : result;
+}
+
+/* The file operations hold the node's gate for the whole op */
+static long buffer_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct integer_buffer *buffer = gate_enter(file);
+    long result;
+    
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    
+    result = node_ioctl(buffer, cmd, arg);
+    gate_exit(file);
+    return result;
+}
+
+static ssize_t buffer_read(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct integer_buffer *buffer = gate_enter(iocb->ki_filp);
+    ssize_t result;
+    
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    
+    result = node_read(buffer, to);
+    gate_exit(iocb->ki_filp);
+    return result;
+}
+
+static ssize_t buffer_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct integer_buffer *buffer = gate_enter(iocb->ki_filp);
+    ssize_t result;
+    
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    
+    result = node_write(buffer, from);
+    gate_exit(iocb->ki_filp);
+    return result;
+}
+
+static const struct file_operations buffer_fops = {
+    .owner = THIS_MODULE,
+    .open = buffer_open,
+    .release = buffer_release,
+    .read_iter = buffer_read,
+    .write_iter = buffer_write,
+    .unlocked_ioctl = buffer_ioctl,
+    .compat_ioctl = buffer_ioctl,  /* For 32bit userspace on 64bit kernel */
+    .mmap = buffer_mmap,
+};
+
+static struct miscdevice buffer_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "int_stack",
+    .fops = &buffer_fops,
+    .mode = 0666, 
+};
+
+/*
+ * Write-behind journal on the key. A key with a bulk IN/OUT endpoint pair
+ * stores its stack's change records (struct int_stack_change) sent
+ * on bulk OUT and truncates its journal whenever a RESET record arrives.
+ * On JOURNAL_REQ_REPLAY it sends the journal back on bulk IN, ended by a
+ * short packet.
+ *
+ * The journal follows the change log like any other reader, so the hot
+ * path only appends to its per-CPU ring. A work item packs records into
+ * large URBs and keeps up to JOURNAL_URBS of them in flight; whenever the
+ * key may have missed records (first plug-in, failed URB, change log
+ * overrun, snapshot load) it writes a RESET followed by the full contents.
+ */
+#define JOURNAL_URBS         4
+#define JOURNAL_URB_SIZE     (64 * 1024)
+#define JOURNAL_RECORDS      (JOURNAL_URB_SIZE / sizeof(struct int_stack_change))
+#define JOURNAL_REQ_REPLAY   0x01
+#define JOURNAL_TIMEOUT_MS   5000
+#define JOURNAL_LOG_SIZE     65536
+
+struct usb_journal {
+    struct usb_key *key;
+    struct usb_device *udev;
+    struct usb_interface *interface;
+    unsigned int in_pipe;
+    unsigned int out_pipe;
+    struct usb_anchor anchor;
+    struct delayed_work work;
+    struct change_reader *reader;
+    struct urb *urbs[JOURNAL_URBS];
+    unsigned long idle;
+    spinlock_t lock;
+    bool resync;
+    bool stopping;
+    /* Contents being written after a RESET */
+    int *base;
+    size_t base_count;
+    size_t base_capacity;
+    size_t base_pos;
+    u64 base_seq;
+    atomic64_t records_written;
+    atomic64_t urb_errors;
+    atomic64_t resyncs;
+};
+
+/* Copies the contents and the seq they reflect, like export_snapshot */
+static int journal_start_resync(struct usb_journal *j)
+{
+    struct integer_buffer *buffer = j->key->buffer;
+    unsigned long flags;
+    size_t count;
+    
+    /* op_lock keeps the capacity; _atomic pushes may still run */
+    mutex_lock(&buffer->op_lock);
+    j->base = kvmalloc_array(max_t(size_t, buffer->capacity, 1), sizeof(int), GFP_KERNEL);
+    if (!j->base) {
+        mutex_unlock(&buffer->op_lock);
+        return -ENOMEM;
+    }
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    count = stack_core_copy_start(&buffer->core, buffer->capacity);
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    
+    stack_core_copy(&buffer->core, j->base, NULL, 0, count);
+    
+    raw_spin_lock_irqsave(&buffer->data_lock, flags);
+    count = stack_core_copy_finish(&buffer->core, j->base, NULL, buffer->capacity, count);
+    j->base_seq = buffer->change_seq;
+    j->base_capacity = buffer->capacity;
+    raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+    mutex_unlock(&buffer->op_lock);
+    
+    j->base_count = count;
+    j->base_pos = 0;
+    j->reader->next_seq = j->base_seq + 1;
+    j->resync = false;
+    atomic64_inc(&j->resyncs);
+    
+    return 0;
+}
+
+/* Fills one URB worth of records, returning how many */
+static size_t journal_fill(struct usb_journal *j, struct int_stack_change *out)
+{
+    size_t n = 0;
+    int got, i;
+    
+    if (READ_ONCE(j->resync) && !j->base && journal_start_resync(j) < 0)
+        return 0;
+    
+    if (j->base) {
+        if (j->base_pos == 0) {
+            out[n].seq = j->base_seq;
+            out[n].type = INT_STACK_CHANGE_RESET;
+            out[n].stack_id = j->key->buffer->id;
+            out[n].value = j->base_count;
+            n++;
+            
+            /* Declares the capacity the replay may fill */
+            out[n].seq = j->base_seq;
+            out[n].type = INT_STACK_CHANGE_RESIZE;
+            out[n].stack_id = j->key->buffer->id;
+            out[n].value = j->base_capacity;
+            n++;
+        }
+        
+        while (n < JOURNAL_RECORDS && j->base_pos < j->base_count) {
+            out[n].seq = j->base_seq;
+            out[n].type = INT_STACK_CHANGE_PUSH;
+            out[n].stack_id = j->key->buffer->id;
+            out[n].value = j->base[j->base_pos++];
+            n++;
+        }
+        
+        if (j->base_pos < j->base_count)
+            return n;
+        kvfree(j->base);
+        j->base = NULL;
+    }
+    
+    while (n < JOURNAL_RECORDS) {
+        got = collect_changes(j->reader, min_t(size_t, JOURNAL_RECORDS - n, CHANGE_BATCH));
+        if (got == -EOVERFLOW)
+            WRITE_ONCE(j->resync, true);
+        if (got <= 0)
+            break;
+        
+        /* A loaded snapshot cannot be expressed as records */
+        for (i = 0; i < got; i++) {
+            if (j->reader->batch[i].type == INT_STACK_CHANGE_RESET) {
+                WRITE_ONCE(j->resync, true);
+                break;
+            }
+            out[n++] = j->reader->batch[i];
+        }
+        j->reader->next_seq += i;
+        
+        if (i < got)
+            break;
+    }
+    
+    return n;
+}
+
+static void journal_write_complete(struct urb *urb)
+{
+    struct usb_journal *j = urb->context;
+    unsigned long flags;
+    int i;
+    
+    if (urb->status) {
+        if (urb->status != -ENOENT && urb->status != -ECONNRESET &&
+            urb->status != -ESHUTDOWN)
+            atomic64_inc(&j->urb_errors);
+        /* The key may now lack records, so its journal is rewritten */
+        WRITE_ONCE(j->resync, true);
+    } else {
+        atomic64_add(urb->actual_length / sizeof(struct int_stack_change),
+                     &j->records_written);
+    }
+    
+    spin_lock_irqsave(&j->lock, flags);
+    for (i = 0; i < JOURNAL_URBS; i++) {
+        if (j->urbs[i] == urb)
+            __set_bit(i, &j->idle);
+    }
+    spin_unlock_irqrestore(&j->lock, flags);
+    
+    if (!READ_ONCE(j->stopping))
+        mod_delayed_work(system_wq, &j->work, 0);
+}
+
+static void journal_work_fn(struct work_struct *work)
+{
+    struct usb_journal *j = container_of(to_delayed_work(work), struct usb_journal, work);
+    struct urb *urb;
+    size_t records;
+    int slot, result;
+    
+    while (!READ_ONCE(j->stopping)) {
+        spin_lock_irq(&j->lock);
+        slot = find_first_bit(&j->idle, JOURNAL_URBS);
+        spin_unlock_irq(&j->lock);
+        
+        /* A completion requeues us */
+        if (slot >= JOURNAL_URBS)
+            return;
+        
+        urb = j->urbs[slot];
+        records = journal_fill(j, urb->transfer_buffer);
+        if (records == 0)
+            break;
+        
+        urb->transfer_buffer_length = records * sizeof(struct int_stack_change);
+        spin_lock_irq(&j->lock);
+        __clear_bit(slot, &j->idle);
+        spin_unlock_irq(&j->lock);
+        
+        usb_anchor_urb(urb, &j->anchor);
+        result = usb_submit_urb(urb, GFP_KERNEL);
+        if (result < 0) {
+            usb_unanchor_urb(urb);
+            spin_lock_irq(&j->lock);
+            __set_bit(slot, &j->idle);
+            spin_unlock_irq(&j->lock);
+            atomic64_inc(&j->urb_errors);
+            WRITE_ONCE(j->resync, true);
+            break;
+        }
+    }
+    
+    if (!READ_ONCE(j->stopping))
+        schedule_delayed_work(&j->work, msecs_to_jiffies(journal_flush_ms));
+}
+
+/* Applies replayed records to a growing image of the stack */
+struct journal_image {
+    int *values;
+    size_t count;
+    size_t allocated;
+    size_t capacity;
+};
+
+static int journal_apply(struct journal_image *image, const struct int_stack_change *record)
+{
+    size_t n;
+    
+    switch (record->type) {
+    case INT_STACK_CHANGE_PUSH:
+        /* A corrupt journal must not grow the image past what it declared */
+        if (image->count >= image->capacity || image->count >= INT_MAX)
+            return -EINVAL;
+        if (image->count == image->allocated) {
+            size_t allocated = min_t(size_t, max_t(size_t, image->allocated * 2, 1024),
+                                     image->capacity);
+            int *values = kvmalloc_array(allocated, sizeof(int), GFP_KERNEL);
+            
+            if (!values)
+                return -ENOMEM;
+            if (image->values)
+                memcpy(values, image->values, image->count * sizeof(int));
+            kvfree(image->values);
+            image->values = values;
+            image->allocated = allocated;
+        }
+        image->values[image->count++] = record->value;
+        break;
+        
+    case INT_STACK_CHANGE_POP:
+        n = record->value > 0 ? record->value : 0;
+        image->count -= min(n, image->count);
+        break;
+        
+    case INT_STACK_CHANGE_CLEAR:
+    case INT_STACK_CHANGE_RESET:
+        image->count = 0;
+        break;
+        
+    case INT_STACK_CHANGE_RESIZE:
+        image->capacity = record->value > 0 ? record->value : 0;
+        image->count = min(image->count, image->capacity);
+        break;
+    }
+    
+    return 0;
+}
+
+static int journal_replay(struct usb_journal *j)
+{
+    struct integer_buffer *buffer = j->key->buffer;
+    struct journal_image image = { };
+    size_t carry = 0, requested, records, replayed = 0, capacity, i;
+    int *new_array = NULL;
+    int actual, result;
+    u8 *chunk;
+    
+    result = usb_control_msg(j->udev, usb_sndctrlpipe(j->udev, 0), JOURNAL_REQ_REPLAY,
+                             USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE, 0,
+                             j->interface->cur_altsetting->desc.bInterfaceNumber,
+                             NULL, 0, JOURNAL_TIMEOUT_MS);
+    if (result < 0)
+        return result;
+    
+    chunk = kmalloc(JOURNAL_URB_SIZE, GFP_KERNEL);
+    if (!chunk)
+        return -ENOMEM;
+    
+    /* Records may straddle transfers, so a partial one is carried over */
+    do {
+        requested = JOURNAL_URB_SIZE - carry;
+        result = usb_bulk_msg(j->udev, j->in_pipe, chunk + carry, requested,
+                              &actual, JOURNAL_TIMEOUT_MS);
+        if (result < 0)
+            break;
+        
+        records = (carry + actual) / sizeof(struct int_stack_change);
+        for (i = 0; i < records && result == 0; i++)
+            result = journal_apply(&image, (struct int_stack_change *)chunk + i);
+        replayed += records;
+        
+        carry = (carry + actual) % sizeof(struct int_stack_change);
+        memmove(chunk, chunk + records * sizeof(struct int_stack_change), carry);
+    } while (result == 0 && actual == requested);
+    
+    kfree(chunk);
+    
+    /* A fresh key has an empty journal and leaves the stack alone */
+    if (result == 0 && replayed > 0) {
+        mutex_lock(&buffer->op_lock);
+        capacity = max3(image.capacity, buffer->capacity, image.count);
+        if (capacity > 0) {
+            new_array = kvcalloc(capacity, sizeof(int), GFP_KERNEL);
+            if (!new_array)
+                result = -ENOMEM;
+            else if (image.count)
+                memcpy(new_array, image.values, image.count * sizeof(int));
+        }
+        if (result == 0)
+            result = install_contents(buffer, new_array, image.count, capacity);
+        mutex_unlock(&buffer->op_lock);
+        
+        if (result == 0)
+            printk(KERN_INFO "int_stack: restored %zu elements from the journal of key %s\n",
+                   image.count, j->key->serial);
+    }
+    
+    kvfree(image.values);
+    return result;
+}
+
+static void journal_free(struct usb_journal *j)
+{
+    int i;
+    
+    for (i = 0; i < JOURNAL_URBS; i++) {
+        if (!j->urbs[i])
+            continue;
+        usb_free_coherent(j->udev, JOURNAL_URB_SIZE, j->urbs[i]->transfer_buffer,
+                          j->urbs[i]->transfer_dma);
+        usb_free_urb(j->urbs[i]);
+    }
+    
+    if (j->reader)
+        free_change_reader(j->reader);
+    kvfree(j->base);
+    usb_put_dev(j->udev);
+    kfree(j);
+}
+
+static void journal_attach(struct usb_key *key, struct usb_interface *interface)
+{
+    struct usb_endpoint_descriptor *bulk_in, *bulk_out;
+    struct usb_journal *j;
+    int i, result;
+    
+    if (!usb_journal || !key->buffer->changes || key->journal)
+        return;
+    
+    if (usb_find_common_endpoints(interface->cur_altsetting, &bulk_in, &bulk_out,
+                                  NULL, NULL)) {
+        printk(KERN_INFO "int_stack: key has no bulk endpoints, journal disabled\n");
+        return;
+    }
+    
+    j = kzalloc(sizeof(*j), GFP_KERNEL);
+    if (!j)
+        return;
+    
+    j->key = key;
+    j->udev = usb_get_dev(interface_to_usbdev(interface));
+    j->interface = interface;
+    j->in_pipe = usb_rcvbulkpipe(j->udev, usb_endpoint_num(bulk_in));
+    j->out_pipe = usb_sndbulkpipe(j->udev, usb_endpoint_num(bulk_out));
+    init_usb_anchor(&j->anchor);
+    spin_lock_init(&j->lock);
+    INIT_DELAYED_WORK(&j->work, journal_work_fn);
+    atomic64_set(&j->records_written, 0);
+    atomic64_set(&j->urb_errors, 0);
+    atomic64_set(&j->resyncs, 0);
+    j->resync = true;
+    
+    result = 0;
+    for (i = 0; i < JOURNAL_URBS && result == 0; i++) {
+        struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+        void *data;
+        
+        if (!urb) {
+            result = -ENOMEM;
+            break;
+        }
+        
+        data = usb_alloc_coherent(j->udev, JOURNAL_URB_SIZE, GFP_KERNEL, &urb->transfer_dma);
+        if (!data) {
+            usb_free_urb(urb);
+            result = -ENOMEM;
+            break;
+        }
+        
+        usb_fill_bulk_urb(urb, j->udev, j->out_pipe, data, JOURNAL_URB_SIZE,
+                          journal_write_complete, j);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        j->urbs[i] = urb;
+        __set_bit(i, &j->idle);
+    }
+    
+    if (result == 0) {
+        j->reader = alloc_change_reader(key->buffer, 0);
+        if (!j->reader)
+            result = -ENOMEM;
+    }
+    
+    /* A journal that cannot be read back must not be overwritten */
+    if (result == 0 && !key->journal_replayed) {
+        result = journal_replay(j);
+        if (result == 0)
+            key->journal_replayed = true;
+    }
+    
+    if (result < 0) {
+        printk(KERN_ERR "int_stack: journal disabled: %d\n", result);
+        journal_free(j);
+        return;
+    }
+    
+    key->journal = j;
+    schedule_delayed_work(&j->work, 0);
+}
+
+/* Records not yet on the key are rewritten by the resync of the next plug-in */
+static void journal_detach(struct usb_key *key)
+{
+    struct usb_journal *j = key->journal;
+    
+    if (!j)
+        return;
+    
+    /* The work may submit one more URB before it sees stopping */
+    WRITE_ONCE(j->stopping, true);
+    usb_kill_anchored_urbs(&j->anchor);
+    cancel_delayed_work_sync(&j->work);
+    usb_kill_anchored_urbs(&j->anchor);
+    
+    printk(KERN_INFO "int_stack: key %s journal records=%lld urb_errors=%lld resyncs=%lld\n",
+           key->serial, atomic64_read(&j->records_written), atomic64_read(&j->urb_errors),
+           atomic64_read(&j->resyncs));
+    
+    key->journal = NULL;
+    journal_free(j);
+}
+
+/*
+ * Sample producer. A key that streams little-endian 32-bit samples on an
+ * interrupt IN endpoint, or on bulk IN when the journal does not own it,
+ * feeds its stack directly: a ring of anchored URBs stays in
+ * flight and each completion pushes its whole transfer with one
+ * int_stack_push_n_atomic(), then resubmits itself. Like the BPF kfuncs
+ * this bypasses the push filter and auto-resize; samples that find the
+ * stack full are counted as overruns.
+ */
+#define PRODUCER_BULK_SIZE   (16 * 1024)
+#define PRODUCER_MAX_URBS    64
+
+struct usb_producer {
+    struct usb_key *key;
+    struct usb_device *udev;
+    struct usb_anchor anchor;
+    struct urb **urbs;
+    int nr_urbs;
+    size_t transfer_size;
+};
+
+static void producer_complete(struct urb *urb)
 {
-    if (atomic_read(&usb_key_present) == 0)
-        return -ENODEV;
+    struct usb_producer *p = urb->context;
+    struct usb_key *key = p->key;
+    __le32 *raw = urb->transfer_buffer;
+    int *values = urb->transfer_buffer;
+    size_t count, i;
+    int pushed, result;
     
-    return 0;
+    switch (urb->status) {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        /* Killed by producer_detach or the key is gone */
+        return;
+    default:
+        atomic64_inc(&key->urb_errors);
+        goto resubmit;
+    }
+    
+    count = urb->actual_length / sizeof(__le32);
+    for (i = 0; i < count; i++)
+        values[i] = le32_to_cpu(raw[i]);
+    
+    if (count) {
+        pushed = int_stack_push_n_atomic(key->buffer, values, count);
+        if (pushed < 0)
+            pushed = 0;
+        atomic64_add(pushed, &key->samples);
+        atomic64_add(count - pushed, &key->overruns);
+    }
+    
+resubmit:
+    usb_anchor_urb(urb, &p->anchor);
+    result = usb_submit_urb(urb, GFP_ATOMIC);
+    if (result < 0) {
+        usb_unanchor_urb(urb);
+        /* -EPERM means producer_detach poisoned it */
+        if (result != -EPERM && result != -ENODEV)
+            atomic64_inc(&key->urb_errors);
+    }
 }
 
-static int buffer_release(struct inode *inode, struct file *file)
+static void producer_free(struct usb_producer *p)
 {
-    return 0;
+    int i;
+    
+    for (i = 0; i < p->nr_urbs; i++) {
+        if (!p->urbs[i])
+            continue;
+        usb_free_coherent(p->udev, p->transfer_size, p->urbs[i]->transfer_buffer,
+                          p->urbs[i]->transfer_dma);
+        usb_free_urb(p->urbs[i]);
+    }
+    
+    kfree(p->urbs);
+    usb_put_dev(p->udev);
+    kfree(p);
 }
 
-static int resize_buffer(size_t new_capacity)
+static void producer_attach(struct usb_key *key, struct usb_interface *interface)
 {
-    int *new_array;
-    size_t copy_size;
+    struct usb_endpoint_descriptor *endpoint = NULL;
+    struct usb_host_interface *alt = interface->cur_altsetting;
+    struct usb_producer *p;
+    unsigned int pipe;
+    int i, result = 0;
     
-    if (new_capacity == 0) {
-        if (dev_buffer->elements) {
-            kfree(dev_buffer->elements);
-            dev_buffer->elements = NULL;
-        }
-        dev_buffer->capacity = 0;
-        dev_buffer->position = 0;
-        return 0;
+    if (!usb_samples || key->producer)
+        return;
+    
+    usb_find_int_in_endpoint(alt, &endpoint);
+    if (!endpoint && !usb_journal)
+        usb_find_bulk_in_endpoint(alt, &endpoint);
+    if (!endpoint) {
+        printk(KERN_INFO "int_stack: key has no sample endpoint\n");
+        return;
     }
-
-    new_array = kzalloc(sizeof(int) * new_capacity, GFP_KERNEL);
-    if (!new_array)
-        return -ENOMEM;
+    
+    p = kzalloc(sizeof(*p), GFP_KERNEL);
+    if (!p)
+        return;
+    
+    p->nr_urbs = clamp(sample_urbs, 1, PRODUCER_MAX_URBS);
+    p->urbs = kcalloc(p->nr_urbs, sizeof(*p->urbs), GFP_KERNEL);
+    if (!p->urbs) {
+        kfree(p);
+        return;
+    }
+    
+    p->key = key;
+    p->udev = usb_get_dev(interface_to_usbdev(interface));
+    init_usb_anchor(&p->anchor);
+    
+    /* An interrupt URB carries one packet per interval */
+    if (usb_endpoint_xfer_int(endpoint)) {
+        pipe = usb_rcvintpipe(p->udev, usb_endpoint_num(endpoint));
+        p->transfer_size = usb_endpoint_maxp(endpoint) * usb_endpoint_maxp_mult(endpoint);
+    } else {
+        pipe = usb_rcvbulkpipe(p->udev, usb_endpoint_num(endpoint));
+        p->transfer_size = PRODUCER_BULK_SIZE;
+    }
+    
+    for (i = 0; i < p->nr_urbs; i++) {
+        struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+        void *data;
         
-    if (dev_buffer->elements && dev_buffer->position > 0) {
-        copy_size = min(dev_buffer->position, new_capacity);
-        memcpy(new_array, dev_buffer->elements, sizeof(int) * copy_size);
+        if (!urb) {
+            result = -ENOMEM;
+            break;
+        }
         
-        kfree(dev_buffer->elements);
+        data = usb_alloc_coherent(p->udev, p->transfer_size, GFP_KERNEL, &urb->transfer_dma);
+        if (!data) {
+            usb_free_urb(urb);
+            result = -ENOMEM;
+            break;
+        }
         
-        dev_buffer->position = copy_size;
-    } else {
-        dev_buffer->position = 0;
+        if (usb_endpoint_xfer_int(endpoint))
+            usb_fill_int_urb(urb, p->udev, pipe, data, p->transfer_size,
+                             producer_complete, p, endpoint->bInterval);
+        else
+            usb_fill_bulk_urb(urb, p->udev, pipe, data, p->transfer_size,
+                              producer_complete, p);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        p->urbs[i] = urb;
     }
     
-    dev_buffer->elements = new_array;
-    dev_buffer->capacity = new_capacity;
+    if (result == 0) {
+        key->producer = p;
+        for (i = 0; i < p->nr_urbs && result == 0; i++) {
+            usb_anchor_urb(p->urbs[i], &p->anchor);
+            result = usb_submit_urb(p->urbs[i], GFP_KERNEL);
+            if (result < 0)
+                usb_unanchor_urb(p->urbs[i]);
+        }
+    }
     
-    return 0;
+    if (result < 0) {
+        printk(KERN_ERR "int_stack: sample producer disabled: %d\n", result);
+        usb_poison_anchored_urbs(&p->anchor);
+        key->producer = NULL;
+        producer_free(p);
+        return;
+    }
+    
+    printk(KERN_INFO "int_stack: streaming samples from %s endpoint 0x%02x, %d URBs of %zu bytes\n",
+           usb_endpoint_xfer_int(endpoint) ? "interrupt" : "bulk",
+           endpoint->bEndpointAddress, p->nr_urbs, p->transfer_size);
 }
 
-static long buffer_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static void producer_detach(struct usb_key *key)
 {
-    int result = 0;
-    int value = 0;
+    struct usb_producer *p = key->producer;
     
-    if (atomic_read(&usb_key_present) == 0)
-        return -ENODEV;
+    if (!p)
+        return;
     
-    mutex_lock(&dev_buffer->op_lock);
+    /* Poisoning also fails the resubmit of a completion in progress */
+    usb_poison_anchored_urbs(&p->anchor);
     
-    switch (cmd) {
-    case INT_STACK_SET_MAX_SIZE:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(int))) {
-            result = -EFAULT;
-            break;
-        }
+    printk(KERN_INFO "int_stack: key %s samples=%lld overruns=%lld urb_errors=%lld\n",
+           key->serial, atomic64_read(&key->samples), atomic64_read(&key->overruns),
+           atomic64_read(&key->urb_errors));
+    
+    key->producer = NULL;
+    producer_free(p);
+}
+
+/* A stack behind a device node; only those are visible to followers */
+static struct integer_buffer *create_device_stack(const char *name)
+{
+    struct integer_buffer *buffer;
+    
+    buffer = int_stack_create(name, default_capacity > 0 ? default_capacity : 0);
+    if (IS_ERR(buffer))
+        return buffer;
+    
+    /* The journal follows the change log too */
+    if (change_log_size > 0 || usb_journal) {
+        int result = init_change_log(buffer, change_log_size > 0 ?
+                                     change_log_size : JOURNAL_LOG_SIZE);
         
-        if (value < 0) {
-            result = -EINVAL;
-            break;
+        if (result < 0) {
+            int_stack_destroy(buffer);
+            return ERR_PTR(result);
         }
+    }
+    
+    return buffer;
+}
+
+static int initialize_buffer(void)
+{
+    dev_buffer = create_device_stack("int_stack");
+    if (IS_ERR(dev_buffer)) {
+        int result = PTR_ERR(dev_buffer);
         
-        result = resize_buffer(value);
-        break;
-        
-    case CMD_GET_CAPACITY:
-        value = dev_buffer->capacity;
-        if (copy_to_user((int __user *)arg, &value, sizeof(int)))
-            result = -EFAULT;
-        break;
-        
-    case CMD_GET_USAGE:
-        value = dev_buffer->position;
-        if (copy_to_user((int __user *)arg, &value, sizeof(int)))
-            result = -EFAULT;
-        break;
-        
-    case CMD_CLEAR_BUFFER:
-        dev_buffer->position = 0;
-        break;
-        
-    default:
-        result = -ENOTTY;
+        dev_buffer = NULL;
+        return result;
     }
     
-    mutex_unlock(&dev_buffer->op_lock);
-    return result;
+    return 0;
 }
 
-static ssize_t buffer_read(struct file *file, char __user *user_buffer, 
-                          size_t count, loff_t *offset)
+static void gate_drained(struct percpu_ref *ref)
 {
-    int value;
+    complete_all(&container_of(ref, struct key_gate, ref)->drained);
+}
+
+static void gate_expire(struct work_struct *work);
+static void gate_sync(struct work_struct *work);
+
+/* Gates start closed, as if their key had been removed */
+static int init_gate(struct key_gate *gate, struct miscdevice *misc)
+{
+    int result;
     
-    if (atomic_read(&usb_key_present) == 0)
-        return -ENODEV;
+    gate->misc = misc;
+    gate->registered = false;
+    atomic_set(&gate->present, 0);
+    atomic_set(&gate->grace, 0);
+    init_waitqueue_head(&gate->wait);
+    init_completion(&gate->drained);
+    INIT_DELAYED_WORK(&gate->expire, gate_expire);
+    INIT_WORK(&gate->sync, gate_sync);
     
-    if (count < sizeof(int))
-        return -EINVAL;
-        
-    mutex_lock(&dev_buffer->op_lock);
+    result = percpu_ref_init(&gate->ref, gate_drained, PERCPU_REF_ALLOW_REINIT, GFP_KERNEL);
+    if (result < 0)
+        return result;
+    percpu_ref_kill(&gate->ref);
+    
+    return 0;
+}
+
+/* Registers the node while the key is present or may come back */
+static void sync_gate_locked(struct key_gate *gate)
+{
+    bool wanted = atomic_read(&gate->present) || atomic_read(&gate->grace);
+    int result;
     
-    if (dev_buffer->position == 0) {
-        atomic_inc(&dev_buffer->stats.underflow_count);
-        mutex_unlock(&dev_buffer->op_lock);
-        return 0; 
+    lockdep_assert_held(&key_lock);
+    
+    if (wanted && !gate->registered) {
+        gate->misc->minor = MISC_DYNAMIC_MINOR;
+        result = misc_register(gate->misc);
+        if (result < 0) {
+            printk(KERN_ERR "int_stack: Failed to register device %s: %d\n",
+                   gate->misc->name, result);
+            return;
+        }
+        gate->registered = true;
+        printk(KERN_INFO "int_stack: device %s registered\n", gate->misc->name);
+    } else if (!wanted && gate->registered) {
+        misc_deregister(gate->misc);
+        gate->registered = false;
+        printk(KERN_INFO "int_stack: device %s unregistered\n", gate->misc->name);
     }
+}
+
+static void gate_sync(struct work_struct *work)
+{
+    struct key_gate *gate = container_of(work, struct key_gate, sync);
+    
+    mutex_lock(&key_lock);
+    sync_gate_locked(gate);
+    mutex_unlock(&key_lock);
+}
+
+/* Lets ops in and wakes those waiting out a grace period */
+static void open_gate(struct key_gate *gate)
+{
+    lockdep_assert_held(&key_lock);
+    
+    /* gate_expire rechecks present under key_lock, so no need to sync */
+    cancel_delayed_work(&gate->expire);
+    
+    /* Only a drained ref can be revived; normally it already is */
+    wait_for_completion(&gate->drained);
+    reinit_completion(&gate->drained);
+    percpu_ref_reinit(&gate->ref);
     
-    dev_buffer->position--;
-    value = dev_buffer->elements[dev_buffer->position];
+    atomic_set(&gate->grace, 0);
+    atomic_set(&gate->present, 1);
+    wake_up_all(&gate->wait);
     
+    /* An existing node (grace period, churn) is left alone */
+    if (!gate->registered)
+        queue_work(system_wq, &gate->sync);
+}
 
-    if (copy_to_user(user_buffer, &value, sizeof(int))) {
-        dev_buffer->position++;
-        mutex_unlock(&dev_buffer->op_lock);
-        return -EFAULT;
+/* Stops new ops; the caller then waits for drained */
+static void close_gate(struct key_gate *gate)
+{
+    int grace_ms = READ_ONCE(removal_grace_ms);
+    
+    lockdep_assert_held(&key_lock);
+    
+    /* grace goes first so that ops failing to get ref see it */
+    if (grace_ms > 0) {
+        atomic_set(&gate->grace, 1);
+        mod_delayed_work(system_wq, &gate->expire, msecs_to_jiffies(grace_ms));
     }
+    atomic_set(&gate->present, 0);
+    percpu_ref_kill(&gate->ref);
+    
+    if (grace_ms <= 0)
+        queue_work(system_wq, &gate->sync);
+}
+
+static void gate_expire(struct work_struct *work)
+{
+    struct key_gate *gate = container_of(to_delayed_work(work), struct key_gate, expire);
     
-    atomic_inc(&dev_buffer->stats.pop_count);
-    mutex_unlock(&dev_buffer->op_lock);
+    mutex_lock(&key_lock);
+    if (!atomic_read(&gate->present) && atomic_read(&gate->grace)) {
+        atomic_set(&gate->grace, 0);
+        sync_gate_locked(gate);
+    }
+    mutex_unlock(&key_lock);
     
-    return sizeof(int);
+    wake_up_all(&gate->wait);
 }
 
-static ssize_t buffer_write(struct file *file, const char __user *user_buffer,
-                           size_t count, loff_t *offset)
+/* At module exit, once no key can come back and no file is open */
+static void release_gate(struct key_gate *gate)
 {
-    int value;
-    int result;
+    mutex_lock(&key_lock);
+    if (atomic_read(&gate->present))
+        close_gate(gate);
+    atomic_set(&gate->grace, 0);
+    mutex_unlock(&key_lock);
     
-    if (atomic_read(&usb_key_present) == 0)
-        return -ENODEV;
+    cancel_delayed_work_sync(&gate->expire);
+    cancel_work_sync(&gate->sync);
+    wait_for_completion(&gate->drained);
     
-    if (count != sizeof(int))
-        return -EINVAL;
-        
-    if (copy_from_user(&value, user_buffer, sizeof(int)))
-        return -EFAULT;
-        
-    mutex_lock(&dev_buffer->op_lock);
+    mutex_lock(&key_lock);
+    sync_gate_locked(gate);
+    mutex_unlock(&key_lock);
     
-    if (dev_buffer->position >= dev_buffer->capacity) {
-        if (enable_auto_resize) {
-            size_t new_capacity = max(dev_buffer->capacity * 2, 8UL);
-            result = resize_buffer(new_capacity);
-            if (result < 0) {
-                atomic_inc(&dev_buffer->stats.overflow_count);
-                mutex_unlock(&dev_buffer->op_lock);
-                return -ENOSPC;
-            }
-        } else {
-            atomic_inc(&dev_buffer->stats.overflow_count);
-            mutex_unlock(&dev_buffer->op_lock);
-            return -ENOSPC;
-        }
-    }
+    percpu_ref_exit(&gate->ref);
+}
+
+/* Device and stack names only keep characters that are safe in /dev */
+static void key_serial(struct usb_device *udev, char *serial)
+{
+    char fallback[KEY_SERIAL_LEN];
+    const char *src = udev->serial;
+    size_t i;
     
-    dev_buffer->elements[dev_buffer->position++] = value;
-    atomic_inc(&dev_buffer->stats.push_count);
+    /* Keys without a serial number are told apart by their port */
+    if (!src || !*src) {
+        snprintf(fallback, sizeof(fallback), "port%s", udev->devpath);
+        src = fallback;
+    }
     
-    mutex_unlock(&dev_buffer->op_lock);
-    return sizeof(int);
+    for (i = 0; src[i] && i < KEY_SERIAL_LEN - 1; i++)
+        serial[i] = isalnum(src[i]) || src[i] == '-' || src[i] == '.' ? src[i] : '_';
+    serial[i] = '\0';
 }
 
-static const struct file_operations buffer_fops = {
-    .owner = THIS_MODULE,
-    .open = buffer_open,
-    .release = buffer_release,
-    .read = buffer_read,
-    .write = buffer_write,
-    .unlocked_ioctl = buffer_ioctl,
-    .compat_ioctl = buffer_ioctl,  /* For 32bit userspace on 64bit kernel */
-};
+/* Finds the key with this serial number or adds it with a fresh stack */
+static struct usb_key *get_key(struct usb_device *udev)
+{
+    char serial[KEY_SERIAL_LEN];
+    struct usb_key *key;
+    
+    lockdep_assert_held(&key_lock);
+    
+    key_serial(udev, serial);
+    list_for_each_entry(key, &key_list, node) {
+        if (strcmp(key->serial, serial) == 0)
+            return key;
+    }
+    
+    key = kzalloc(sizeof(*key), GFP_KERNEL);
+    if (!key)
+        return ERR_PTR(-ENOMEM);
+    
+    strscpy(key->serial, serial, sizeof(key->serial));
+    snprintf(key->name, sizeof(key->name), "int_stack-%s", serial);
+    key->buffer = create_device_stack(key->name);
+    if (IS_ERR(key->buffer)) {
+        struct integer_buffer *buffer = key->buffer;
+        
+        kfree(key);
+        return ERR_CAST(buffer);
+    }
+    
+    key->misc.name = key->name;
+    key->misc.fops = &buffer_fops;
+    key->misc.mode = 0666;
+    if (init_gate(&key->gate, &key->misc) < 0) {
+        int_stack_destroy(key->buffer);
+        kfree(key);
+        return ERR_PTR(-ENOMEM);
+    }
+    atomic64_set(&key->samples, 0);
+    atomic64_set(&key->overruns, 0);
+    atomic64_set(&key->urb_errors, 0);
+    list_add_tail(&key->node, &key_list);
+    
+    return key;
+}
 
-static struct miscdevice buffer_device = {
-    .minor = MISC_DYNAMIC_MINOR,
-    .name = "int_stack",
-    .fops = &buffer_fops,
-    .mode = 0666, 
-};
+/* The device nodes appear asynchronously, see gate_sync */
+static int plug_key(struct usb_key *key, struct usb_interface *interface)
+{
+    mutex_lock(&key_lock);
+    
+    /* Two keys with the same serial number cannot share a stack */
+    if (atomic_read(&key->gate.present)) {
+        mutex_unlock(&key_lock);
+        return -EBUSY;
+    }
+    
+    open_gate(&key->gate);
+    key->interface = interface;
+    
+    if (atomic_inc_return(&usb_key_present) == 1 && require_key)
+        open_gate(&shared_gate);
+    
+    mutex_unlock(&key_lock);
+    
+    printk(KERN_INFO "int_stack: key %s bound to /dev/%s, depth=%zu capacity=%zu\n",
+           key->serial, key->name, int_stack_usage(key->buffer), key->buffer->capacity);
+    return 0;
+}
 
-static void init_stats(struct buffer_stats *stats)
+/*
+ * Ops already past the gate finish before the key is torn down. They
+ * never take key_lock, so draining under it cannot deadlock, and it keeps
+ * a concurrent plug-in from reviving the ref before it has drained.
+ */
+static void unplug_key(struct usb_key *key)
 {
-    atomic_set(&stats->push_count, 0);
-    atomic_set(&stats->pop_count, 0);
-    atomic_set(&stats->overflow_count, 0);
-    atomic_set(&stats->underflow_count, 0);
+    mutex_lock(&key_lock);
+    
+    close_gate(&key->gate);
+    key->interface = NULL;
+    wait_for_completion(&key->gate.drained);
+    
+    if (atomic_dec_return(&usb_key_present) == 0 && require_key) {
+        close_gate(&shared_gate);
+        wait_for_completion(&shared_gate.drained);
+    }
+    
+    mutex_unlock(&key_lock);
 }
 
-static int initialize_buffer(void)
+/* At module exit, after the USB driver has let go of every key */
+static void release_keys(void)
 {
-    int result;
+    struct usb_key *key, *tmp;
     
-    dev_buffer = kzalloc(sizeof(struct integer_buffer), GFP_KERNEL);
-    if (!dev_buffer)
-        return -ENOMEM;
-        
-    dev_buffer->elements = NULL;
-    dev_buffer->capacity = 0;
-    dev_buffer->position = 0;
-    mutex_init(&dev_buffer->op_lock);
-    init_stats(&dev_buffer->stats);
+    list_for_each_entry_safe(key, tmp, &key_list, node) {
+        printk(KERN_INFO "int_stack: key %s stats: pushed=%d, popped=%d, overflows=%d, underflows=%d\n",
+               key->serial,
+               atomic_read(&key->buffer->stats.push_count),
+               atomic_read(&key->buffer->stats.pop_count),
+               atomic_read(&key->buffer->stats.overflow_count),
+               atomic_read(&key->buffer->stats.underflow_count));
+        release_gate(&key->gate);
+        list_del(&key->node);
+        int_stack_destroy(key->buffer);
+        kfree(key);
+    }
+}
+
+static int keys_show(struct seq_file *m, void *v)
+{
+    struct usb_key *key;
     
-    if (default_capacity > 0) {
-        mutex_lock(&dev_buffer->op_lock);
-        result = resize_buffer(default_capacity);
-        mutex_unlock(&dev_buffer->op_lock);
+    mutex_lock(&key_lock);
+    list_for_each_entry(key, &key_list, node) {
+        struct integer_buffer *buffer = key->buffer;
         
-        if (result < 0) {
-            kfree(dev_buffer);
-            return result;
-        }
+        seq_printf(m, "%s present=%d grace=%d depth=%zu capacity=%zu pushed=%d popped=%d "
+                   "overflows=%d underflows=%d samples=%lld overruns=%lld urb_errors=%lld\n",
+                   key->serial, atomic_read(&key->gate.present),
+                   atomic_read(&key->gate.grace),
+                   READ_ONCE(buffer->position), READ_ONCE(buffer->capacity),
+                   atomic_read(&buffer->stats.push_count),
+                   atomic_read(&buffer->stats.pop_count),
+                   atomic_read(&buffer->stats.overflow_count),
+                   atomic_read(&buffer->stats.underflow_count),
+                   atomic64_read(&key->samples), atomic64_read(&key->overruns),
+                   atomic64_read(&key->urb_errors));
     }
+    mutex_unlock(&key_lock);
     
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(keys);
+
+/*
+ * BPF kfuncs. They run in any context a BPF program can (XDP, kprobes,
+ * tracing), so they are thin wrappers over the _atomic API: no op_lock,
+ * no push filter and no auto-resize. The program may be attached to
+ * something running under this very data_lock, so they only try it and
+ * return -EBUSY when it is taken.
+ */
+__bpf_kfunc_start_defs();
 
-static int register_device(void)
+__bpf_kfunc int bpf_int_stack_push(const char *name__str, int value)
 {
-    int result;
+    struct integer_buffer *buffer;
+    int result = -ENOENT;
     
-    if (atomic_read(&device_registered))
-        return 0;
+    rcu_read_lock();
+    buffer = find_stack_rcu(name__str);
+    if (buffer)
+        result = __int_stack_push_atomic(buffer, value, true);
+    rcu_read_unlock();
     
-    result = misc_register(&buffer_device);
-    if (result < 0)
-        return result;
+    return result;
+}
+
+__bpf_kfunc int bpf_int_stack_pop(const char *name__str, int *value)
+{
+    struct integer_buffer *buffer;
+    int result = -ENOENT;
     
-    atomic_set(&device_registered, 1);
-    printk(KERN_INFO "int_stack: device registered with capacity=%zu\n", 
-           dev_buffer->capacity);
+    rcu_read_lock();
+    buffer = find_stack_rcu(name__str);
+    if (buffer)
+        result = __int_stack_pop_atomic(buffer, value, true);
+    rcu_read_unlock();
     
-    return 0;
+    return result;
 }
 
-static void unregister_device(void)
+__bpf_kfunc int bpf_int_stack_peek(const char *name__str, int *value)
 {
-    if (atomic_read(&device_registered)) {
-        misc_deregister(&buffer_device);
-        atomic_set(&device_registered, 0);
-        printk(KERN_INFO "int_stack: device unregistered\n");
+    struct integer_buffer *buffer;
+    unsigned long flags;
+    int result = -ENOENT;
+    
+    rcu_read_lock();
+    buffer = find_stack_rcu(name__str);
+    if (buffer) {
+        result = -EBUSY;
+        if (stack_lock_atomic(buffer, &flags, true)) {
+            result = -ENODATA;
+            if (buffer->position > 0) {
+                *value = buffer->elements[buffer->position - 1];
+                result = 0;
+            }
+            raw_spin_unlock_irqrestore(&buffer->data_lock, flags);
+        }
     }
+    rcu_read_unlock();
+    
+    return result;
+}
+
+/* Returns the current depth, or a negative errno */
+__bpf_kfunc s64 bpf_int_stack_usage(const char *name__str)
+{
+    struct integer_buffer *buffer;
+    s64 result = -ENOENT;
+    
+    rcu_read_lock();
+    buffer = find_stack_rcu(name__str);
+    if (buffer)
+        result = int_stack_usage(buffer);
+    rcu_read_unlock();
+    
+    return result;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(int_stack_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_int_stack_push)
+BTF_ID_FLAGS(func, bpf_int_stack_pop)
+BTF_ID_FLAGS(func, bpf_int_stack_peek)
+BTF_ID_FLAGS(func, bpf_int_stack_usage)
+BTF_KFUNCS_END(int_stack_kfunc_ids)
+
+static const struct btf_kfunc_id_set int_stack_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set = &int_stack_kfunc_ids,
+};
+
+static const enum bpf_prog_type int_stack_kfunc_prog_types[] = {
+    BPF_PROG_TYPE_XDP,
+    BPF_PROG_TYPE_KPROBE,
+    BPF_PROG_TYPE_TRACING,
+};
+
+static void create_debugfs(void)
+{
+    debug_dir = debugfs_create_dir("int_stack", NULL);
+    debugfs_create_file("latency", 0444, debug_dir, NULL, &latency_fops);
+    debugfs_create_file_unsafe("latency_enable", 0644, debug_dir, NULL,
+                               &latency_enable_fops);
+    debugfs_create_file_unsafe("latency_reset", 0200, debug_dir, NULL,
+                               &latency_reset_fops);
+    debugfs_create_file("clients", 0444, debug_dir, NULL, &clients_fops);
+    debugfs_create_file("depth_samples", 0400, debug_dir, NULL, &depth_samples_fops);
+    debugfs_create_file("high_water", 0444, debug_dir, NULL, &high_water_fops);
+    debugfs_create_file("sojourn", 0444, debug_dir, NULL, &sojourn_fops);
+    debugfs_create_file("stages", 0444, debug_dir, NULL, &stages_fops);
+    debugfs_create_file("stacks", 0444, debug_dir, NULL, &stacks_fops);
+    debugfs_create_file("keys", 0444, debug_dir, NULL, &keys_fops);
 }
 
 static struct usb_device_id pen_table[] = {
@@ -312,6 +4269,7 @@ MODULE_DEVICE_TABLE(usb, pen_table);
 
 static int pen_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
+    struct usb_key *key;
     int result;
     struct usb_device *dev = interface_to_usbdev(interface);
     
@@ -320,29 +4278,38 @@ static int pen_probe(struct usb_interface *interface, const struct usb_device_id
     
     printk(KERN_INFO "USB Key (%04X:%04X) plugged in\n", dev->descriptor.idVendor, dev->descriptor.idProduct);
     
-    atomic_set(&usb_key_present, 1);
+    mutex_lock(&key_lock);
+    key = get_key(dev);
+    mutex_unlock(&key_lock);
+    if (IS_ERR(key))
+        return PTR_ERR(key);
     
-    result = register_device();
+    result = plug_key(key, interface);
     if (result < 0) {
-        printk(KERN_ERR "int_stack: Failed to register device: %d\n", result);
+        printk(KERN_ERR "int_stack: Failed to bind key %s: %d\n", key->serial, result);
         return result;
     }
     
+    usb_set_intfdata(interface, key);
+    journal_attach(key, interface);
+    producer_attach(key, interface);
+    
     return 0;
 }
 
 static void pen_disconnect(struct usb_interface *interface)
 {
-    struct usb_device *dev = interface_to_usbdev(interface);
+    struct usb_key *key = usb_get_intfdata(interface);
     
-    if (dev->descriptor.idVendor != usb_vid || dev->descriptor.idProduct != usb_pid)
+    if (!key)
         return;
     
-    printk(KERN_INFO "USB Key removed\n");
+    printk(KERN_INFO "USB Key %s removed\n", key->serial);
     
-    atomic_set(&usb_key_present, 0);
-    
-    unregister_device();
+    unplug_key(key);
+    producer_detach(key);
+    journal_detach(key);
+    usb_set_intfdata(interface, NULL);
 }
 
 static struct usb_driver pen_driver = {
@@ -352,8 +4319,17 @@ static struct usb_driver pen_driver = {
     .disconnect = pen_disconnect,
 };
 
+static void release_buffer(void)
+{
+    if (dev_buffer) {
+        int_stack_destroy(dev_buffer);
+        dev_buffer = NULL;
+    }
+}
+
 static int __init integer_buffer_init(void)
 {
+    unsigned int i;
     int result;
     
     printk(KERN_INFO "int_stack: Configured for USB device %04X:%04X\n", usb_vid, usb_pid);
@@ -364,41 +4340,73 @@ static int __init integer_buffer_init(void)
     result = initialize_buffer();
     if (result < 0)
         return result;
+    result = init_gate(&shared_gate, &buffer_device);
+    if (result < 0)
+        goto err_buffer;
+    /* Set before the node can be opened, so enter and exit always agree */
+    if (!require_key) {
+        static_branch_enable(&shared_always_present);
+        mutex_lock(&key_lock);
+        open_gate(&shared_gate);
+        mutex_unlock(&key_lock);
+    }
+    
+    result = init_client_table();
+    if (result < 0)
+        goto err_gate;
+    
+    if (latency_stats)
+        static_branch_enable(&latency_tracking);
+    register_builtin_transforms();
+    create_debugfs();
+    
+    /* Needs module BTF; the character device works without it */
+    for (i = 0; i < ARRAY_SIZE(int_stack_kfunc_prog_types); i++) {
+        result = register_btf_kfunc_id_set(int_stack_kfunc_prog_types[i],
+                                           &int_stack_kfunc_set);
+        if (result < 0)
+            printk(KERN_WARNING "int_stack: BPF kfuncs unavailable to program type %d: %d\n",
+                   int_stack_kfunc_prog_types[i], result);
+    }
     
     result = usb_register(&pen_driver);
     if (result < 0) {
         printk(KERN_ERR "int_stack: Failed to register USB driver: %d\n", result);
-        if (dev_buffer) {
-            if (dev_buffer->elements)
-                kfree(dev_buffer->elements);
-            mutex_destroy(&dev_buffer->op_lock);
-            kfree(dev_buffer);
-        }
-        return result;
+        goto err_debugfs;
     }
     
     printk(KERN_INFO "int_stack: USB driver registered\n");
     return 0;
+
+err_debugfs:
+    debugfs_remove_recursive(debug_dir);
+    kvfree(client_pool);
+err_gate:
+    release_gate(&shared_gate);
+err_buffer:
+    release_buffer();
+    return result;
 }
 
 static void __exit integer_buffer_exit(void)
 {
-    printk(KERN_INFO "int_stack: usage stats: pushed=%d, popped=%d, overflows=%d, underflows=%d\n",
+    printk(KERN_INFO "int_stack: usage stats: pushed=%d, popped=%d, overflows=%d, underflows=%d, filtered=%d\n",
            atomic_read(&dev_buffer->stats.push_count),
            atomic_read(&dev_buffer->stats.pop_count),
            atomic_read(&dev_buffer->stats.overflow_count),
-           atomic_read(&dev_buffer->stats.underflow_count));
+           atomic_read(&dev_buffer->stats.underflow_count),
+           atomic_read(&dev_buffer->stats.filtered_count));
     
     usb_deregister(&pen_driver);
     
-    unregister_device();
+    release_gate(&shared_gate);
     
-    if (dev_buffer) {
-        if (dev_buffer->elements)
-            kfree(dev_buffer->elements);
-        mutex_destroy(&dev_buffer->op_lock);
-        kfree(dev_buffer);
-    }
+    debugfs_remove_recursive(debug_dir);
+    kvfree(client_pool);
+    
+    destroy_user_stacks();
+    release_keys();
+    release_buffer();
 }
 
 module_init(integer_buffer_init);
@@ -0,0 +1,61 @@
+#ifndef _INT_STACK_H
+#define _INT_STACK_H
+
+/*
+ * In-kernel interface of int_stack.ko for other modules. A stack is an
+ * opaque handle; the device node operates on the stack named "int_stack".
+ *
+ * Functions without a suffix may sleep: they serialize with the device's
+ * file operations on op_lock, run the push filter and honour
+ * enable_auto_resize. The _atomic variants only take the stack's raw
+ * spinlock, are callable from any context and never resize. They spin on
+ * the lock except in NMI, where they only try it and return -EBUSY; the
+ * BPF kfuncs always only try it.
+ */
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+struct integer_buffer;
+struct module;
+
+struct integer_buffer *int_stack_create(const char *name, size_t capacity);
+void int_stack_destroy(struct integer_buffer *stack);
+struct integer_buffer *int_stack_find(const char *name);
+void int_stack_put(struct integer_buffer *stack);
+
+int int_stack_push(struct integer_buffer *stack, int value);
+int int_stack_push_n(struct integer_buffer *stack, const int *values, size_t count);
+int int_stack_pop(struct integer_buffer *stack, int *value);
+int int_stack_pop_n(struct integer_buffer *stack, int *values, size_t count);
+size_t int_stack_usage(struct integer_buffer *stack);
+void int_stack_clear(struct integer_buffer *stack);
+
+int int_stack_push_atomic(struct integer_buffer *stack, int value);
+int int_stack_push_n_atomic(struct integer_buffer *stack, const int *values, size_t count);
+int int_stack_pop_atomic(struct integer_buffer *stack, int *value);
+int int_stack_pop_n_atomic(struct integer_buffer *stack, int *values, size_t count);
+
+/*
+ * Consumer stages. A stage drains its source stack from a workqueue once
+ * the depth reaches a threshold, passes each element through a transform
+ * and pushes the results onto an output stack (NULL discards them).
+ * Transforms are looked up by name so that userspace can build pipelines
+ * with CMD_ATTACH_STAGE; fn returns false to drop the element.
+ */
+struct int_stack_transform {
+    const char *name;
+    struct module *owner;
+    bool (*fn)(int value, int *out);
+    struct list_head node;
+};
+
+int int_stack_register_transform(struct int_stack_transform *transform);
+void int_stack_unregister_transform(struct int_stack_transform *transform);
+
+int int_stack_attach_stage(struct integer_buffer *source, const char *transform,
+                           struct integer_buffer *output, unsigned int threshold,
+                           unsigned int batch_size, unsigned int max_active);
+void int_stack_detach_stage(struct integer_buffer *source);
+
+#endif /* _INT_STACK_H */
@@ -0,0 +1,132 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/err.h>
+
+#include "int_stack.h"
+
+/*
+ * Example consumer of the int_stack in-kernel API. On load it times
+ * push/pop round trips on a private stack through direct calls, the
+ * atomic and batched variants, and through the /dev/int_stack file
+ * operations, then prints ns per operation.
+ */
+
+static int iterations = 1000000;
+module_param(iterations, int, 0444);
+MODULE_PARM_DESC(iterations, "Push/pop round trips per measurement");
+
+static int batch_size = 64;
+module_param(batch_size, int, 0444);
+MODULE_PARM_DESC(batch_size, "Elements per call for the batched measurement");
+
+static void report(const char *name, u64 elapsed_ns, long operations)
+{
+    printk(KERN_INFO "int_stack_bench: %-8s %llu ns/op (%ld ops)\n", name,
+           operations ? elapsed_ns / operations : 0ULL, operations);
+}
+
+static void bench_direct(struct integer_buffer *stack)
+{
+    u64 start;
+    int value;
+    int i;
+    
+    start = ktime_get_ns();
+    for (i = 0; i < iterations; i++) {
+        int_stack_push(stack, i);
+        int_stack_pop(stack, &value);
+    }
+    report("direct", ktime_get_ns() - start, 2L * iterations);
+    
+    start = ktime_get_ns();
+    for (i = 0; i < iterations; i++) {
+        int_stack_push_atomic(stack, i);
+        int_stack_pop_atomic(stack, &value);
+    }
+    report("atomic", ktime_get_ns() - start, 2L * iterations);
+}
+
+static void bench_batched(struct integer_buffer *stack)
+{
+    int *values;
+    u64 start;
+    long done = 0;
+    int i;
+    
+    values = kcalloc(batch_size, sizeof(int), GFP_KERNEL);
+    if (!values)
+        return;
+    
+    for (i = 0; i < batch_size; i++)
+        values[i] = i;
+    
+    start = ktime_get_ns();
+    for (i = 0; i < iterations / batch_size; i++) {
+        done += max(int_stack_push_n(stack, values, batch_size), 0);
+        done += int_stack_pop_n(stack, values, batch_size);
+    }
+    report("batched", ktime_get_ns() - start, done);
+    
+    kfree(values);
+}
+
+static void bench_fops(void)
+{
+    struct file *filp;
+    loff_t pos = 0;
+    u64 start;
+    int value;
+    int i;
+    
+    filp = filp_open("/dev/int_stack", O_RDWR, 0);
+    if (IS_ERR(filp)) {
+        printk(KERN_INFO "int_stack_bench: fops   skipped, /dev/int_stack unavailable (%ld)\n",
+               PTR_ERR(filp));
+        return;
+    }
+    
+    start = ktime_get_ns();
+    for (i = 0; i < iterations; i++) {
+        value = i;
+        if (kernel_write(filp, &value, sizeof(value), &pos) != sizeof(value))
+            break;
+        kernel_read(filp, &value, sizeof(value), &pos);
+    }
+    report("fops", ktime_get_ns() - start, 2L * i);
+    
+    filp_close(filp, NULL);
+}
+
+static int __init int_stack_bench_init(void)
+{
+    struct integer_buffer *stack;
+    
+    if (iterations <= 0 || batch_size <= 0)
+        return -EINVAL;
+    
+    stack = int_stack_create("int_stack_bench", max(batch_size, 16));
+    if (IS_ERR(stack))
+        return PTR_ERR(stack);
+    
+    bench_direct(stack);
+    bench_batched(stack);
+    bench_fops();
+    
+    int_stack_destroy(stack);
+    return 0;
+}
+
+static void __exit int_stack_bench_exit(void)
+{
+}
+
+module_init(int_stack_bench_init);
+module_exit(int_stack_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Ivan Platonov");
+MODULE_DESCRIPTION("Benchmark of the int_stack in-kernel API against its file operations");
+MODULE_VERSION("1.0");
@@ -0,0 +1,216 @@
+#ifndef _INT_STACK_CORE_H
+#define _INT_STACK_CORE_H
+
+/*
+ * Algorithmic core of a stack: bounds checks, the element and timestamp
+ * arrays, high-water marks and counters. It does no locking, allocation
+ * or notification, so it builds both in the module, which calls it under
+ * data_lock and adds change records, the status page and tracepoints,
+ * and in userspace against int_stack_shim.h (see core_bench.c and
+ * core_test.c).
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#else
+#include "int_stack_shim.h"
+#endif
+
+struct buffer_stats {
+    atomic_t push_count;
+    atomic_t pop_count;
+    atomic_t overflow_count;
+    atomic_t underflow_count;
+    atomic_t filtered_count;
+    atomic_t resize_count;
+};
+
+/* Also spelled out in struct integer_buffer, which embeds it as ->core */
+#define STACK_CORE_MEMBERS          \
+    int *elements;                  \
+    u64 *timestamps;                \
+    size_t capacity;                \
+    size_t position;                \
+    size_t high_water;              \
+    size_t window_high_water;       \
+    size_t copy_floor;              \
+    struct buffer_stats stats;
+
+struct stack_core {
+    STACK_CORE_MEMBERS
+};
+
+/* Pushes value, stamped with now_ns if the stack keeps timestamps */
+static inline int stack_core_push(struct stack_core *core, int value, u64 now_ns)
+{
+    if (core->position >= core->capacity) {
+        atomic_inc(&core->stats.overflow_count);
+        return -ENOSPC;
+    }
+
+    if (core->timestamps)
+        core->timestamps[core->position] = now_ns;
+    core->elements[core->position++] = value;
+    if (core->position > core->window_high_water) {
+        core->window_high_water = core->position;
+        if (core->position > core->high_water)
+            core->high_water = core->position;
+    }
+    atomic_inc(&core->stats.push_count);
+
+    return 0;
+}
+
+/* Pops the top element; enqueued_ns is its push time, 0 without timestamps */
+static inline int stack_core_pop(struct stack_core *core, int *value, u64 *enqueued_ns)
+{
+    if (core->position == 0) {
+        atomic_inc(&core->stats.underflow_count);
+        return -ENODATA;
+    }
+
+    core->position--;
+    if (core->position < core->copy_floor)
+        core->copy_floor = core->position;
+    *value = core->elements[core->position];
+    *enqueued_ns = core->timestamps ? core->timestamps[core->position] : 0;
+    atomic_inc(&core->stats.pop_count);
+
+    return 0;
+}
+
+/*
+ * A pop whose values must reach the caller first, when handing them over
+ * may fail (a copy to userspace can fault): stack_core_pop_start()
+ * (locked) copies up to count values from the top, top first, and
+ * returns how many; once they were delivered stack_core_pop_finish()
+ * (locked again) removes them from depth, the position before the start.
+ * Nothing is popped in between, so a failed delivery needs no undo. If
+ * anything pushed, popped or cleared meanwhile the values may be stale:
+ * finish then pops nothing and returns false, and the caller starts over.
+ */
+static inline size_t stack_core_pop_start(struct stack_core *core, int *values, size_t count)
+{
+    size_t n = min_t(size_t, count, core->position);
+    size_t i;
+
+    if (core->position == 0) {
+        atomic_inc(&core->stats.underflow_count);
+        return 0;
+    }
+
+    for (i = 0; i < n; i++)
+        values[i] = core->elements[core->position - 1 - i];
+    core->copy_floor = core->position;
+
+    return n;
+}
+
+static inline bool stack_core_pop_finish(struct stack_core *core, size_t depth, size_t count)
+{
+    bool intact = core->position == depth && core->copy_floor == depth;
+
+    core->copy_floor = 0;
+    if (!intact)
+        return false;
+
+    core->position -= count;
+    atomic_add((int)count, &core->stats.pop_count);
+    return true;
+}
+
+/* Empties the stack; counters and high-water marks are kept */
+static inline void stack_core_clear(struct stack_core *core)
+{
+    core->position = 0;
+    core->copy_floor = 0;
+}
+
+/*
+ * A resize may copy the bulk of the stack without the lock that guards
+ * the core, as long as nothing but push, pop and clear run meanwhile:
+ * stack_core_copy_start() (locked) returns how many elements to copy and
+ * from then on pops lower copy_floor to the lowest depth reached.
+ * Elements below it were not touched, so stack_core_replace() (locked
+ * again) only copies from there up.
+ */
+static inline size_t stack_core_copy_start(struct stack_core *core, size_t new_capacity)
+{
+    core->copy_floor = core->position;
+    return min_t(size_t, core->position, new_capacity);
+}
+
+static inline void stack_core_copy(const struct stack_core *core, int *new_array,
+                                   u64 *new_timestamps, size_t start, size_t end)
+{
+    if (end <= start)
+        return;
+
+    memcpy(new_array + start, core->elements + start, sizeof(int) * (end - start));
+    if (new_timestamps && core->timestamps)
+        memcpy(new_timestamps + start, core->timestamps + start,
+               sizeof(u64) * (end - start));
+}
+
+/*
+ * Completes a copy into arrays of new_capacity elements whose first
+ * copied elements are already in place (0, or the return of
+ * stack_core_copy_start()), truncating from the top. Returns the number
+ * of elements copied; the copy is the stack as it is now.
+ */
+static inline size_t stack_core_copy_finish(struct stack_core *core, int *new_array,
+                                            u64 *new_timestamps, size_t new_capacity,
+                                            size_t copied)
+{
+    size_t copy_size = min_t(size_t, core->position, new_capacity);
+
+    stack_core_copy(core, new_array, new_timestamps,
+                    min_t(size_t, copied, core->copy_floor), copy_size);
+    core->copy_floor = 0;
+
+    return copy_size;
+}
+
+/*
+ * Moves the stack into new arrays of new_capacity elements (new_timestamps
+ * may be NULL), as completed by stack_core_copy_finish(), and hands back
+ * the old arrays for the caller to free. Returns the new depth.
+ */
+static inline size_t stack_core_replace(struct stack_core *core, int *new_array,
+                                        u64 *new_timestamps, size_t new_capacity,
+                                        size_t copied, int **old_array,
+                                        u64 **old_timestamps)
+{
+    size_t copy_size = stack_core_copy_finish(core, new_array, new_timestamps,
+                                              new_capacity, copied);
+
+    *old_array = core->elements;
+    *old_timestamps = core->timestamps;
+    core->position = copy_size;
+    core->elements = new_array;
+    core->timestamps = new_timestamps;
+    core->capacity = new_capacity;
+    atomic_inc(&core->stats.resize_count);
+
+    return copy_size;
+}
+
+/*
+ * Auto-resize policy: double, starting at 8, until needed elements fit.
+ * Where doubling would wrap it settles for exactly needed.
+ */
+static inline size_t stack_core_grow_capacity(size_t capacity, size_t needed)
+{
+    while (capacity < needed) {
+        if (capacity > SIZE_MAX / 2)
+            return needed;
+        capacity = max_t(size_t, capacity * 2, 8);
+    }
+    return capacity;
+}
+
+#endif /* _INT_STACK_CORE_H */
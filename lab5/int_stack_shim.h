@@ -0,0 +1,85 @@
+#ifndef _INT_STACK_SHIM_H
+#define _INT_STACK_SHIM_H
+
+/*
+ * Just enough of the kernel API for int_stack_core.h to build in
+ * userspace: fixed-width types, atomic_t on GCC builtins, the allocators
+ * and ktime_get_ns() on libc.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+static inline int atomic_read(const atomic_t *v)
+{
+    return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_set(atomic_t *v, int i)
+{
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_inc(atomic_t *v)
+{
+    __atomic_fetch_add(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_add(int i, atomic_t *v)
+{
+    __atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_dec(atomic_t *v)
+{
+    __atomic_fetch_sub(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+#define GFP_KERNEL 0
+
+static inline void *kzalloc(size_t size, int flags)
+{
+    (void)flags;
+    return calloc(1, size);
+}
+
+static inline void *kvcalloc(size_t n, size_t size, int flags)
+{
+    (void)flags;
+    return calloc(n, size);
+}
+
+static inline void kfree(const void *p)
+{
+    free((void *)p);
+}
+
+static inline void kvfree(const void *p)
+{
+    free((void *)p);
+}
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + (u64)now.tv_nsec;
+}
+
+#endif /* _INT_STACK_SHIM_H */
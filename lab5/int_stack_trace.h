@@ -0,0 +1,123 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM int_stack
+
+#if !defined(_INT_STACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _INT_STACK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+DECLARE_EVENT_CLASS(int_stack_value,
+
+    TP_PROTO(int id, size_t depth, int value),
+
+    TP_ARGS(id, depth, value),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(pid_t, pid)
+        __field(size_t, depth)
+        __field(int, value)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->pid = current->pid;
+        __entry->depth = depth;
+        __entry->value = value;
+    ),
+
+    TP_printk("id=%d pid=%d depth=%zu value=%d",
+              __entry->id, __entry->pid, __entry->depth, __entry->value)
+);
+
+/* Successful buffer_write, depth is taken after the push */
+DEFINE_EVENT(int_stack_value, int_stack_push,
+    TP_PROTO(int id, size_t depth, int value),
+    TP_ARGS(id, depth, value)
+);
+
+/* Successful buffer_read, depth is taken after the pop */
+DEFINE_EVENT(int_stack_value, int_stack_pop,
+    TP_PROTO(int id, size_t depth, int value),
+    TP_ARGS(id, depth, value)
+);
+
+DECLARE_EVENT_CLASS(int_stack_depth,
+
+    TP_PROTO(int id, size_t depth),
+
+    TP_ARGS(id, depth),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(pid_t, pid)
+        __field(size_t, depth)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->pid = current->pid;
+        __entry->depth = depth;
+    ),
+
+    TP_printk("id=%d pid=%d depth=%zu",
+              __entry->id, __entry->pid, __entry->depth)
+);
+
+/* buffer_write rejected with -ENOSPC */
+DEFINE_EVENT(int_stack_depth, int_stack_overflow,
+    TP_PROTO(int id, size_t depth),
+    TP_ARGS(id, depth)
+);
+
+/* buffer_read on an empty stack */
+DEFINE_EVENT(int_stack_depth, int_stack_underflow,
+    TP_PROTO(int id, size_t depth),
+    TP_ARGS(id, depth)
+);
+
+/* CMD_CLEAR_BUFFER, depth is taken before the clear */
+DEFINE_EVENT(int_stack_depth, int_stack_clear,
+    TP_PROTO(int id, size_t depth),
+    TP_ARGS(id, depth)
+);
+
+TRACE_EVENT(int_stack_resize,
+
+    TP_PROTO(int id, size_t depth, size_t old_capacity, size_t new_capacity,
+             u64 copy_ns),
+
+    TP_ARGS(id, depth, old_capacity, new_capacity, copy_ns),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(pid_t, pid)
+        __field(size_t, depth)
+        __field(size_t, old_capacity)
+        __field(size_t, new_capacity)
+        __field(u64, copy_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->pid = current->pid;
+        __entry->depth = depth;
+        __entry->old_capacity = old_capacity;
+        __entry->new_capacity = new_capacity;
+        __entry->copy_ns = copy_ns;
+    ),
+
+    TP_printk("id=%d pid=%d depth=%zu old_capacity=%zu new_capacity=%zu copy_ns=%llu",
+              __entry->id, __entry->pid, __entry->depth,
+              __entry->old_capacity, __entry->new_capacity,
+              __entry->copy_ns)
+);
+
+#endif /* _INT_STACK_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE int_stack_trace
+#include <trace/define_trace.h>
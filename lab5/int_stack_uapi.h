@@ -0,0 +1,216 @@
+#ifndef _INT_STACK_UAPI_H
+#define _INT_STACK_UAPI_H
+
+/* Interface shared by int_stack.ko and the kernel_stack utility */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define INT_BUFFER_MAGIC 's'
+#define INT_STACK_SET_MAX_SIZE _IOW(INT_BUFFER_MAGIC, 1, int)
+#define CMD_GET_CAPACITY _IOR(INT_BUFFER_MAGIC, 2, int)
+#define CMD_GET_USAGE _IOR(INT_BUFFER_MAGIC, 3, int)
+#define CMD_CLEAR_BUFFER _IO(INT_BUFFER_MAGIC, 4)
+#define CMD_SET_SAMPLE_PERIOD _IOW(INT_BUFFER_MAGIC, 5, int)
+#define CMD_GET_HIGH_WATER _IOR(INT_BUFFER_MAGIC, 6, struct int_stack_high_water)
+#define CMD_SET_PUSH_FILTER _IOW(INT_BUFFER_MAGIC, 7, int)
+#define CMD_CREATE_STACK _IOW(INT_BUFFER_MAGIC, 8, struct int_stack_spec)
+#define CMD_DESTROY_STACK _IOW(INT_BUFFER_MAGIC, 9, struct int_stack_spec)
+#define CMD_ATTACH_STAGE _IOW(INT_BUFFER_MAGIC, 10, struct int_stack_stage)
+#define CMD_DETACH_STAGE _IOW(INT_BUFFER_MAGIC, 11, struct int_stack_spec)
+#define CMD_EXPORT _IOWR(INT_BUFFER_MAGIC, 12, struct int_stack_transfer)
+#define CMD_IMPORT _IOW(INT_BUFFER_MAGIC, 13, struct int_stack_transfer)
+#define CMD_OPEN_CHANGES _IOW(INT_BUFFER_MAGIC, 14, __u64)
+#define CMD_READ_DEPTH_SAMPLES _IOWR(INT_BUFFER_MAGIC, 15, struct int_stack_sample_read)
+#define CMD_POP_BATCH _IOWR(INT_BUFFER_MAGIC, 16, struct int_stack_pop_batch)
+
+#define INT_STACK_NAME_LEN 32
+
+/* One record of the depth sampler stream (debugfs int_stack/depth_samples) */
+struct int_stack_depth_sample {
+    __u64 timestamp_ns;
+    __u32 depth;
+    __u32 capacity;
+};
+
+/*
+ * CMD_SET_SAMPLE_PERIOD needs CAP_SYS_ADMIN; nonzero periods below this
+ * are raised to it.
+ */
+#define INT_STACK_MIN_SAMPLE_PERIOD_US 1000
+
+/*
+ * CMD_READ_DEPTH_SAMPLES drains up to count samples of the stack behind
+ * the fd, oldest first, into the array at buffer and sets count to the
+ * number returned; overwritten is the number of samples lost to a full
+ * ring so far.
+ */
+struct int_stack_sample_read {
+    __u64 buffer;
+    __u32 count;
+    __u32 reserved;
+    __u64 overwritten;
+};
+
+/*
+ * A read pops one int. CMD_POP_BATCH pops up to count ints, top first,
+ * into the array at buffer and sets count to the number popped, 0 on an
+ * empty stack.
+ */
+struct int_stack_pop_batch {
+    __u64 buffer;
+    __u32 count;
+    __u32 reserved;
+};
+
+/* Window is the maximum depth since the previous CMD_GET_HIGH_WATER */
+struct int_stack_high_water {
+    __u64 lifetime;
+    __u64 window;
+};
+
+/*
+ * Read-only status page, mmap()ed from the device at offset 0. The kernel
+ * bumps seq to an odd value before updating the other fields and to the
+ * next even value afterwards; generation counts published updates.
+ */
+struct int_stack_status {
+    __u32 seq;
+    __u32 reserved;
+    __u64 generation;
+    __u64 position;
+    __u64 capacity;
+    __u64 push_count;
+    __u64 pop_count;
+    __u64 overflow_count;
+    __u64 underflow_count;
+    /* CLOCK_MONOTONIC_COARSE enqueue time of the bottom element, 0 if unknown */
+    __u64 oldest_timestamp_ns;
+    __u64 filtered_count;
+    /* Sequence number of the latest mutation, see struct int_stack_change */
+    __u64 change_seq;
+};
+
+/*
+ * Context of a push filter attached with CMD_SET_PUSH_FILTER (a
+ * BPF_PROG_TYPE_SYSCALL program fd, or -1 to detach). The program runs for
+ * every element written through the device and returns one of the verdicts
+ * below; for INT_STACK_FILTER_REWRITE the element becomes ctx->value.
+ */
+struct int_stack_filter_ctx {
+    __s32 value;
+    __u32 depth;
+    __u32 capacity;
+    __u32 tgid;
+};
+
+#define INT_STACK_FILTER_ACCEPT  0
+#define INT_STACK_FILTER_REJECT  1
+#define INT_STACK_FILTER_REWRITE 2
+
+/*
+ * A named stack for CMD_CREATE_STACK; CMD_DESTROY_STACK and
+ * CMD_DETACH_STAGE only use the name. An empty name means the device stack.
+ */
+struct int_stack_spec {
+    char name[INT_STACK_NAME_LEN];
+    __u32 capacity;
+    __u32 reserved;
+};
+
+/*
+ * CMD_ATTACH_STAGE: once the depth of the input stack reaches threshold,
+ * up to max_active workers drain it in batches of batch_size elements.
+ * Each element goes through the in-kernel transform named transform or,
+ * when transform is empty, through the BPF_PROG_TYPE_SYSCALL program
+ * prog_fd (same context and verdicts as a push filter), and the results
+ * are pushed onto the output stack. An empty output discards them.
+ */
+struct int_stack_stage {
+    char input[INT_STACK_NAME_LEN];
+    char output[INT_STACK_NAME_LEN];
+    char transform[INT_STACK_NAME_LEN];
+    __s32 prog_fd;
+    __u32 threshold;
+    __u32 batch_size;
+    __u32 max_active;
+};
+
+/*
+ * Snapshot of the device stack: a header followed by body_size bytes
+ * holding count elements bottom first, either as raw host-endian ints or
+ * as LEB128 varints of the zigzag-encoded difference to the previous
+ * element (the first one is relative to 0). checksum is the CRC32C of the
+ * body and seq the change sequence number the snapshot reflects.
+ */
+#define INT_STACK_SNAPSHOT_MAGIC   0x4b545349 /* "ISTK" */
+#define INT_STACK_SNAPSHOT_VERSION 2
+
+#define INT_STACK_SNAPSHOT_RAW   0
+#define INT_STACK_SNAPSHOT_DELTA 1
+
+struct int_stack_snapshot_header {
+    __u32 magic;
+    __u16 version;
+    __u8 element_width;
+    __u8 encoding;
+    __u64 count;
+    __u64 body_size;
+    __u32 checksum;
+    __u32 reserved;
+    __u64 seq;
+};
+
+/*
+ * CMD_EXPORT writes a snapshot to buffer, which must have room for the
+ * worst case (header plus 4 bytes per element raw, 5 delta), and returns
+ * its size in length; on ENOSPC length is the room needed. CMD_IMPORT
+ * replaces the stack with the snapshot of length bytes at buffer, growing
+ * the capacity if needed.
+ */
+struct int_stack_transfer {
+    __u64 buffer;
+    __u64 length;
+    __u32 encoding;
+    __u32 reserved;
+};
+
+/*
+ * Change log of the device stack, read from the fd returned by
+ * CMD_OPEN_CHANGES (argument: first sequence number wanted, 0 for the
+ * oldest retained one). Every mutation gets the next sequence number;
+ * reads return whole records in sequence order and fail with EOVERFLOW
+ * once the next record has been overwritten, after which a follower has
+ * to resync from a snapshot.
+ */
+#define INT_STACK_CHANGE_PUSH   1  /* value pushed */
+#define INT_STACK_CHANGE_POP    2  /* value elements popped */
+#define INT_STACK_CHANGE_CLEAR  3
+#define INT_STACK_CHANGE_RESIZE 4  /* new capacity, truncating like the device */
+#define INT_STACK_CHANGE_RESET  5  /* contents replaced by CMD_IMPORT, value elements */
+
+struct int_stack_change {
+    __u64 seq;
+    __u16 type;
+    __u16 stack_id;
+    __s32 value;
+};
+
+#ifndef __KERNEL__
+/* Lock-free consistent snapshot of the status page, retries while torn */
+static inline void int_stack_status_read(const struct int_stack_status *page,
+                                         struct int_stack_status *snapshot)
+{
+    __u32 seq;
+    
+    do {
+        while ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        *snapshot = *page;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+    snapshot->seq = seq;
+}
+#endif
+
+#endif /* _INT_STACK_UAPI_H */
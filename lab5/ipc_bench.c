@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+/*
+ * Runs the same push/pop workload over /dev/int_stack and over the usual
+ * ways of passing integers between threads, to see what the device costs:
+ *
+ *   int_stack  write()/read() of one int on the device, one fd per thread
+ *   pipe       write()/read() of one int on a pipe
+ *   unix       send()/recv() of one int on a SOCK_SEQPACKET socketpair
+ *   eventfd    a stack in shared memory under a process-shared mutex, with
+ *              eventfd semaphores counting free slots and elements
+ *   mutex      a stack in process memory under a pthread mutex
+ *
+ * For every thread count T, T producers push --values integers in total
+ * and T consumers pop all of them. Pushes onto a full stack and pops from
+ * an empty one (int_stack, mutex) are retried after sched_yield(); the
+ * other transports block instead. A table goes to stdout and, with --csv,
+ * one row per run to a file.
+ *
+ * usage: ipc_bench [--threads 1,2,4] [--values N] [--capacity N]
+ *                  [--device path] [--transports a,b,..] [--csv file]
+ */
+
+#define MAX_THREAD_COUNTS 16
+
+struct bench_options {
+    int threads[MAX_THREAD_COUNTS];
+    int thread_counts;
+    long values;
+    long capacity;
+    const char *device;
+    const char *transports;
+    const char *csv;
+};
+
+/* Stack in a MAP_SHARED mapping, usable across processes */
+struct shared_stack {
+    pthread_mutex_t lock;
+    long depth;
+    int values[];
+};
+
+struct bench_run {
+    const struct bench_options *options;
+    pthread_barrier_t start;
+    int fds[2];
+    int items_fd;
+    int slots_fd;
+    struct shared_stack *shared;
+    size_t shared_size;
+    pthread_mutex_t lock;
+    int *values;
+    long depth;
+};
+
+struct worker {
+    struct bench_run *run;
+    pthread_t thread;
+    int producer;
+    long quota;
+    int fd;
+    long retries;
+    int error;
+};
+
+/* push/pop return 0 on success, 1 to retry later and -1 with errno set */
+struct transport {
+    const char *name;
+    int (*setup)(struct bench_run *run);
+    int (*push)(struct worker *worker, int value);
+    int (*pop)(struct worker *worker, int *value);
+    void (*teardown)(struct bench_run *run);
+};
+
+static int device_setup(struct bench_run *run)
+{
+    int fd = open(run->options->device, O_RDWR);
+    
+    if (fd < 0)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+static int device_push(struct worker *worker, int value)
+{
+    if (write(worker->fd, &value, sizeof(value)) == sizeof(value))
+        return 0;
+    return errno == ENOSPC ? 1 : -1;
+}
+
+static int device_pop(struct worker *worker, int *value)
+{
+    ssize_t got = read(worker->fd, value, sizeof(*value));
+    
+    if (got == sizeof(*value))
+        return 0;
+    return got == 0 ? 1 : -1;
+}
+
+static int pipe_setup(struct bench_run *run)
+{
+    return pipe(run->fds);
+}
+
+static int socket_setup(struct bench_run *run)
+{
+    return socketpair(AF_UNIX, SOCK_SEQPACKET, 0, run->fds);
+}
+
+/* Both ends carry whole ints: pipe writes this small are atomic */
+static int stream_push(struct worker *worker, int value)
+{
+    return write(worker->run->fds[1], &value, sizeof(value)) == sizeof(value) ? 0 : -1;
+}
+
+static int stream_pop(struct worker *worker, int *value)
+{
+    return read(worker->run->fds[0], value, sizeof(*value)) == sizeof(*value) ? 0 : -1;
+}
+
+static void stream_teardown(struct bench_run *run)
+{
+    close(run->fds[0]);
+    close(run->fds[1]);
+}
+
+static int eventfd_setup(struct bench_run *run)
+{
+    pthread_mutexattr_t attr;
+    
+    run->shared_size = sizeof(*run->shared) + (size_t)run->options->capacity * sizeof(int);
+    run->shared = mmap(NULL, run->shared_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (run->shared == MAP_FAILED)
+        return -1;
+    
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&run->shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    run->shared->depth = 0;
+    
+    run->items_fd = eventfd(0, EFD_SEMAPHORE);
+    run->slots_fd = eventfd((unsigned int)run->options->capacity, EFD_SEMAPHORE);
+    if (run->items_fd < 0 || run->slots_fd < 0)
+        return -1;
+    return 0;
+}
+
+static int eventfd_push(struct worker *worker, int value)
+{
+    struct bench_run *run = worker->run;
+    uint64_t count = 1;
+    
+    if (read(run->slots_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    pthread_mutex_lock(&run->shared->lock);
+    run->shared->values[run->shared->depth++] = value;
+    pthread_mutex_unlock(&run->shared->lock);
+    return write(run->items_fd, &count, sizeof(count)) == sizeof(count) ? 0 : -1;
+}
+
+static int eventfd_pop(struct worker *worker, int *value)
+{
+    struct bench_run *run = worker->run;
+    uint64_t count = 1;
+    
+    if (read(run->items_fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    pthread_mutex_lock(&run->shared->lock);
+    *value = run->shared->values[--run->shared->depth];
+    pthread_mutex_unlock(&run->shared->lock);
+    return write(run->slots_fd, &count, sizeof(count)) == sizeof(count) ? 0 : -1;
+}
+
+static void eventfd_teardown(struct bench_run *run)
+{
+    if (run->items_fd >= 0)
+        close(run->items_fd);
+    if (run->slots_fd >= 0)
+        close(run->slots_fd);
+    if (run->shared && run->shared != MAP_FAILED) {
+        pthread_mutex_destroy(&run->shared->lock);
+        munmap(run->shared, run->shared_size);
+    }
+}
+
+static int mutex_setup(struct bench_run *run)
+{
+    run->values = malloc((size_t)run->options->capacity * sizeof(int));
+    if (!run->values)
+        return -1;
+    pthread_mutex_init(&run->lock, NULL);
+    run->depth = 0;
+    return 0;
+}
+
+static int mutex_push(struct worker *worker, int value)
+{
+    struct bench_run *run = worker->run;
+    int result = 1;
+    
+    pthread_mutex_lock(&run->lock);
+    if (run->depth < run->options->capacity) {
+        run->values[run->depth++] = value;
+        result = 0;
+    }
+    pthread_mutex_unlock(&run->lock);
+    return result;
+}
+
+static int mutex_pop(struct worker *worker, int *value)
+{
+    struct bench_run *run = worker->run;
+    int result = 1;
+    
+    pthread_mutex_lock(&run->lock);
+    if (run->depth > 0) {
+        *value = run->values[--run->depth];
+        result = 0;
+    }
+    pthread_mutex_unlock(&run->lock);
+    return result;
+}
+
+static void mutex_teardown(struct bench_run *run)
+{
+    pthread_mutex_destroy(&run->lock);
+    free(run->values);
+}
+
+static const struct transport transports[] = {
+    { "int_stack", device_setup, device_push, device_pop, NULL },
+    { "pipe", pipe_setup, stream_push, stream_pop, stream_teardown },
+    { "unix", socket_setup, stream_push, stream_pop, stream_teardown },
+    { "eventfd", eventfd_setup, eventfd_push, eventfd_pop, eventfd_teardown },
+    { "mutex", mutex_setup, mutex_push, mutex_pop, mutex_teardown },
+};
+
+static const struct transport *current;
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    long done = 0;
+    int value = 0;
+    int result;
+    
+    pthread_barrier_wait(&worker->run->start);
+    
+    while (done < worker->quota) {
+        if (worker->producer)
+            result = current->push(worker, (int)done);
+        else
+            result = current->pop(worker, &value);
+    
+        if (result == 0) {
+            done++;
+        } else if (result > 0) {
+            worker->retries++;
+            sched_yield();
+        } else {
+            if (errno == EINTR)
+                continue;
+            worker->error = errno;
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Returns the elapsed seconds, or a negative value with a message printed */
+static double run_once(const struct bench_options *options, int threads, long *retries)
+{
+    struct bench_run run;
+    struct worker *workers;
+    double start, elapsed;
+    int count = threads * 2;
+    int error = 0;
+    int started, i;
+    
+    memset(&run, 0, sizeof(run));
+    run.options = options;
+    run.items_fd = -1;
+    run.slots_fd = -1;
+    if (current->setup(&run) != 0) {
+        fprintf(stderr, "%s: skipped, setup failed: %s\n", current->name, strerror(errno));
+        if (current->teardown)
+            current->teardown(&run);
+        return -1;
+    }
+    
+    workers = calloc((size_t)count, sizeof(*workers));
+    if (!workers) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&run.start, NULL, (unsigned int)count + 1);
+    
+    /* Producers and consumers split the values evenly, the first ones take the rest */
+    for (i = 0; i < count; i++) {
+        workers[i].run = &run;
+        workers[i].producer = i < threads;
+        workers[i].quota = options->values / threads + (i % threads < options->values % threads);
+        workers[i].fd = current->push == device_push ? open(options->device, O_RDWR) : -1;
+    }
+    
+    for (started = 0; started < count; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]) != 0) {
+            fprintf(stderr, "Error: Cannot start thread %d\n", started);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    pthread_barrier_wait(&run.start);
+    start = now_seconds();
+    for (i = 0; i < count; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = now_seconds() - start;
+    
+    *retries = 0;
+    for (i = 0; i < count; i++) {
+        *retries += workers[i].retries;
+        if (workers[i].error && !error)
+            error = workers[i].error;
+        if (workers[i].fd >= 0)
+            close(workers[i].fd);
+    }
+    
+    pthread_barrier_destroy(&run.start);
+    free(workers);
+    if (current->teardown)
+        current->teardown(&run);
+    
+    if (error) {
+        fprintf(stderr, "%s: failed with %d threads: %s\n", current->name, threads,
+                strerror(error));
+        return -1;
+    }
+    return elapsed;
+}
+
+static int selected(const char *list, const char *name)
+{
+    size_t length = strlen(name);
+    const char *p = list;
+    
+    if (!list)
+        return 1;
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ',') && (p[length] == ',' || p[length] == '\0'))
+            return 1;
+        p += length;
+    }
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[], struct bench_options *options)
+{
+    char *endptr;
+    const char *p;
+    long value;
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        if (i + 1 == argc) {
+            fprintf(stderr, "Error: %s needs a value\n", argv[i]);
+            return -1;
+        }
+    
+        if (strcmp(argv[i], "--threads") == 0) {
+            options->thread_counts = 0;
+            for (p = argv[++i]; *p; p = *endptr == ',' ? endptr + 1 : endptr) {
+                value = strtol(p, &endptr, 10);
+                if (endptr == p || value <= 0 || value > 1024 ||
+                    options->thread_counts == MAX_THREAD_COUNTS) {
+                    fprintf(stderr, "Error: Thread counts must be a list like 1,2,4\n");
+                    return -1;
+                }
+                options->threads[options->thread_counts++] = (int)value;
+            }
+        } else if (strcmp(argv[i], "--values") == 0 || strcmp(argv[i], "--capacity") == 0) {
+            value = strtol(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || value <= 0) {
+                fprintf(stderr, "Error: %s must be a positive number\n", argv[i]);
+                return -1;
+            }
+            if (strcmp(argv[i++], "--values") == 0)
+                options->values = value;
+            else
+                options->capacity = value;
+        } else if (strcmp(argv[i], "--device") == 0) {
+            options->device = argv[++i];
+        } else if (strcmp(argv[i], "--transports") == 0) {
+            options->transports = argv[++i];
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            options->csv = argv[++i];
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    
+    return options->thread_counts > 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options options = {
+        .threads = { 1, 2, 4 },
+        .thread_counts = 3,
+        .values = 1000000,
+        .capacity = 4096,
+        .device = "/dev/int_stack",
+    };
+    double baseline[MAX_THREAD_COUNTS];
+    double elapsed, ops_per_sec;
+    FILE *csv = NULL;
+    size_t t;
+    long retries;
+    int i;
+    
+    if (parse_options(argc, argv, &options) != 0) {
+        fprintf(stderr, "usage: %s [--threads 1,2,4] [--values N] [--capacity N] "
+                "[--device path] [--transports a,b,..] [--csv file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (options.csv) {
+        csv = fopen(options.csv, "w");
+        if (!csv) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", options.csv, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "transport,threads,values,seconds,ops_per_sec,ns_per_op,retries\n");
+    }
+    
+    /* An op is one push or one pop, so a run does 2 * values of them */
+    printf("%-10s %8s %14s %10s %12s %10s\n", "transport", "threads", "ops/s", "ns/op",
+           "retries", "vs device");
+    for (i = 0; i < options.thread_counts; i++)
+        baseline[i] = 0;
+    
+    for (t = 0; t < sizeof(transports) / sizeof(transports[0]); t++) {
+        current = &transports[t];
+        if (!selected(options.transports, current->name))
+            continue;
+    
+        for (i = 0; i < options.thread_counts; i++) {
+            elapsed = run_once(&options, options.threads[i], &retries);
+            if (elapsed < 0)
+                break;
+    
+            ops_per_sec = 2.0 * options.values / elapsed;
+            if (t == 0)
+                baseline[i] = ops_per_sec;
+    
+            printf("%-10s %8d %14.0f %10.1f %12ld", current->name, options.threads[i],
+                   ops_per_sec, 1e9 / ops_per_sec, retries);
+            if (baseline[i] > 0)
+                printf(" %9.2fx", ops_per_sec / baseline[i]);
+            printf("\n");
+            fflush(stdout);
+    
+            if (csv)
+                fprintf(csv, "%s,%d,%ld,%.6f,%.0f,%.1f,%ld\n", current->name,
+                        options.threads[i], options.values, elapsed, ops_per_sec,
+                        1e9 / ops_per_sec, retries);
+        }
+    }
+    
+    if (csv)
+        fclose(csv);
+    return EXIT_SUCCESS;
+}
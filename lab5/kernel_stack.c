@@ -1,31 +1,76 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include "int_stack_uapi.h"
 
 #define STACK_DEVICE_PATH    "/dev/int_stack"
-#define STACK_CONFIG_CMD     _IOW('s', 1, int)
+#define STACK_KEY_ENV        "INT_STACK_KEY"
+#define STACK_CONFIG_CMD     INT_STACK_SET_MAX_SIZE
+#define STACKS_PATH          "/sys/kernel/debug/int_stack/stacks"
+#define MAX_STACKS           256
 
 #define EXIT_CONFIG_ERROR    2
 #define EXIT_IO_ERROR        3
 #define EXIT_FORMAT_ERROR    4
 #define EXIT_USB_ERROR       5 
 
+/* Bulk push: values per write(), batches in flight, initial read size */
+#define PUSH_BATCH_VALUES    16384
+#define PUSH_BATCHES         4
+#define PUSH_READ_SIZE       (1 << 20)
+
+/* Unwind: values per CMD_POP_BATCH, output buffer size */
+#define UNWIND_BATCH_VALUES  65536
+#define UNWIND_OUTPUT_SIZE   (1 << 20)
+
 static int device_handle = -1;
 
 static void release_resources(void);
 static void show_help(const char *program_name);
 static int configure_stack_size(const char *size_str);
 static int add_value_to_stack(const char *value_str);
+static int push_from_input(const char *path);
 static int retrieve_value_from_stack(void);
-static int empty_entire_stack(void);
+static int empty_entire_stack(int argc, char *argv[]);
+static int configure_sample_period(const char *period_str);
+static int show_depth_stats(void);
+static int show_status(void);
+static int configure_push_filter(const char *pin_path);
+static int manage_stack(unsigned long cmd, const char *name, const char *capacity_str);
+static int attach_stage(int argc, char *argv[]);
+static int save_snapshot(const char *path, const char *encoding_str);
+static int load_snapshot(const char *path);
+static int follow_changes(const char *seq_str);
+static int show_top(int argc, char *argv[]);
+static int serve_metrics(int argc, char *argv[]);
+static int run_bench(int argc, char *argv[]);
 
 int main(int argc, char *argv[])
 {
     int status = EXIT_SUCCESS;
+    const char *key = getenv(STACK_KEY_ENV);
+    char device_path[64];
     
     if (argc < 2) {
         show_help(argv[0]);
@@ -36,9 +81,21 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Warning: Could not register cleanup handler\n");
     }
     
-    device_handle = open(STACK_DEVICE_PATH, O_RDWR);
+    /* These only read debugfs and work with no key plugged in */
+    if (strcmp(argv[1], "top") == 0)
+        return show_top(argc - 2, argv + 2);
+    if (strcmp(argv[1], "export") == 0)
+        return serve_metrics(argc - 2, argv + 2);
+    
+    /* INT_STACK_KEY=<serial> selects the stack of that key */
+    if (key && *key)
+        snprintf(device_path, sizeof(device_path), "%s-%s", STACK_DEVICE_PATH, key);
+    else
+        snprintf(device_path, sizeof(device_path), "%s", STACK_DEVICE_PATH);
+    
+    device_handle = open(device_path, O_RDWR);
     if (device_handle < 0) {
-        if (errno == ENODEV) {
+        if (errno == ENODEV || (errno == ENOENT && key && *key)) {
             fprintf(stderr, "Error: USB key not inserted\n");
             return EXIT_USB_ERROR;
         } else {
@@ -58,17 +115,88 @@ int main(int argc, char *argv[])
         status = configure_stack_size(argv[2]);
     }
     else if (strcmp(command, "push") == 0) {
-        if (argc != 3) {
+        if (argc == 4 && strcmp(argv[2], "--file") == 0) {
+            status = push_from_input(argv[3]);
+        } else if (argc != 3) {
             fprintf(stderr, "Error: The push command requires a value argument\n");
             return EXIT_FAILURE;
+        } else if (strcmp(argv[2], "-") == 0) {
+            status = push_from_input("-");
+        } else {
+            status = add_value_to_stack(argv[2]);
         }
-        status = add_value_to_stack(argv[2]);
     }
     else if (strcmp(command, "pop") == 0) {
         status = retrieve_value_from_stack();
     }
     else if (strcmp(command, "unwind") == 0) {
-        status = empty_entire_stack();
+        status = empty_entire_stack(argc - 2, argv + 2);
+    }
+    else if (strcmp(command, "sample-period") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: The sample-period command requires a period argument\n");
+            return EXIT_FAILURE;
+        }
+        status = configure_sample_period(argv[2]);
+    }
+    else if (strcmp(command, "depth-stats") == 0) {
+        status = show_depth_stats();
+    }
+    else if (strcmp(command, "status") == 0) {
+        status = show_status();
+    }
+    else if (strcmp(command, "set-filter") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: The set-filter command requires a pinned program path or 'none'\n");
+            return EXIT_FAILURE;
+        }
+        status = configure_push_filter(argv[2]);
+    }
+    else if (strcmp(command, "create") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Error: The create command requires a name and a capacity\n");
+            return EXIT_FAILURE;
+        }
+        status = manage_stack(CMD_CREATE_STACK, argv[2], argv[3]);
+    }
+    else if (strcmp(command, "destroy") == 0 || strcmp(command, "unstage") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: The %s command requires a stack name\n", command);
+            return EXIT_FAILURE;
+        }
+        status = manage_stack(strcmp(command, "destroy") == 0 ?
+                              CMD_DESTROY_STACK : CMD_DETACH_STAGE, argv[2], NULL);
+    }
+    else if (strcmp(command, "save") == 0) {
+        if (argc != 3 && argc != 4) {
+            fprintf(stderr, "Error: The save command requires a file argument\n");
+            return EXIT_FAILURE;
+        }
+        status = save_snapshot(argv[2], argc == 4 ? argv[3] : "raw");
+    }
+    else if (strcmp(command, "load") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: The load command requires a file argument\n");
+            return EXIT_FAILURE;
+        }
+        status = load_snapshot(argv[2]);
+    }
+    else if (strcmp(command, "follow") == 0) {
+        if (argc > 3) {
+            fprintf(stderr, "Error: The follow command takes at most a sequence number\n");
+            return EXIT_FAILURE;
+        }
+        status = follow_changes(argc == 3 ? argv[2] : "0");
+    }
+    else if (strcmp(command, "bench") == 0) {
+        status = run_bench(argc - 2, argv + 2);
+    }
+    else if (strcmp(command, "stage") == 0) {
+        if (argc < 5 || argc > 8) {
+            fprintf(stderr, "Error: The stage command requires an input, a transform and an output\n");
+            return EXIT_FAILURE;
+        }
+        status = attach_stage(argc - 2, argv + 2);
     }
     else {
         fprintf(stderr, "Error: Unknown command: %s\n", command);
@@ -90,11 +218,32 @@ static void release_resources(void)
 static void show_help(const char *program_name)
 {
     printf("Usage: %s <command> [arguments]\n\n", program_name);
+    printf("Set %s=<serial> to use the stack of that USB key instead of the shared one.\n\n",
+           STACK_KEY_ENV);
     printf("Available commands:\n");
     printf("  set-size <size>  Configure the maximum stack capacity\n");
     printf("  push <value>     Add an integer to the stack\n");
+    printf("  push -|--file <path>  Push every integer read from stdin or a file\n");
     printf("  pop              Remove and display the top stack element\n");
-    printf("  unwind           Remove and display all stack elements\n");
+    printf("  unwind [--format=text|binary|csv|json] [--limit N]\n");
+    printf("                   Remove and display all (or the top N) stack elements\n");
+    printf("  sample-period <us>  Sample stack depth every <us> microseconds (0 stops)\n");
+    printf("  depth-stats      Drain depth samples and display percentiles\n");
+    printf("  status           Display depth, capacity and counters from the status page\n");
+    printf("  set-filter <pin|none>  Attach a pinned BPF push filter, or detach it\n");
+    printf("  create <name> <capacity>  Create a named in-kernel stack\n");
+    printf("  destroy <name>   Destroy a stack made with create\n");
+    printf("  stage <input> <transform|pin> <output|-> [threshold] [batch] [workers]\n");
+    printf("                   Drain <input> through a transform into <output>\n");
+    printf("  unstage <input>  Detach the stage draining <input>\n");
+    printf("  save <file> [raw|delta]  Write a binary snapshot of the stack\n");
+    printf("  load <file>      Replace the stack with a snapshot\n");
+    printf("  follow [seq]     Stream the change log from <seq> (default: oldest kept)\n");
+    printf("  top [--interval ms] [--count N]  Live depth and rates of every stack\n");
+    printf("  export --listen <path|port>  Serve Prometheus metrics of every stack\n");
+    printf("  bench [options]  Load the stack and report throughput and latency percentiles\n");
+    printf("                   (--producers N --consumers M --mixed K --push-pct P --batch B\n");
+    printf("                    --rate ops/s --duration s --warmup s --cpus 0,1,.. --json)\n");
 }
 
 static int configure_stack_size(const char *size_str)
@@ -129,6 +278,22 @@ static int configure_stack_size(const char *size_str)
     return EXIT_SUCCESS;
 }
 
+static int report_push_error(void)
+{
+    if (errno == ENODEV) {
+        fprintf(stderr, "Error: USB key not inserted\n");
+        return EXIT_USB_ERROR;
+    } else if (errno == ENOSPC || errno == ERANGE) {
+        fprintf(stderr, "Error: Stack is full\n");
+    } else if (errno == EPERM) {
+        fprintf(stderr, "Error: Value rejected by the push filter\n");
+    } else {
+        fprintf(stderr, "Error: Failed to write to stack: %s\n", 
+                strerror(errno));
+    }
+    return EXIT_IO_ERROR;
+}
+
 static int add_value_to_stack(const char *value_str)
 {
     char *endptr;
@@ -142,22 +307,345 @@ static int add_value_to_stack(const char *value_str)
     
     int_value = (int)temp_value;
     
-    if (write(device_handle, &int_value, sizeof(int_value)) != sizeof(int_value)) {
-        if (errno == ENODEV) {
-            fprintf(stderr, "Error: USB key not inserted\n");
-            return EXIT_USB_ERROR;
-        } else if (errno == ENOSPC || errno == ERANGE) {
-            fprintf(stderr, "Error: Stack is full\n");
-        } else {
-            fprintf(stderr, "Error: Failed to write to stack: %s\n", 
-                    strerror(errno));
+    if (write(device_handle, &int_value, sizeof(int_value)) != sizeof(int_value))
+        return report_push_error();
+    
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Bulk push. The main thread parses the input into batches and a writer
+ * thread pushes each batch with one write(); the module pushes all of it
+ * or stops at the value that fails, so a short write is retried from there
+ * and the retry reports that value's error.
+ */
+struct push_batch {
+    int values[PUSH_BATCH_VALUES];
+    size_t count;
+};
+
+struct push_pipeline {
+    struct push_batch batches[PUSH_BATCHES];
+    struct push_batch *current;     /* being filled by the parser */
+    unsigned long long filled;      /* batches handed to the writer */
+    unsigned long long written;     /* batches the writer is done with */
+    unsigned long long parsed;      /* values */
+    unsigned long long pushed;      /* values */
+    int done;
+    int write_errno;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static int write_batch(struct push_pipeline *pipeline, const struct push_batch *batch)
+{
+    const char *data = (const char *)batch->values;
+    size_t remaining = batch->count * sizeof(int);
+    ssize_t written;
+    
+    while (remaining > 0) {
+        written = write(device_handle, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        return EXIT_IO_ERROR;
+        data += written;
+        remaining -= (size_t)written;
+        pipeline->pushed += (size_t)written / sizeof(int);
+    }
+    
+    return 0;
+}
+
+static void *push_writer(void *arg)
+{
+    struct push_pipeline *pipeline = arg;
+    struct push_batch *batch;
+    
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (pipeline->written == pipeline->filled && !pipeline->done)
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        if (pipeline->written == pipeline->filled)
+            break;
+        
+        batch = &pipeline->batches[pipeline->written % PUSH_BATCHES];
+        pthread_mutex_unlock(&pipeline->lock);
+        
+        if (write_batch(pipeline, batch) != 0) {
+            pthread_mutex_lock(&pipeline->lock);
+            pipeline->write_errno = errno;
+            pthread_cond_signal(&pipeline->changed);
+            break;
+        }
+        
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->written++;
+        pthread_cond_signal(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    
+    return NULL;
+}
+
+/* Hands the current batch to the writer, returns -1 once the writer has failed */
+static int publish_batch(struct push_pipeline *pipeline)
+{
+    int result = 0;
+    
+    if (pipeline->current->count == 0)
+        return 0;
+    
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->filled++;
+    pthread_cond_signal(&pipeline->changed);
+    while (pipeline->filled - pipeline->written == PUSH_BATCHES && !pipeline->write_errno)
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    if (pipeline->write_errno)
+        result = -1;
+    pipeline->current = &pipeline->batches[pipeline->filled % PUSH_BATCHES];
+    pipeline->current->count = 0;
+    pthread_mutex_unlock(&pipeline->lock);
+    
+    return result;
+}
+
+/* isspace() of the C locale, which strtol() skips */
+static int is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Converts eight ASCII digits with a few 64-bit operations (SWAR),
+ * returns 0 if any of them is not a digit.
+ */
+static int eight_digits(const char *p, uint64_t *value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t x;
+    
+    memcpy(&x, p, sizeof(x));
+    if (((x & 0xf0f0f0f0f0f0f0f0ULL) |
+         (((x + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) != 0x3333333333333333ULL)
+        return 0;
+    
+    /* Combine pairs, then pairs of pairs, then the two halves */
+    x -= 0x3030303030303030ULL;
+    x = x * 10 + (x >> 8);
+    x = ((x & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32)) +
+         ((x >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32))) >> 32;
+    *value = x;
+    return 1;
+#else
+    (void)p;
+    (void)value;
+    return 0;
+#endif
+}
+
+/*
+ * Parses the whitespace separated values in [p, end), which must not cut
+ * a value in two. Each value is accepted and converted exactly like
+ * strtol(value, &end, 10) with *end == '\0' followed by a cast to int, as
+ * in add_value_to_stack: an optional sign and decimal digits, saturating
+ * at LONG_MIN/LONG_MAX. Returns EXIT_FORMAT_ERROR at the first invalid
+ * value and EXIT_IO_ERROR once the writer has failed.
+ */
+static int parse_values(struct push_pipeline *pipeline, const char *p, const char *end)
+{
+    const unsigned int max_digits = sizeof(long) == 8 ? 19 : 10;
+    
+    while (p < end) {
+        unsigned long long magnitude = 0;
+        unsigned int digits = 0;
+        int negative = 0;
+        int saturated = 0;
+        const char *start;
+        uint64_t chunk;
+        long value;
+        
+        if (is_space(*p)) {
+            p++;
+            continue;
+        }
+        
+        if (*p == '+' || *p == '-')
+            negative = *p++ == '-';
+        start = p;
+        
+        while (p < end && *p == '0')
+            p++;
+        while (end - p >= 8 && eight_digits(p, &chunk)) {
+            if (digits + 8 <= max_digits)
+                magnitude = magnitude * 100000000ULL + chunk;
+            else
+                saturated = 1;
+            digits += 8;
+            p += 8;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits + 1 <= max_digits)
+                magnitude = magnitude * 10 + (unsigned int)(*p - '0');
+            else
+                saturated = 1;
+            digits++;
+            p++;
+        }
+        
+        if (p == start || (p < end && !is_space(*p))) {
+            fprintf(stderr, "Error: Input must be a valid integer (value %llu)\n",
+                    pipeline->parsed + 1);
+            return EXIT_FORMAT_ERROR;
+        }
+        
+        if (!negative)
+            value = saturated || magnitude > (unsigned long long)LONG_MAX ?
+                    LONG_MAX : (long)magnitude;
+        else
+            value = saturated || magnitude > (unsigned long long)LONG_MAX + 1 ?
+                    LONG_MIN : magnitude == 0 ? 0 : -(long)(magnitude - 1) - 1;
+        
+        pipeline->current->values[pipeline->current->count++] = (int)value;
+        pipeline->parsed++;
+        if (pipeline->current->count == PUSH_BATCH_VALUES && publish_batch(pipeline) != 0)
+            return EXIT_IO_ERROR;
     }
     
     return EXIT_SUCCESS;
 }
 
+/*
+ * Regular files read from the start are mapped, anything else is read in
+ * chunks cut at whitespace. Returns an exit status.
+ */
+static int parse_input(struct push_pipeline *pipeline, int fd, const char *name)
+{
+    struct stat st;
+    size_t size = PUSH_READ_SIZE, used = 0, cut;
+    char *buffer, *grown;
+    ssize_t got;
+    int result = EXIT_SUCCESS;
+    
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        lseek(fd, 0, SEEK_CUR) == 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            result = parse_values(pipeline, map, (const char *)map + st.st_size);
+            munmap(map, (size_t)st.st_size);
+            return result;
+        }
+    }
+    
+    buffer = malloc(size);
+    if (!buffer) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_IO_ERROR;
+    }
+    
+    while (1) {
+        got = read(fd, buffer + used, size - used);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Failed to read %s: %s\n", name, strerror(errno));
+            result = EXIT_IO_ERROR;
+            break;
+        }
+        if (got == 0) {
+            result = parse_values(pipeline, buffer, buffer + used);
+            break;
+        }
+        used += (size_t)got;
+        
+        /* Parse up to the last whitespace, keep the value after it */
+        for (cut = used; cut > 0 && !is_space(buffer[cut - 1]); cut--)
+            ;
+        if (cut > 0) {
+            result = parse_values(pipeline, buffer, buffer + cut);
+            if (result != EXIT_SUCCESS)
+                break;
+            memmove(buffer, buffer + cut, used - cut);
+            used -= cut;
+        } else if (used == size) {
+            grown = realloc(buffer, size * 2);
+            if (!grown) {
+                fprintf(stderr, "Error: Out of memory\n");
+                result = EXIT_IO_ERROR;
+                break;
+            }
+            buffer = grown;
+            size *= 2;
+        }
+    }
+    
+    free(buffer);
+    return result;
+}
+
+static int push_from_input(const char *path)
+{
+    struct push_pipeline *pipeline;
+    pthread_t writer;
+    int status;
+    int fd = STDIN_FILENO;
+    
+    if (strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+    }
+    
+    pipeline = calloc(1, sizeof(*pipeline));
+    if (!pipeline) {
+        fprintf(stderr, "Error: Out of memory\n");
+        if (fd != STDIN_FILENO)
+            close(fd);
+        return EXIT_IO_ERROR;
+    }
+    pipeline->current = &pipeline->batches[0];
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    
+    if (pthread_create(&writer, NULL, push_writer, pipeline) != 0) {
+        fprintf(stderr, "Error: Cannot start the writer thread\n");
+        free(pipeline);
+        if (fd != STDIN_FILENO)
+            close(fd);
+        return EXIT_IO_ERROR;
+    }
+    
+    status = parse_input(pipeline, fd, strcmp(path, "-") == 0 ? "stdin" : path);
+    publish_batch(pipeline);
+    
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = 1;
+    pthread_cond_signal(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    pthread_join(writer, NULL);
+    
+    /* The writer's error is about an earlier value than the parser's */
+    if (pipeline->write_errno) {
+        errno = pipeline->write_errno;
+        status = report_push_error();
+        fprintf(stderr, "Error: Stopped after %llu values\n", pipeline->pushed);
+    } else if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "Error: Stopped after %llu values\n", pipeline->pushed);
+    }
+    
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->changed);
+    free(pipeline);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return status;
+}
+
 static int retrieve_value_from_stack(void)
 {
     int value;
@@ -182,34 +670,1623 @@ static int retrieve_value_from_stack(void)
     return EXIT_SUCCESS;
 }
 
-static int empty_entire_stack(void)
+enum unwind_format {
+    UNWIND_TEXT,
+    UNWIND_BINARY,
+    UNWIND_CSV,
+    UNWIND_JSON,
+};
+
+struct output_buffer {
+    char *data;
+    size_t used;
+};
+
+static int flush_output(struct output_buffer *out)
 {
-    int count = 0;
-    int value;
-    ssize_t bytes_read;
+    size_t done = 0;
+    ssize_t written;
     
-    while (1) {
-        bytes_read = read(device_handle, &value, sizeof(value));
-        
-        if (bytes_read == 0) {
-            if (count == 0) {
-                printf("Stack is empty\n");
+    while (done < out->used) {
+        written = write(STDOUT_FILENO, out->data + done, out->used - done);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Failed to write output: %s\n", strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        done += (size_t)written;
+    }
+    out->used = 0;
+    
+    return EXIT_SUCCESS;
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Decimal text of value at p, two digits per division; returns the end */
+static char *format_unsigned(char *p, unsigned long long value)
+{
+    char digits[20];
+    char *t = digits + sizeof(digits);
+    unsigned int pair;
+    
+    while (value >= 100) {
+        pair = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        *--t = digit_pairs[pair + 1];
+        *--t = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        *--t = digit_pairs[value * 2 + 1];
+        *--t = digit_pairs[value * 2];
+    } else {
+        *--t = (char)('0' + value);
+    }
+    
+    memcpy(p, t, (size_t)(digits + sizeof(digits) - t));
+    return p + (digits + sizeof(digits) - t);
+}
+
+static char *format_int(char *p, int value)
+{
+    if (value < 0) {
+        *p++ = '-';
+        return format_unsigned(p, 0ULL - (unsigned long long)(long long)value);
+    }
+    return format_unsigned(p, (unsigned long long)value);
+}
+
+/* Value of --name=value or --name value at argv[*i], NULL if it is another option */
+static const char *option_value(int argc, char *argv[], int *i, const char *name)
+{
+    size_t length = strlen(name);
+    
+    if (strncmp(argv[*i], name, length) != 0)
+        return NULL;
+    if (argv[*i][length] == '=')
+        return argv[*i] + length + 1;
+    if (argv[*i][length] == '\0' && *i + 1 < argc)
+        return argv[++*i];
+    return NULL;
+}
+
+static int parse_unwind_args(int argc, char *argv[], enum unwind_format *format,
+                             unsigned long long *limit)
+{
+    const char *value;
+    char *endptr;
+    int i;
+    
+    for (i = 0; i < argc; i++) {
+        if ((value = option_value(argc, argv, &i, "--format")) != NULL) {
+            if (strcmp(value, "text") == 0)
+                *format = UNWIND_TEXT;
+            else if (strcmp(value, "binary") == 0)
+                *format = UNWIND_BINARY;
+            else if (strcmp(value, "csv") == 0)
+                *format = UNWIND_CSV;
+            else if (strcmp(value, "json") == 0)
+                *format = UNWIND_JSON;
+            else {
+                fprintf(stderr, "Error: Format must be text, binary, csv or json\n");
+                return EXIT_FORMAT_ERROR;
             }
+        } else if ((value = option_value(argc, argv, &i, "--limit")) != NULL) {
+            if (*value < '0' || *value > '9' ||
+                (*limit = strtoull(value, &endptr, 10)) == 0 || *endptr != '\0') {
+                fprintf(stderr, "Error: Limit must be a positive number\n");
+                return EXIT_FORMAT_ERROR;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown unwind option: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/* Pops up to count values with CMD_POP_BATCH; returns bytes like read() */
+static ssize_t pop_batch(int *values, size_t count)
+{
+    struct int_stack_pop_batch request = {
+        .buffer = (uintptr_t)values,
+        .count = (__u32)count,
+    };
+    
+    if (ioctl(device_handle, CMD_POP_BATCH, &request) < 0)
+        return -1;
+    return (ssize_t)request.count * (ssize_t)sizeof(int);
+}
+
+/*
+ * Pops the stack in batches of up to UNWIND_BATCH_VALUES and formats the
+ * values, top first, into a large buffer that is written out whenever it
+ * fills up. Values already popped are written out even if a later batch
+ * fails.
+ */
+static int empty_entire_stack(int argc, char *argv[])
+{
+    enum unwind_format format = UNWIND_TEXT;
+    unsigned long long limit = ULLONG_MAX;
+    unsigned long long count = 0;
+    struct output_buffer out;
+    size_t wanted, got, i;
+    ssize_t bytes_read;
+    int *values;
+    char *p;
+    int status;
+    
+    status = parse_unwind_args(argc, argv, &format, &limit);
+    if (status != EXIT_SUCCESS)
+        return status;
+    
+    values = malloc(UNWIND_BATCH_VALUES * sizeof(int));
+    out.data = malloc(UNWIND_OUTPUT_SIZE);
+    out.used = 0;
+    if (!values || !out.data) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(values);
+        free(out.data);
+        return EXIT_IO_ERROR;
+    }
+    
+    if (format == UNWIND_CSV) {
+        memcpy(out.data, "index,value\n", 12);
+        out.used = 12;
+    } else if (format == UNWIND_JSON) {
+        out.data[out.used++] = '[';
+    }
+    
+    while (count < limit) {
+        wanted = limit - count < UNWIND_BATCH_VALUES ? (size_t)(limit - count) : UNWIND_BATCH_VALUES;
+        bytes_read = pop_batch(values, wanted);
+        if (bytes_read == 0)
             break;
-        } else if (bytes_read != sizeof(value)) {
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
             if (errno == ENODEV) {
                 fprintf(stderr, "Error: USB key not inserted\n");
-                return EXIT_USB_ERROR;
+                status = EXIT_USB_ERROR;
             } else {
                 fprintf(stderr, "Error: Failed to read from stack: %s\n", 
                         strerror(errno));
+                status = EXIT_IO_ERROR;
             }
-            return EXIT_IO_ERROR;
+            break;
         }
+        got = (size_t)bytes_read / sizeof(int);
         
-        printf("%d\n", value);
-        count++;
+        if (format == UNWIND_BINARY) {
+            if (out.used + (size_t)bytes_read > UNWIND_OUTPUT_SIZE &&
+                flush_output(&out) != EXIT_SUCCESS) {
+                status = EXIT_IO_ERROR;
+                break;
+            }
+            memcpy(out.data + out.used, values, (size_t)bytes_read);
+            out.used += (size_t)bytes_read;
+            count += got;
+            continue;
+        }
+        
+        for (i = 0; i < got; i++) {
+            /* Room for the longest entry: a 20 digit index, a value and separators */
+            if (UNWIND_OUTPUT_SIZE - out.used < 40 && flush_output(&out) != EXIT_SUCCESS)
+                break;
+            
+            p = out.data + out.used;
+            
+            switch (format) {
+                case UNWIND_CSV:
+                    p = format_unsigned(p, count + i);
+                    *p++ = ',';
+                    p = format_int(p, values[i]);
+                    *p++ = '\n';
+                    break;
+                case UNWIND_JSON:
+                    if (count + i > 0)
+                        *p++ = ',';
+                    p = format_int(p, values[i]);
+                    break;
+                default:
+                    p = format_int(p, values[i]);
+                    *p++ = '\n';
+            }
+            out.used = (size_t)(p - out.data);
+        }
+        count += got;
+        if (i < got) {
+            status = EXIT_IO_ERROR;
+            break;
+        }
+    }
+    
+    if (format == UNWIND_TEXT && count == 0 && status == EXIT_SUCCESS) {
+        memcpy(out.data, "Stack is empty\n", 15);
+        out.used = 15;
+    } else if (format == UNWIND_JSON) {
+        out.data[out.used++] = ']';
+        out.data[out.used++] = '\n';
+    }
+    
+    if (flush_output(&out) != EXIT_SUCCESS && status == EXIT_SUCCESS)
+        status = EXIT_IO_ERROR;
+    
+    free(values);
+    free(out.data);
+    return status;
+}
+
+static int configure_sample_period(const char *period_str)
+{
+    char *endptr;
+    long period;
+    int period_us;
+    
+    period = strtol(period_str, &endptr, 10);
+    if (*endptr != '\0' || period < 0 || period > 1000000000L) {
+        fprintf(stderr, "Error: Sample period must be a non-negative number of microseconds\n");
+        return EXIT_FORMAT_ERROR;
+    }
+    
+    period_us = (int)period;
+    if (ioctl(device_handle, CMD_SET_SAMPLE_PERIOD, &period_us) != 0) {
+        if (errno == ENODEV) {
+            fprintf(stderr, "Error: USB key not inserted\n");
+            return EXIT_USB_ERROR;
+        }
+        if (errno == EPERM) {
+            fprintf(stderr, "Error: Changing the sample period requires CAP_SYS_ADMIN\n");
+            return EXIT_CONFIG_ERROR;
+        }
+        fprintf(stderr, "Error: Failed to configure sample period: %s\n",
+                strerror(errno));
+        return EXIT_CONFIG_ERROR;
     }
     
     return EXIT_SUCCESS;
 }
+
+static int compare_depths(const void *a, const void *b)
+{
+    unsigned int depth_a = *(const unsigned int *)a;
+    unsigned int depth_b = *(const unsigned int *)b;
+    
+    return (depth_a > depth_b) - (depth_a < depth_b);
+}
+
+static unsigned int depth_percentile(const unsigned int *depths, size_t count, double pct)
+{
+    size_t index = (size_t)(count * pct / 100.0);
+    
+    if (index >= count)
+        index = count - 1;
+    return depths[index];
+}
+
+static int show_depth_stats(void)
+{
+    struct int_stack_depth_sample samples[256];
+    struct int_stack_sample_read request;
+    struct int_stack_high_water high_water;
+    unsigned int *depths = NULL;
+    size_t count = 0;
+    size_t allocated = 0;
+    int result;
+    size_t i;
+    
+    /* Samples of the stack behind device_handle, so per key as well */
+    for (;;) {
+        size_t n;
+        
+        memset(&request, 0, sizeof(request));
+        request.buffer = (uintptr_t)samples;
+        request.count = sizeof(samples) / sizeof(samples[0]);
+        result = ioctl(device_handle, CMD_READ_DEPTH_SAMPLES, &request);
+        if (result != 0 || request.count == 0)
+            break;
+        
+        n = request.count;
+        
+        if (count + n > allocated) {
+            unsigned int *grown;
+            
+            allocated = (count + n) * 2;
+            grown = realloc(depths, allocated * sizeof(*depths));
+            if (!grown) {
+                fprintf(stderr, "Error: Out of memory\n");
+                free(depths);
+                return EXIT_FAILURE;
+            }
+            depths = grown;
+        }
+        
+        for (i = 0; i < n; i++)
+            depths[count++] = samples[i].depth;
+    }
+    
+    if (result != 0) {
+        free(depths);
+        if (errno == ENODEV) {
+            fprintf(stderr, "Error: USB key not inserted\n");
+            return EXIT_USB_ERROR;
+        }
+        fprintf(stderr, "Error: Failed to read depth samples: %s\n", strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    
+    if (ioctl(device_handle, CMD_GET_HIGH_WATER, &high_water) == 0) {
+        printf("high water: lifetime=%llu window=%llu\n",
+               (unsigned long long)high_water.lifetime,
+               (unsigned long long)high_water.window);
+    }
+    
+    if (count == 0) {
+        printf("No depth samples recorded\n");
+        free(depths);
+        return EXIT_SUCCESS;
+    }
+    
+    qsort(depths, count, sizeof(*depths), compare_depths);
+    printf("samples: %zu (overwritten %llu)\n", count,
+           (unsigned long long)request.overwritten);
+    printf("p50: %u\n", depth_percentile(depths, count, 50.0));
+    printf("p90: %u\n", depth_percentile(depths, count, 90.0));
+    printf("p99: %u\n", depth_percentile(depths, count, 99.0));
+    printf("p99.9: %u\n", depth_percentile(depths, count, 99.9));
+    printf("max: %u\n", depths[count - 1]);
+    
+    free(depths);
+    return EXIT_SUCCESS;
+}
+
+static int show_status(void)
+{
+    const struct int_stack_status *page;
+    struct int_stack_status snapshot;
+    
+    page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, device_handle, 0);
+    if (page == MAP_FAILED) {
+        if (errno == ENODEV) {
+            fprintf(stderr, "Error: USB key not inserted\n");
+            return EXIT_USB_ERROR;
+        }
+        fprintf(stderr, "Error: Failed to map status page: %s\n", strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    
+    int_stack_status_read(page, &snapshot);
+    munmap((void *)page, sizeof(*page));
+    
+    printf("generation: %llu\n", (unsigned long long)snapshot.generation);
+    printf("depth: %llu\n", (unsigned long long)snapshot.position);
+    printf("capacity: %llu\n", (unsigned long long)snapshot.capacity);
+    printf("pushed: %llu\n", (unsigned long long)snapshot.push_count);
+    printf("popped: %llu\n", (unsigned long long)snapshot.pop_count);
+    printf("overflows: %llu\n", (unsigned long long)snapshot.overflow_count);
+    printf("underflows: %llu\n", (unsigned long long)snapshot.underflow_count);
+    printf("filtered: %llu\n", (unsigned long long)snapshot.filtered_count);
+    if (snapshot.oldest_timestamp_ns) {
+        struct timespec now;
+        unsigned long long now_ns;
+        
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        now_ns = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        printf("oldest element age: %.3f ms\n",
+               now_ns > snapshot.oldest_timestamp_ns ?
+               (now_ns - snapshot.oldest_timestamp_ns) / 1e6 : 0.0);
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+static int configure_push_filter(const char *pin_path)
+{
+    union bpf_attr attr;
+    int prog_fd = -1;
+    int result;
+    
+    if (strcmp(pin_path, "none") != 0) {
+        memset(&attr, 0, sizeof(attr));
+        attr.pathname = (unsigned long)pin_path;
+        prog_fd = (int)syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+        if (prog_fd < 0) {
+            fprintf(stderr, "Error: Failed to open pinned program %s: %s\n",
+                    pin_path, strerror(errno));
+            return EXIT_CONFIG_ERROR;
+        }
+    }
+    
+    result = ioctl(device_handle, CMD_SET_PUSH_FILTER, &prog_fd);
+    if (prog_fd >= 0)
+        close(prog_fd);
+    
+    if (result != 0) {
+        switch (errno) {
+            case ENODEV:
+                fprintf(stderr, "Error: USB key not inserted\n");
+                return EXIT_USB_ERROR;
+            case EPERM:
+                fprintf(stderr, "Error: Attaching a push filter requires CAP_BPF\n");
+                break;
+            case EINVAL:
+                fprintf(stderr, "Error: Program is not a BPF_PROG_TYPE_SYSCALL program\n");
+                break;
+            default:
+                fprintf(stderr, "Error: Failed to set push filter: %s\n",
+                        strerror(errno));
+        }
+        return EXIT_CONFIG_ERROR;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+static int report_pipeline_error(const char *what)
+{
+    switch (errno) {
+        case ENODEV:
+            fprintf(stderr, "Error: USB key not inserted\n");
+            return EXIT_USB_ERROR;
+        case EPERM:
+            fprintf(stderr, "Error: %s requires CAP_SYS_ADMIN\n", what);
+            break;
+        case ENOENT:
+            fprintf(stderr, "Error: No such stack or transform\n");
+            break;
+        case EEXIST:
+            fprintf(stderr, "Error: A stack with that name already exists\n");
+            break;
+        case EBUSY:
+            fprintf(stderr, "Error: The input stack already has a stage\n");
+            break;
+        case ELOOP:
+            fprintf(stderr, "Error: The stage would feed back into its input\n");
+            break;
+        default:
+            fprintf(stderr, "Error: %s failed: %s\n", what, strerror(errno));
+    }
+    return EXIT_CONFIG_ERROR;
+}
+
+static int copy_stack_name(char *dst, const char *name)
+{
+    if (strlen(name) >= INT_STACK_NAME_LEN) {
+        fprintf(stderr, "Error: Names are at most %d characters\n",
+                INT_STACK_NAME_LEN - 1);
+        return -1;
+    }
+    strcpy(dst, name);
+    return 0;
+}
+
+static int manage_stack(unsigned long cmd, const char *name, const char *capacity_str)
+{
+    struct int_stack_spec spec;
+    char *endptr;
+    long capacity;
+    
+    memset(&spec, 0, sizeof(spec));
+    if (copy_stack_name(spec.name, name) < 0)
+        return EXIT_FORMAT_ERROR;
+    
+    if (capacity_str) {
+        capacity = strtol(capacity_str, &endptr, 10);
+        if (*endptr != '\0' || capacity < 0 || capacity > 0x7fffffffL) {
+            fprintf(stderr, "Error: Capacity must be a non-negative number\n");
+            return EXIT_FORMAT_ERROR;
+        }
+        spec.capacity = (__u32)capacity;
+    }
+    
+    if (ioctl(device_handle, cmd, &spec) != 0)
+        return report_pipeline_error("Managing stacks");
+    
+    return EXIT_SUCCESS;
+}
+
+/* argv: input transform output [threshold [batch [workers]]] */
+static int attach_stage(int argc, char *argv[])
+{
+    struct int_stack_stage stage;
+    const char *names[] = { "threshold", "batch", "workers" };
+    __u32 *params[] = { &stage.threshold, &stage.batch_size, &stage.max_active };
+    union bpf_attr attr;
+    char *endptr;
+    long value;
+    int result;
+    int i;
+    
+    memset(&stage, 0, sizeof(stage));
+    stage.prog_fd = -1;
+    stage.threshold = 1;
+    stage.batch_size = 64;
+    stage.max_active = 1;
+    
+    if (copy_stack_name(stage.input, argv[0]) < 0 ||
+        (strcmp(argv[2], "-") != 0 && copy_stack_name(stage.output, argv[2]) < 0))
+        return EXIT_FORMAT_ERROR;
+    
+    for (i = 3; i < argc; i++) {
+        value = strtol(argv[i], &endptr, 10);
+        if (*endptr != '\0' || value <= 0 || value > 0x7fffffffL) {
+            fprintf(stderr, "Error: The %s must be a positive number\n", names[i - 3]);
+            return EXIT_FORMAT_ERROR;
+        }
+        *params[i - 3] = (__u32)value;
+    }
+    
+    /* Anything that looks like a path is a pinned BPF program */
+    if (strchr(argv[1], '/')) {
+        memset(&attr, 0, sizeof(attr));
+        attr.pathname = (unsigned long)argv[1];
+        stage.prog_fd = (int)syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+        if (stage.prog_fd < 0) {
+            fprintf(stderr, "Error: Failed to open pinned program %s: %s\n",
+                    argv[1], strerror(errno));
+            return EXIT_CONFIG_ERROR;
+        }
+    } else if (copy_stack_name(stage.transform, argv[1]) < 0) {
+        return EXIT_FORMAT_ERROR;
+    }
+    
+    result = ioctl(device_handle, CMD_ATTACH_STAGE, &stage);
+    if (stage.prog_fd >= 0)
+        close(stage.prog_fd);
+    
+    if (result != 0)
+        return report_pipeline_error("Attaching a stage");
+    
+    return EXIT_SUCCESS;
+}
+
+static int report_snapshot_error(const char *what)
+{
+    switch (errno) {
+        case ENODEV:
+            fprintf(stderr, "Error: USB key not inserted\n");
+            return EXIT_USB_ERROR;
+        case EINVAL:
+            fprintf(stderr, "Error: Not a snapshot of a compatible version\n");
+            return EXIT_FORMAT_ERROR;
+        case EBADMSG:
+            fprintf(stderr, "Error: Snapshot is corrupt (checksum or body mismatch)\n");
+            return EXIT_FORMAT_ERROR;
+        case EFBIG:
+            fprintf(stderr, "Error: Snapshot holds too many elements\n");
+            break;
+        default:
+            fprintf(stderr, "Error: Failed to %s snapshot: %s\n", what, strerror(errno));
+    }
+    return EXIT_IO_ERROR;
+}
+
+/*
+ * The kernel writes the snapshot straight into the page cache of the
+ * output file through a shared mapping sized for the worst case, which is
+ * then truncated to the real size.
+ */
+static int save_snapshot(const char *path, const char *encoding_str)
+{
+    struct int_stack_transfer xfer;
+    const struct int_stack_snapshot_header *header;
+    size_t per_element;
+    size_t size;
+    int usage = 0;
+    void *map;
+    int fd;
+    
+    memset(&xfer, 0, sizeof(xfer));
+    if (strcmp(encoding_str, "raw") == 0) {
+        xfer.encoding = INT_STACK_SNAPSHOT_RAW;
+        per_element = sizeof(int);
+    } else if (strcmp(encoding_str, "delta") == 0) {
+        xfer.encoding = INT_STACK_SNAPSHOT_DELTA;
+        per_element = 5;
+    } else {
+        fprintf(stderr, "Error: Encoding must be raw or delta\n");
+        return EXIT_FORMAT_ERROR;
+    }
+    
+    if (ioctl(device_handle, CMD_GET_USAGE, &usage) != 0)
+        return report_snapshot_error("save");
+    xfer.length = sizeof(*header) + (size_t)usage * per_element;
+    
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    
+    /* The stack may grow between CMD_GET_USAGE and the export */
+    while (1) {
+        size = (size_t)xfer.length;
+        
+        if (ftruncate(fd, (off_t)size) != 0) {
+            fprintf(stderr, "Error: Failed to size %s: %s\n", path, strerror(errno));
+            close(fd);
+            return EXIT_IO_ERROR;
+        }
+        
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Error: Failed to map %s: %s\n", path, strerror(errno));
+            close(fd);
+            return EXIT_IO_ERROR;
+        }
+        
+        xfer.buffer = (unsigned long)map;
+        if (ioctl(device_handle, CMD_EXPORT, &xfer) == 0)
+            break;
+        
+        munmap(map, size);
+        if (errno != ENOSPC) {
+            close(fd);
+            return report_snapshot_error("save");
+        }
+    }
+    
+    header = map;
+    printf("Saved %llu elements (%llu bytes) at seq %llu\n",
+           (unsigned long long)header->count,
+           (unsigned long long)xfer.length,
+           (unsigned long long)header->seq);
+    munmap(map, size);
+    
+    if (ftruncate(fd, (off_t)xfer.length) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "Error: Failed to write %s: %s\n", path, strerror(errno));
+        close(fd);
+        return EXIT_IO_ERROR;
+    }
+    
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+static int load_snapshot(const char *path)
+{
+    struct int_stack_transfer xfer;
+    const struct int_stack_snapshot_header *header;
+    struct stat st;
+    void *map;
+    int result;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+        fprintf(stderr, "Error: %s is not a snapshot\n", path);
+        close(fd);
+        return EXIT_FORMAT_ERROR;
+    }
+    
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map %s: %s\n", path, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.buffer = (unsigned long)map;
+    xfer.length = (__u64)st.st_size;
+    
+    header = map;
+    result = ioctl(device_handle, CMD_IMPORT, &xfer);
+    if (result == 0)
+        printf("Loaded %llu elements, follow from seq %llu\n",
+               (unsigned long long)header->count,
+               (unsigned long long)header->seq + 1);
+    else
+        result = report_snapshot_error("load");
+    
+    munmap(map, (size_t)st.st_size);
+    return result;
+}
+
+static const char *change_type_name(unsigned int type)
+{
+    switch (type) {
+        case INT_STACK_CHANGE_PUSH:
+            return "push";
+        case INT_STACK_CHANGE_POP:
+            return "pop";
+        case INT_STACK_CHANGE_CLEAR:
+            return "clear";
+        case INT_STACK_CHANGE_RESIZE:
+            return "resize";
+        case INT_STACK_CHANGE_RESET:
+            return "reset";
+        default:
+            return "unknown";
+    }
+}
+
+/* Prints one "<seq> <type> <value>" line per change until interrupted */
+static int follow_changes(const char *seq_str)
+{
+    struct int_stack_change changes[256];
+    unsigned long long from_seq;
+    __u64 seq;
+    ssize_t bytes_read;
+    char *endptr;
+    int changes_fd;
+    size_t i, n;
+    
+    errno = 0;
+    from_seq = strtoull(seq_str, &endptr, 10);
+    if (*endptr != '\0' || errno != 0) {
+        fprintf(stderr, "Error: Sequence number must be a non-negative number\n");
+        return EXIT_FORMAT_ERROR;
+    }
+    
+    seq = from_seq;
+    changes_fd = ioctl(device_handle, CMD_OPEN_CHANGES, &seq);
+    if (changes_fd < 0) {
+        switch (errno) {
+            case ENODEV:
+                fprintf(stderr, "Error: USB key not inserted\n");
+                return EXIT_USB_ERROR;
+            case EOPNOTSUPP:
+                fprintf(stderr, "Error: Change log disabled (load the module with change_log_size=N)\n");
+                break;
+            default:
+                fprintf(stderr, "Error: Failed to open change log: %s\n", strerror(errno));
+        }
+        return EXIT_CONFIG_ERROR;
+    }
+    
+    while ((bytes_read = read(changes_fd, changes, sizeof(changes))) > 0) {
+        n = (size_t)bytes_read / sizeof(changes[0]);
+        for (i = 0; i < n; i++) {
+            printf("%llu %s %d\n", (unsigned long long)changes[i].seq,
+                   change_type_name(changes[i].type), changes[i].value);
+        }
+        fflush(stdout);
+    }
+    
+    if (bytes_read < 0 && errno == EOVERFLOW)
+        fprintf(stderr, "Error: Change log overrun, resync from a snapshot\n");
+    else if (bytes_read < 0)
+        fprintf(stderr, "Error: Failed to read change log: %s\n", strerror(errno));
+    
+    close(changes_fd);
+    return EXIT_IO_ERROR;
+}
+
+/* The columns of debugfs int_stack/stacks after the name */
+enum stack_field {
+    STACK_DEPTH,
+    STACK_CAPACITY,
+    STACK_PUSHED,
+    STACK_POPPED,
+    STACK_OVERFLOWS,
+    STACK_UNDERFLOWS,
+    STACK_FILTERED,
+    STACK_RESIZES,
+    STACK_FIELDS,
+};
+
+static const struct {
+    const char *metric;
+    const char *type;
+    const char *help;
+} stack_metrics[STACK_FIELDS] = {
+    { "int_stack_depth", "gauge", "Elements on the stack." },
+    { "int_stack_capacity", "gauge", "Current capacity of the stack." },
+    { "int_stack_pushes_total", "counter", "Successful pushes." },
+    { "int_stack_pops_total", "counter", "Successful pops." },
+    { "int_stack_overflows_total", "counter", "Pushes onto a full stack." },
+    { "int_stack_underflows_total", "counter", "Pops from an empty stack." },
+    { "int_stack_filtered_total", "counter", "Pushes rejected by the push filter." },
+    { "int_stack_resizes_total", "counter", "Capacity changes." },
+};
+
+struct stack_counters {
+    char name[INT_STACK_NAME_LEN];
+    unsigned long long fields[STACK_FIELDS];
+};
+
+/* The name may contain spaces, the numbers after it do not */
+static int parse_stack_line(char *line, struct stack_counters *stack)
+{
+    char *fields = line + strcspn(line, "\n");
+    char *endptr;
+    size_t length;
+    int i;
+    
+    *fields = '\0';
+    for (i = 0; i < STACK_FIELDS; i++) {
+        while (fields > line && fields[-1] != ' ')
+            fields--;
+        if (fields == line)
+            return -1;
+        fields--;
+    }
+    
+    length = (size_t)(fields - line);
+    if (length == 0 || length >= sizeof(stack->name))
+        return -1;
+    memcpy(stack->name, line, length);
+    stack->name[length] = '\0';
+    
+    for (i = 0; i < STACK_FIELDS; i++) {
+        stack->fields[i] = strtoull(fields, &endptr, 10);
+        if (endptr == fields)
+            return -1;
+        fields = endptr;
+    }
+    
+    return 0;
+}
+
+/* Returns the number of stacks read, or -1 with a message printed */
+static int read_stacks(struct stack_counters *stacks, int max)
+{
+    char line[256];
+    FILE *file;
+    int count = 0;
+    
+    file = fopen(STACKS_PATH, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", STACKS_PATH, strerror(errno));
+        return -1;
+    }
+    
+    /* Skip the header */
+    if (fgets(line, sizeof(line), file)) {
+        while (count < max && fgets(line, sizeof(line), file)) {
+            if (parse_stack_line(line, &stacks[count]) == 0)
+                count++;
+        }
+    }
+    
+    fclose(file);
+    return count;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static const struct stack_counters *find_counters(const struct stack_counters *stacks,
+                                                  int count, const char *name)
+{
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (strcmp(stacks[i].name, name) == 0)
+            return &stacks[i];
+    }
+    return NULL;
+}
+
+/* The kernel counters are 32-bit and wrap, so differences are taken modulo 2^32 */
+static unsigned int counter_delta(const struct stack_counters *now,
+                                  const struct stack_counters *before, enum stack_field field)
+{
+    return (unsigned int)now->fields[field] - (unsigned int)before->fields[field];
+}
+
+/*
+ * Refreshing dashboard. Each refresh is one read of debugfs; rates are the
+ * counter differences to the previous refresh over the time between them.
+ */
+static int show_top(int argc, char *argv[])
+{
+    static struct stack_counters samples[2][MAX_STACKS];
+    unsigned long long iterations = 0, max_iterations = 0;
+    long interval_ms = 1000;
+    const struct stack_counters *before;
+    const struct stack_counters *now;
+    const char *value;
+    char *endptr;
+    double previous_time = 0, current_time, elapsed;
+    int counts[2] = { 0, 0 };
+    int current = 0;
+    int i;
+    
+    for (i = 0; i < argc; i++) {
+        if ((value = option_value(argc, argv, &i, "--interval")) != NULL) {
+            interval_ms = strtol(value, &endptr, 10);
+            if (*endptr != '\0' || interval_ms <= 0) {
+                fprintf(stderr, "Error: Interval must be a positive number of milliseconds\n");
+                return EXIT_FORMAT_ERROR;
+            }
+        } else if ((value = option_value(argc, argv, &i, "--count")) != NULL) {
+            max_iterations = strtoull(value, &endptr, 10);
+            if (*endptr != '\0' || max_iterations == 0) {
+                fprintf(stderr, "Error: Count must be a positive number\n");
+                return EXIT_FORMAT_ERROR;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown top option: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    /* The first read only sets the baseline for the rates */
+    while (1) {
+        counts[current] = read_stacks(samples[current], MAX_STACKS);
+        current_time = monotonic_seconds();
+        if (counts[current] < 0)
+            return EXIT_IO_ERROR;
+        elapsed = current_time - previous_time;
+        
+        if (iterations > 0) {
+            printf("\033[H\033[2J");
+            printf("int_stack: %d stacks, interval %.2f s\n\n", counts[current], elapsed);
+            printf("%-32s %10s %10s %6s %12s %12s %10s %10s %8s\n", "NAME", "DEPTH",
+                   "CAPACITY", "FILL%", "PUSH/s", "POP/s", "OVERFL/s", "UNDERFL/s", "RESIZES");
+            
+            for (i = 0; i < counts[current]; i++) {
+                now = &samples[current][i];
+                before = find_counters(samples[!current], counts[!current], now->name);
+                if (!before)
+                    before = now;
+                
+                printf("%-32s %10llu %10llu %6.1f %12.0f %12.0f %10.0f %10.0f %8llu",
+                       now->name, now->fields[STACK_DEPTH], now->fields[STACK_CAPACITY],
+                       now->fields[STACK_CAPACITY] ?
+                       100.0 * now->fields[STACK_DEPTH] / now->fields[STACK_CAPACITY] : 0.0,
+                       counter_delta(now, before, STACK_PUSHED) / elapsed,
+                       counter_delta(now, before, STACK_POPPED) / elapsed,
+                       counter_delta(now, before, STACK_OVERFLOWS) / elapsed,
+                       counter_delta(now, before, STACK_UNDERFLOWS) / elapsed,
+                       now->fields[STACK_RESIZES]);
+                if (counter_delta(now, before, STACK_RESIZES))
+                    printf(" (+%u)", counter_delta(now, before, STACK_RESIZES));
+                printf("\n");
+            }
+            fflush(stdout);
+        }
+        
+        if (max_iterations && iterations == max_iterations)
+            break;
+        iterations++;
+        previous_time = current_time;
+        current = !current;
+        usleep((useconds_t)interval_ms * 1000);
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/* A TCP port on 127.0.0.1 if the address is a number, a Unix socket path otherwise */
+static int open_listener(const char *address)
+{
+    struct sockaddr_un unix_address;
+    struct sockaddr_in inet_address;
+    char *endptr;
+    long port;
+    int one = 1;
+    int fd;
+    
+    port = strtol(address, &endptr, 10);
+    if (*address != '\0' && *endptr == '\0') {
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "Error: Port must be between 1 and 65535\n");
+            return -1;
+        }
+        
+        memset(&inet_address, 0, sizeof(inet_address));
+        inet_address.sin_family = AF_INET;
+        inet_address.sin_port = htons((unsigned short)port);
+        inet_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&inet_address, sizeof(inet_address)) != 0)
+            goto fail;
+    } else {
+        if (strlen(address) >= sizeof(unix_address.sun_path)) {
+            fprintf(stderr, "Error: Socket path is too long\n");
+            return -1;
+        }
+        
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strcpy(unix_address.sun_path, address);
+        
+        /* A socket left behind by a previous exporter is replaced */
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) != 0)
+            goto fail;
+    }
+    
+    if (listen(fd, 16) != 0)
+        goto fail;
+    return fd;
+    
+fail:
+    fprintf(stderr, "Error: Failed to listen on %s: %s\n", address, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static void write_metrics(FILE *out, const struct stack_counters *stacks, int count)
+{
+    const char *name;
+    int field, i;
+    
+    for (field = 0; field < STACK_FIELDS; field++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", stack_metrics[field].metric,
+                stack_metrics[field].help, stack_metrics[field].metric,
+                stack_metrics[field].type);
+        
+        for (i = 0; i < count; i++) {
+            fprintf(out, "%s{stack=\"", stack_metrics[field].metric);
+            for (name = stacks[i].name; *name; name++) {
+                if (*name == '\\' || *name == '"')
+                    fputc('\\', out);
+                fputc(*name, out);
+            }
+            fprintf(out, "\"} %llu\n", stacks[i].fields[field]);
+        }
+    }
+}
+
+/*
+ * Prometheus text exposition over HTTP/1.0, one client at a time. Every
+ * scrape is one read of debugfs; counters are exported as they are and
+ * the scraper computes rates, e.g. rate(int_stack_pushes_total[1m]).
+ */
+static int serve_metrics(int argc, char *argv[])
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Connection: close\r\n\r\n";
+    static struct stack_counters stacks[MAX_STACKS];
+    struct timeval timeout = { 1, 0 };
+    const char *address = NULL;
+    char request[4096];
+    char *body;
+    size_t body_size;
+    FILE *out;
+    int listener, client;
+    int count, i;
+    
+    for (i = 0; i < argc; i++) {
+        if ((address = option_value(argc, argv, &i, "--listen")) == NULL) {
+            fprintf(stderr, "Error: Unknown export option: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!address) {
+        fprintf(stderr, "Error: The export command requires --listen <path|port>\n");
+        return EXIT_FAILURE;
+    }
+    
+    /* Fail early if debugfs is not readable */
+    if (read_stacks(stacks, MAX_STACKS) < 0)
+        return EXIT_IO_ERROR;
+    
+    listener = open_listener(address);
+    if (listener < 0)
+        return EXIT_IO_ERROR;
+    
+    while (1) {
+        client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: Failed to accept: %s\n", strerror(errno));
+            close(listener);
+            return EXIT_IO_ERROR;
+        }
+        
+        /* Whatever the request, the answer is the metrics */
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (recv(client, request, sizeof(request), 0) < 0 && errno != EAGAIN) {
+            close(client);
+            continue;
+        }
+        
+        body = NULL;
+        out = open_memstream(&body, &body_size);
+        if (!out) {
+            close(client);
+            continue;
+        }
+        count = read_stacks(stacks, MAX_STACKS);
+        write_metrics(out, stacks, count < 0 ? 0 : count);
+        fclose(out);
+        
+        if (send(client, header, sizeof(header) - 1, MSG_NOSIGNAL) == (ssize_t)sizeof(header) - 1)
+            send(client, body, body_size, MSG_NOSIGNAL);
+        free(body);
+        close(client);
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Latency histogram with HDR-style log-linear buckets: values below 128 ns
+ * are exact, above that every power of two is split into 64 buckets, so a
+ * recorded value is off by less than 1/64 across the whole range.
+ */
+#define HIST_SUB_BITS  6
+#define HIST_BUCKETS   ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct latency_hist {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+};
+
+static unsigned int hist_index(unsigned long long value)
+{
+    unsigned int shift;
+    
+    if (value < (2ULL << HIST_SUB_BITS))
+        return (unsigned int)value;
+    shift = 63 - (unsigned int)__builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift << HIST_SUB_BITS) + (unsigned int)(value >> shift);
+}
+
+/* Midpoint of the values that land in bucket index */
+static unsigned long long hist_value(unsigned int index)
+{
+    unsigned int shift = index < (2U << HIST_SUB_BITS) ? 0 : (index >> HIST_SUB_BITS) - 1;
+    unsigned long long sub = index - ((unsigned long long)shift << HIST_SUB_BITS);
+    
+    return (sub << shift) + ((1ULL << shift) >> 1);
+}
+
+static void hist_record(struct latency_hist *hist, unsigned long long value)
+{
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+static void hist_merge(struct latency_hist *into, const struct latency_hist *from)
+{
+    unsigned int i;
+    
+    for (i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+static unsigned long long hist_percentile(const struct latency_hist *hist, double pct)
+{
+    unsigned long long rank = (unsigned long long)(hist->total * pct / 100.0);
+    unsigned long long seen = 0;
+    unsigned int i;
+    
+    if (hist->total == 0)
+        return 0;
+    if (rank >= hist->total)
+        rank = hist->total - 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank)
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+    }
+    return hist->max;
+}
+
+static const double bench_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+static const char *const bench_percentile_names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+
+#define BENCH_PUSH 0
+#define BENCH_POP  1
+
+enum bench_role {
+    BENCH_PRODUCER,
+    BENCH_CONSUMER,
+    BENCH_MIXED,
+};
+
+/* Per op kind: calls, elements moved and the calls that moved none */
+struct bench_counts {
+    unsigned long long calls;
+    unsigned long long elements;
+    unsigned long long misses;      /* full on push, empty on pop */
+    struct latency_hist latency;
+};
+
+struct bench_config {
+    int producers;
+    int consumers;
+    int mixed;
+    int push_pct;
+    int batch;
+    double rate;                    /* total calls/s, 0 for closed loop */
+    double duration;
+    double warmup;
+    int cpus[CPU_SETSIZE];
+    int cpu_count;
+    int json;
+};
+
+#define BENCH_WARMUP  0
+#define BENCH_MEASURE 1
+#define BENCH_STOP    2
+
+struct bench_thread {
+    pthread_t thread;
+    const struct bench_config *config;
+    enum bench_role role;
+    int cpu;
+    double rate;
+    int *phase;
+    int error;
+    struct bench_counts counts[2];
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+/*
+ * In open-loop mode each call has an intended start time on a fixed
+ * schedule and its latency is taken from that time, so a stall is charged
+ * to every call that queued behind it (no coordinated omission).
+ */
+static void *bench_worker(void *arg)
+{
+    struct bench_thread *thread = arg;
+    const struct bench_config *config = thread->config;
+    size_t size = (size_t)config->batch * sizeof(int);
+    unsigned long long interval = thread->rate > 0 ? (unsigned long long)(1e9 / thread->rate) : 0;
+    unsigned long long next = now_ns(), start, end;
+    unsigned int random_state = (unsigned int)(uintptr_t)thread | 1;
+    struct bench_counts *counts;
+    struct timespec wake;
+    ssize_t result;
+    int *values;
+    int kind, phase, i;
+    
+    if (thread->cpu >= 0) {
+        cpu_set_t set;
+        
+        CPU_ZERO(&set);
+        CPU_SET(thread->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    
+    values = malloc(size);
+    if (!values) {
+        thread->error = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < config->batch; i++)
+        values[i] = i;
+    
+    /* The default 50 us timer slack would dominate open-loop latencies */
+    if (interval)
+        prctl(PR_SET_TIMERSLACK, 1UL);
+    
+    while ((phase = __atomic_load_n(thread->phase, __ATOMIC_RELAXED)) != BENCH_STOP) {
+        if (thread->role == BENCH_MIXED) {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 17;
+            random_state ^= random_state << 5;
+            kind = (int)(random_state % 100) < config->push_pct ? BENCH_PUSH : BENCH_POP;
+        } else {
+            kind = thread->role == BENCH_PRODUCER ? BENCH_PUSH : BENCH_POP;
+        }
+        
+        if (interval) {
+            wake.tv_sec = (time_t)(next / 1000000000ULL);
+            wake.tv_nsec = (long)(next % 1000000000ULL);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+            start = next;
+            next += interval;
+        } else {
+            start = now_ns();
+        }
+        
+        if (kind == BENCH_PUSH)
+            result = write(device_handle, values, size);
+        else if (config->batch > 1)
+            result = pop_batch(values, (size_t)config->batch);
+        else
+            result = read(device_handle, values, size);
+        end = now_ns();
+        
+        if (result < 0 && errno != ENOSPC) {
+            thread->error = errno;
+            break;
+        }
+        if (phase != BENCH_MEASURE)
+            continue;
+        
+        counts = &thread->counts[kind];
+        counts->calls++;
+        if (result > 0)
+            counts->elements += (size_t)result / sizeof(int);
+        else
+            counts->misses++;
+        hist_record(&counts->latency, end > start ? end - start : 0);
+    }
+    
+    free(values);
+    return NULL;
+}
+
+static int parse_cpu_list(const char *list, struct bench_config *config)
+{
+    const char *p = list;
+    char *endptr;
+    long cpu;
+    
+    config->cpu_count = 0;
+    while (*p) {
+        cpu = strtol(p, &endptr, 10);
+        if (endptr == p || cpu < 0 || cpu >= CPU_SETSIZE || config->cpu_count == CPU_SETSIZE ||
+            (*endptr != ',' && *endptr != '\0'))
+            return -1;
+        config->cpus[config->cpu_count++] = (int)cpu;
+        p = *endptr == ',' ? endptr + 1 : endptr;
+    }
+    
+    return config->cpu_count > 0 ? 0 : -1;
+}
+
+static int parse_bench_number(const char *value, const char *what, double min, double max,
+                              double *result)
+{
+    char *endptr;
+    
+    *result = strtod(value, &endptr);
+    if (*value == '\0' || *endptr != '\0' || *result < min || *result > max) {
+        fprintf(stderr, "Error: %s must be a number between %.10g and %.10g\n", what, min, max);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_bench_args(int argc, char *argv[], struct bench_config *config)
+{
+    static const struct {
+        const char *option;
+        const char *what;
+        double min;
+        double max;
+    } numbers[] = {
+        { "--producers", "Producers", 0, 1024 },
+        { "--consumers", "Consumers", 0, 1024 },
+        { "--mixed", "Mixed threads", 0, 1024 },
+        { "--push-pct", "Push percentage", 0, 100 },
+        { "--batch", "Batch size", 1, 1 << 20 },
+        { "--rate", "Rate", 0, 1e9 },
+        { "--duration", "Duration", 0.001, 86400 },
+        { "--warmup", "Warm-up", 0, 86400 },
+    };
+    const char *value;
+    double number;
+    size_t n;
+    int i;
+    
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            config->json = 1;
+            continue;
+        }
+        if ((value = option_value(argc, argv, &i, "--cpus")) != NULL) {
+            if (parse_cpu_list(value, config) != 0) {
+                fprintf(stderr, "Error: CPU list must be comma separated CPU numbers\n");
+                return EXIT_FORMAT_ERROR;
+            }
+            continue;
+        }
+        
+        for (n = 0; n < sizeof(numbers) / sizeof(numbers[0]); n++) {
+            if ((value = option_value(argc, argv, &i, numbers[n].option)) != NULL)
+                break;
+        }
+        if (n == sizeof(numbers) / sizeof(numbers[0])) {
+            fprintf(stderr, "Error: Unknown bench option: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        if (parse_bench_number(value, numbers[n].what, numbers[n].min, numbers[n].max,
+                               &number) != 0)
+            return EXIT_FORMAT_ERROR;
+        
+        switch (n) {
+            case 0: config->producers = (int)number; break;
+            case 1: config->consumers = (int)number; break;
+            case 2: config->mixed = (int)number; break;
+            case 3: config->push_pct = (int)number; break;
+            case 4: config->batch = (int)number; break;
+            case 5: config->rate = number; break;
+            case 6: config->duration = number; break;
+            default: config->warmup = number;
+        }
+    }
+    
+    if (config->producers + config->consumers + config->mixed == 0) {
+        fprintf(stderr, "Error: The bench command needs at least one thread\n");
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+static void print_bench_text(const struct bench_config *config,
+                             const struct bench_counts *totals, double elapsed)
+{
+    static const char *const kinds[] = { "push", "pop" };
+    static const char *const misses[] = { "full", "empty" };
+    int kind, i;
+    
+    printf("threads: %d producers, %d consumers, %d mixed (%d%% push), batch %d, %s\n",
+           config->producers, config->consumers, config->mixed, config->push_pct,
+           config->batch, config->rate > 0 ? "open loop" : "closed loop");
+    if (config->rate > 0)
+        printf("target rate: %.0f calls/s\n", config->rate);
+    printf("measured %.2f s after %.2f s warm-up\n", elapsed, config->warmup);
+    printf("total: %.0f calls/s, %.0f elements/s\n\n",
+           (totals[0].calls + totals[1].calls) / elapsed,
+           (totals[0].elements + totals[1].elements) / elapsed);
+    
+    for (kind = 0; kind < 2; kind++) {
+        if (totals[kind].calls == 0)
+            continue;
+        printf("%-4s  %.0f calls/s, %.0f elements/s, %llu %s\n", kinds[kind],
+               totals[kind].calls / elapsed, totals[kind].elements / elapsed,
+               totals[kind].misses, misses[kind]);
+        printf("      latency ns:");
+        for (i = 0; i < (int)(sizeof(bench_percentiles) / sizeof(bench_percentiles[0])); i++)
+            printf(" %s=%llu", bench_percentile_names[i],
+                   hist_percentile(&totals[kind].latency, bench_percentiles[i]));
+        printf(" max=%llu\n", totals[kind].latency.max);
+    }
+}
+
+static void print_bench_json(const struct bench_config *config,
+                             const struct bench_counts *totals, double elapsed)
+{
+    static const char *const kinds[] = { "push", "pop" };
+    static const char *const misses[] = { "full", "empty" };
+    int kind, i;
+    
+    printf("{\"config\":{\"producers\":%d,\"consumers\":%d,\"mixed\":%d,\"push_pct\":%d,"
+           "\"batch\":%d,\"rate\":%.0f,\"duration_s\":%g,\"warmup_s\":%g,\"cpus\":[",
+           config->producers, config->consumers, config->mixed, config->push_pct,
+           config->batch, config->rate, config->duration, config->warmup);
+    for (i = 0; i < config->cpu_count; i++)
+        printf("%s%d", i ? "," : "", config->cpus[i]);
+    printf("]},\"elapsed_s\":%.6f,\"calls_per_sec\":%.1f,\"elements_per_sec\":%.1f",
+           elapsed, (totals[0].calls + totals[1].calls) / elapsed,
+           (totals[0].elements + totals[1].elements) / elapsed);
+    
+    for (kind = 0; kind < 2; kind++) {
+        printf(",\"%s\":{\"calls\":%llu,\"elements\":%llu,\"%s\":%llu,\"calls_per_sec\":%.1f,"
+               "\"latency_ns\":{", kinds[kind], totals[kind].calls, totals[kind].elements,
+               misses[kind], totals[kind].misses, totals[kind].calls / elapsed);
+        for (i = 0; i < (int)(sizeof(bench_percentiles) / sizeof(bench_percentiles[0])); i++)
+            printf("\"%s\":%llu,", bench_percentile_names[i],
+                   hist_percentile(&totals[kind].latency, bench_percentiles[i]));
+        printf("\"max\":%llu}}", totals[kind].latency.max);
+    }
+    printf("}\n");
+}
+
+/*
+ * Load generator on the opened node: producers push, consumers pop and
+ * mixed threads do either at random, each call moving --batch elements.
+ * Only calls started between the end of the warm-up and the end of the
+ * run are counted.
+ */
+static int run_bench(int argc, char *argv[])
+{
+    struct bench_config config;
+    struct bench_thread *threads;
+    struct bench_counts totals[2];
+    struct timespec pause;
+    unsigned long long started, stopped;
+    int phase = BENCH_WARMUP;
+    int count, i, kind;
+    int status;
+    
+    memset(&config, 0, sizeof(config));
+    config.producers = 1;
+    config.consumers = 1;
+    config.push_pct = 50;
+    config.batch = 1;
+    config.duration = 5;
+    config.warmup = 1;
+    
+    status = parse_bench_args(argc, argv, &config);
+    if (status != EXIT_SUCCESS)
+        return status;
+    
+    count = config.producers + config.consumers + config.mixed;
+    threads = calloc((size_t)count, sizeof(*threads));
+    if (!threads) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_IO_ERROR;
+    }
+    
+    for (i = 0; i < count; i++) {
+        threads[i].config = &config;
+        threads[i].role = i < config.producers ? BENCH_PRODUCER :
+                          i < config.producers + config.consumers ? BENCH_CONSUMER : BENCH_MIXED;
+        threads[i].cpu = config.cpu_count ? config.cpus[i % config.cpu_count] : -1;
+        threads[i].rate = config.rate / count;
+        threads[i].phase = &phase;
+        if (pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i]) != 0) {
+            fprintf(stderr, "Error: Cannot start thread %d\n", i);
+            __atomic_store_n(&phase, BENCH_STOP, __ATOMIC_RELAXED);
+            count = i;
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    
+    if (status == EXIT_SUCCESS) {
+        pause.tv_sec = (time_t)config.warmup;
+        pause.tv_nsec = (long)((config.warmup - (double)pause.tv_sec) * 1e9);
+        nanosleep(&pause, NULL);
+        __atomic_store_n(&phase, BENCH_MEASURE, __ATOMIC_RELAXED);
+    }
+    started = now_ns();
+    
+    if (status == EXIT_SUCCESS) {
+        pause.tv_sec = (time_t)config.duration;
+        pause.tv_nsec = (long)((config.duration - (double)pause.tv_sec) * 1e9);
+        nanosleep(&pause, NULL);
+    }
+    __atomic_store_n(&phase, BENCH_STOP, __ATOMIC_RELAXED);
+    stopped = now_ns();
+    
+    memset(totals, 0, sizeof(totals));
+    for (i = 0; i < count; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (kind = 0; kind < 2; kind++) {
+            totals[kind].calls += threads[i].counts[kind].calls;
+            totals[kind].elements += threads[i].counts[kind].elements;
+            totals[kind].misses += threads[i].counts[kind].misses;
+            hist_merge(&totals[kind].latency, &threads[i].counts[kind].latency);
+        }
+        if (threads[i].error && status == EXIT_SUCCESS) {
+            errno = threads[i].error;
+            if (errno == ENODEV) {
+                fprintf(stderr, "Error: USB key not inserted\n");
+                status = EXIT_USB_ERROR;
+            } else {
+                fprintf(stderr, "Error: Benchmark thread failed: %s\n", strerror(errno));
+                status = EXIT_IO_ERROR;
+            }
+        }
+    }
+    free(threads);
+    
+    if (status == EXIT_SUCCESS) {
+        if (config.json)
+            print_bench_json(&config, totals, (stopped - started) / 1e9);
+        else
+            print_bench_text(&config, totals, (stopped - started) / 1e9);
+    }
+    
+    return status;
+}
@@ -0,0 +1,106 @@
+#!/bin/sh
+# Emulate the USB key with dummy_hcd and a FunctionFS gadget, so the module
+# can be exercised without hardware. Run as root from lab5 after `make gadget`.
+#
+#   scripts/dummy_key.sh up       create the gadget and plug it in
+#   scripts/dummy_key.sh unplug   detach it from the bus (pen_disconnect)
+#   scripts/dummy_key.sh plug     attach it again (pen_probe)
+#   scripts/dummy_key.sh down     unplug and remove the gadget
+#
+# VID, PID and SERIAL select the descriptors (defaults match the module);
+# keys with different serials are separate gadgets, each on a free UDC.
+# KEY=journal (default) runs gadget/journal_key with JOURNAL as the file
+# backing the key's journal; KEY=samples runs gadget/sample_key, streaming
+# RATE samples/s (0 = as fast as possible) on a bulk or, with
+# ENDPOINT=interrupt, an interrupt IN endpoint.
+
+set -e
+
+VID=${VID:-0x1234}
+PID=${PID:-0x5678}
+SERIAL=${SERIAL:-0001}
+KEY=${KEY:-journal}
+JOURNAL=${JOURNAL:-/var/tmp/int_stack_key_$SERIAL.journal}
+RATE=${RATE:-0}
+ENDPOINT=${ENDPOINT:-bulk}
+
+INSTANCE=key_$SERIAL
+GADGET=/sys/kernel/config/usb_gadget/int_stack_$INSTANCE
+FFS=/dev/ffs-int_stack_$INSTANCE
+PIDFILE=/run/int_stack_$INSTANCE.pid
+
+plug() {
+    for udc in $(ls /sys/class/udc); do
+        if ! cat /sys/kernel/config/usb_gadget/*/UDC 2>/dev/null | grep -qx "$udc"; then
+            echo "$udc" > "$GADGET/UDC"
+            return
+        fi
+    done
+    echo "no free UDC, load dummy_hcd with a larger num=" >&2
+    exit 1
+}
+
+unplug() {
+    [ -e "$GADGET/UDC" ] && echo "" > "$GADGET/UDC" || true
+}
+
+case "$1" in
+up)
+    modprobe dummy_hcd num=4
+    modprobe libcomposite
+    modprobe usb_f_fs
+    mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+    mkdir -p "$GADGET"
+    echo "$VID" > "$GADGET/idVendor"
+    echo "$PID" > "$GADGET/idProduct"
+    mkdir -p "$GADGET/strings/0x409"
+    echo "int_stack" > "$GADGET/strings/0x409/manufacturer"
+    echo "int_stack key" > "$GADGET/strings/0x409/product"
+    echo "$SERIAL" > "$GADGET/strings/0x409/serialnumber"
+    mkdir -p "$GADGET/configs/c.1" "$GADGET/functions/ffs.$INSTANCE"
+    [ -e "$GADGET/configs/c.1/ffs.$INSTANCE" ] || ln -s "$GADGET/functions/ffs.$INSTANCE" "$GADGET/configs/c.1/"
+
+    mkdir -p "$FFS"
+    mountpoint -q "$FFS" || mount -t functionfs "$INSTANCE" "$FFS"
+    case "$KEY" in
+    journal)
+        ./gadget/journal_key "$FFS" "$JOURNAL" &
+        LAST_EP=ep2
+        ;;
+    samples)
+        ./gadget/sample_key "$FFS" "$RATE" "$ENDPOINT" &
+        LAST_EP=ep1
+        ;;
+    *)
+        echo "unknown KEY $KEY" >&2
+        exit 1
+        ;;
+    esac
+    echo $! > "$PIDFILE"
+
+    # The UDC can only be bound once the daemon has written its descriptors
+    while [ ! -e "$FFS/$LAST_EP" ]; do
+        sleep 0.1
+    done
+    plug
+    ;;
+plug)
+    plug
+    ;;
+unplug)
+    unplug
+    ;;
+down)
+    unplug
+    [ -f "$PIDFILE" ] && kill "$(cat "$PIDFILE")" && rm -f "$PIDFILE"
+    umount "$FFS" 2>/dev/null || true
+    rm -f "$GADGET/configs/c.1/ffs.$INSTANCE"
+    rmdir "$GADGET/configs/c.1" "$GADGET/functions/ffs.$INSTANCE" \
+          "$GADGET/strings/0x409" "$GADGET" 2>/dev/null || true
+    ;;
+*)
+    echo "usage: $0 up|plug|unplug|down" >&2
+    exit 1
+    ;;
+esac
@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+"""Measure how int_stack behaves while its USB key is plugged in and out.
+
+The key is the dummy_hcd gadget of scripts/dummy_key.sh, created with the
+usb_vid/usb_pid the loaded module matches. Load generator threads push and
+pop on the key's device node while the main thread detaches and attaches
+the gadget from its UDC at a fixed rate. Run as root from lab5:
+
+    make gadget
+    sudo insmod int_stack.ko
+    sudo ./scripts/hotplug_churn.py --rate 2 --cycles 20 --workers 4
+
+The report has the time from binding the UDC to the device node appearing
+(which covers enumeration, pen_probe and the node registration work) and
+to the first successful ioctl on it, the time from unbinding to the node
+disappearing, op errors by errno and, for every transition, the throughput
+in the following window relative to the steady-state median. --csv writes
+the per-bucket timeline with the transitions marked.
+"""
+
+import argparse
+import errno
+import fcntl
+import os
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+PARAMETERS = '/sys/module/int_stack/parameters'
+GADGET = '/sys/kernel/config/usb_gadget/int_stack_key_%s'
+
+CMD_GET_USAGE = 0x80047303  # _IOR('s', 3, int)
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    index = min(len(sorted_values) - 1, int(len(sorted_values) * pct / 100.0))
+    return sorted_values[index]
+
+
+def read_param(name):
+    with open(os.path.join(PARAMETERS, name)) as f:
+        return int(f.read())
+
+
+def dummy_key(action, serial):
+    env = dict(os.environ, SERIAL=serial,
+               VID='0x%04x' % read_param('usb_vid'),
+               PID='0x%04x' % read_param('usb_pid'))
+    subprocess.check_call([os.path.join(SCRIPT_DIR, 'dummy_key.sh'), action],
+                          cwd=os.path.dirname(SCRIPT_DIR), env=env)
+
+
+def wait_for(predicate, timeout):
+    """Polls predicate every 100us, returns the seconds it took or None"""
+    start = time.monotonic()
+    while not predicate():
+        if time.monotonic() - start > timeout:
+            return None
+        time.sleep(0.0001)
+    return time.monotonic() - start
+
+
+def node_ready(path):
+    try:
+        fd = os.open(path, os.O_RDWR | os.O_NONBLOCK)
+    except OSError:
+        return False
+    try:
+        fcntl.ioctl(fd, CMD_GET_USAGE, b'\0' * 4)
+        return True
+    except OSError:
+        return False
+    finally:
+        os.close(fd)
+
+
+class Worker(threading.Thread):
+    """Pushes a value and pops it back, counting ops and errors per bucket"""
+
+    def __init__(self, path, start, bucket, buckets):
+        threading.Thread.__init__(self, daemon=True)
+        self.path = path
+        self.start_time = start
+        self.bucket = bucket
+        self.ops = [0] * buckets
+        self.errors = [0] * buckets
+        self.errnos = {}
+        self.stop = False
+
+    def fail(self, err):
+        index = int((time.monotonic() - self.start_time) / self.bucket)
+        if index < len(self.errors):
+            self.errors[index] += 1
+        self.errnos[err.errno] = self.errnos.get(err.errno, 0) + 1
+
+    def run(self):
+        value = struct.pack('i', threading.get_ident() & 0x7fffffff)
+        fd = -1
+        while not self.stop:
+            if fd < 0:
+                try:
+                    fd = os.open(self.path, os.O_RDWR)
+                except OSError as err:
+                    self.fail(err)
+                    time.sleep(0.001)
+                    continue
+            try:
+                os.write(fd, value)
+                os.read(fd, 4)
+            except OSError as err:
+                self.fail(err)
+                if err.errno in (errno.ENODEV, errno.ENOENT):
+                    os.close(fd)
+                    fd = -1
+                continue
+
+            index = int((time.monotonic() - self.start_time) / self.bucket)
+            if index < len(self.ops):
+                self.ops[index] += 2
+        if fd >= 0:
+            os.close(fd)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--serial', default='0001')
+    parser.add_argument('--device', help='node to load (default /dev/int_stack-SERIAL)')
+    parser.add_argument('--rate', type=float, default=1.0, help='plug/unplug cycles per second')
+    parser.add_argument('--down-ms', type=float, help='time unplugged per cycle (default half a cycle)')
+    parser.add_argument('--cycles', type=int, default=10)
+    parser.add_argument('--workers', type=int, default=2)
+    parser.add_argument('--warmup-ms', type=float, default=1000)
+    parser.add_argument('--bucket-ms', type=float, default=10)
+    parser.add_argument('--window-ms', type=float, default=200,
+                        help='span after each transition that counts as its dip')
+    parser.add_argument('--timeout', type=float, default=5.0, help='seconds to wait for the node')
+    parser.add_argument('--setup', action='store_true',
+                        help='run dummy_key.sh up before and down after the run')
+    parser.add_argument('--csv', help='write the per-bucket timeline here')
+    args = parser.parse_args()
+
+    period = 1.0 / args.rate
+    down = args.down_ms / 1000.0 if args.down_ms is not None else period / 2
+    if down >= period:
+        sys.exit('--down-ms must be shorter than a cycle')
+    path = args.device or '/dev/int_stack-%s' % args.serial
+    udc_file = os.path.join(GADGET % args.serial, 'UDC')
+    bucket = args.bucket_ms / 1000.0
+
+    if args.setup:
+        dummy_key('up', args.serial)
+    try:
+        with open(udc_file) as f:
+            udc = f.read().strip()
+    except OSError:
+        sys.exit('no gadget for serial %s, run with --setup or scripts/dummy_key.sh up' % args.serial)
+    if not udc:
+        sys.exit('gadget %s is not plugged in' % args.serial)
+    if wait_for(lambda: node_ready(path), args.timeout) is None:
+        sys.exit('%s did not appear' % path)
+
+    duration = args.warmup_ms / 1000.0 + args.cycles * period + args.window_ms / 1000.0
+    buckets = int(duration / bucket) + 1
+    start = time.monotonic()
+    workers = [Worker(path, start, bucket, buckets) for _ in range(args.workers)]
+    for worker in workers:
+        worker.start()
+
+    transitions = []  # (time, 'detach' | 'attach', cycle)
+    to_dev, to_ready, to_gone = [], [], []
+    time.sleep(args.warmup_ms / 1000.0)
+    try:
+        for cycle in range(args.cycles):
+            cycle_start = time.monotonic()
+            transitions.append((cycle_start - start, 'detach', cycle))
+            with open(udc_file, 'w') as f:
+                f.write('\n')
+            # With removal_grace_ms the node outlives the cycle, which is the point
+            gone = wait_for(lambda: not os.path.exists(path), down)
+            if gone is not None:
+                to_gone.append(gone * 1000)
+
+            time.sleep(max(0.0, cycle_start + down - time.monotonic()))
+            attach = time.monotonic()
+            transitions.append((attach - start, 'attach', cycle))
+            with open(udc_file, 'w') as f:
+                f.write(udc + '\n')
+            appeared = wait_for(lambda: os.path.exists(path), args.timeout)
+            ready = wait_for(lambda: node_ready(path), args.timeout)
+            if appeared is None or ready is None:
+                sys.stderr.write('cycle %d: %s did not come back\n' % (cycle, path))
+                continue
+            to_dev.append(appeared * 1000)
+            to_ready.append((time.monotonic() - attach) * 1000)
+
+            time.sleep(max(0.0, cycle_start + period - time.monotonic()))
+        time.sleep(args.window_ms / 1000.0)
+    finally:
+        for worker in workers:
+            worker.stop = True
+        for worker in workers:
+            worker.join()
+        if args.setup:
+            dummy_key('down', args.serial)
+
+    elapsed = min(buckets, int((time.monotonic() - start) / bucket))
+    ops = [sum(w.ops[i] for w in workers) for i in range(elapsed)]
+    errors = [sum(w.errors[i] for w in workers) for i in range(elapsed)]
+    errnos = {}
+    for worker in workers:
+        for code, count in worker.errnos.items():
+            errnos[code] = errnos.get(code, 0) + count
+
+    # Steady state is every bucket at least a window away from a transition
+    window = int(args.window_ms / args.bucket_ms)
+    disturbed = set()
+    for when, _, _ in transitions:
+        first = int(when / bucket)
+        disturbed.update(range(first - 1, first + window + 1))
+    warmup = int(args.warmup_ms / args.bucket_ms)
+    steady = sorted(ops[i] for i in range(warmup // 2, elapsed) if i not in disturbed)
+    baseline = percentile(steady, 50)
+
+    print('%d cycles at %.2f/s, %.0f ms unplugged, %d workers, %s' % (
+        args.cycles, args.rate, down * 1000, args.workers, path))
+    for name, values in (('attach -> /dev', to_dev), ('attach -> first op', to_ready),
+                         ('detach -> node gone', to_gone)):
+        values.sort()
+        if values:
+            print('%-20s n=%-4d p50=%.2fms p99=%.2fms max=%.2fms' % (
+                name, len(values), percentile(values, 50),
+                percentile(values, 99), values[-1]))
+        else:
+            print('%-20s n=0' % name)
+
+    total_ops, total_errors = sum(ops), sum(errors)
+    print('ops %d, errors %d (%.3f%%), steady state %.0f ops/s' % (
+        total_ops, total_errors,
+        100.0 * total_errors / max(1, total_ops + total_errors), baseline / bucket))
+    for code in sorted(errnos):
+        print('  %-8s %d' % (errno.errorcode.get(code, str(code)), errnos[code]))
+
+    print('transition  cycle  throughput  min bucket  recovery_ms  errors')
+    for when, kind, cycle in transitions:
+        first = int(when / bucket)
+        span = ops[first:first + window]
+        if not span or not baseline:
+            continue
+        recovery = ''
+        for i, count in enumerate(span):
+            if count >= 0.9 * baseline:
+                recovery = '%.0f' % (i * args.bucket_ms)
+                break
+        print('%-10s  %5d  %9.1f%%  %9.1f%%  %11s  %6d' % (
+            kind, cycle, 100.0 * sum(span) / (baseline * len(span)),
+            100.0 * min(span) / baseline, recovery or '>%.0f' % args.window_ms,
+            sum(errors[first:first + window])))
+
+    if args.csv:
+        marks = dict((int(when / bucket), kind) for when, kind, _ in transitions)
+        with open(args.csv, 'w') as f:
+            f.write('time_s,ops,errors,event\n')
+            for i in range(elapsed):
+                f.write('%.3f,%d,%d,%s\n' % (i * bucket, ops[i], errors[i], marks.get(i, '')))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Build a latency and depth timeline from int_stack tracepoints.
+
+Record the module's events together with the syscall entries that lead to
+them, then feed the text report on stdin:
+
+    sudo perf record -a -e 'int_stack:*' \
+        -e syscalls:sys_enter_read -e syscalls:sys_enter_write \
+        -e syscalls:sys_enter_ioctl -- sleep 10
+    sudo perf script | ./scripts/stack_timeline.py > timeline.csv
+
+`trace-cmd record -e int_stack -e syscalls:sys_enter_read ...` followed by
+`trace-cmd report` works the same way.
+
+The CSV has one row per stack event. Latency is measured from the syscall
+entry of the same thread to the tracepoint, so it covers copy_from_user,
+op_lock wait and the operation itself. A per-event summary goes to stderr.
+"""
+
+import re
+import sys
+
+LINE_RE = re.compile(
+    r'^\s*(?P<comm>.*?)[\s-](?P<tid>\d+)\s+\[(?P<cpu>\d+)\]\s+(?:\S+\s+)?'
+    r'(?P<ts>\d+\.\d+):\s+(?:\w+:)?(?P<event>\w+):\s*(?P<fields>.*)$')
+FIELD_RE = re.compile(r'(\w+)=(-?\d+)')
+
+SYSCALL_ENTRIES = ('sys_enter_read', 'sys_enter_write', 'sys_enter_ioctl')
+STACK_EVENTS = ('int_stack_push', 'int_stack_pop', 'int_stack_overflow',
+                'int_stack_underflow', 'int_stack_clear', 'int_stack_resize')
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    index = min(len(sorted_values) - 1, int(len(sorted_values) * pct / 100.0))
+    return sorted_values[index]
+
+
+def main():
+    pending = {}
+    latencies = {}
+    max_depth = {}
+
+    print('time_s,id,event,pid,depth,latency_us,value,copy_ns')
+    for line in sys.stdin:
+        match = LINE_RE.match(line)
+        if not match:
+            continue
+
+        event = match.group('event')
+        tid = int(match.group('tid'))
+        ts = float(match.group('ts'))
+
+        if event in SYSCALL_ENTRIES:
+            pending[tid] = ts
+            continue
+        if event not in STACK_EVENTS:
+            continue
+
+        fields = dict((k, int(v)) for k, v in FIELD_RE.findall(match.group('fields')))
+        stack_id = fields.get('id', 0)
+        depth = fields.get('depth', 0)
+        pid = fields.get('pid', tid)
+
+        latency = ''
+        start = pending.pop(tid, None)
+        if start is not None and event != 'int_stack_resize':
+            latency_us = (ts - start) * 1e6
+            latency = '%.3f' % latency_us
+            latencies.setdefault(event, []).append(latency_us)
+        elif start is not None:
+            # resize fires inside a push or ioctl, keep the entry for it
+            pending[tid] = start
+
+        max_depth[stack_id] = max(max_depth.get(stack_id, 0), depth)
+        print('%.6f,%d,%s,%d,%d,%s,%s,%s' % (
+            ts, stack_id, event[len('int_stack_'):], pid, depth, latency,
+            fields.get('value', ''), fields.get('copy_ns', '')))
+
+    for event in sorted(latencies):
+        values = sorted(latencies[event])
+        sys.stderr.write('%-20s n=%-8d p50=%.2fus p99=%.2fus max=%.2fus\n' % (
+            event, len(values), percentile(values, 50),
+            percentile(values, 99), values[-1]))
+    for stack_id in sorted(max_depth):
+        sys.stderr.write('stack %d max depth %d\n' % (stack_id, max_depth[stack_id]))
+
+
+if __name__ == '__main__':
+    main()